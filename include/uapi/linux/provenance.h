@@ -29,6 +29,7 @@
 #endif
 #include <linux/limits.h>
 #include <linux/utsname.h>
+#include <linux/provenance_types.h>
 
 #define xstr(s)         str(s)
 #define str(s)          # s
@@ -64,6 +65,11 @@
 #define prov_flag(prov)                         ((prov)->msg_info.internal_flag)
 #define prov_taint(prov)                        ((prov)->msg_info.taint)
 #define prov_jiffies(prov)                      ((prov)->msg_info.jiffies)
+/* monotonic time (ns) and per-CPU sequence number at which the element was
+ * written to the relay; elements of a per-CPU relay file are in (ts, seq)
+ * order */
+#define prov_ts(prov)                           ((prov)->msg_info.ts)
+#define prov_seq(prov)                          ((prov)->msg_info.seq)
 
 #define provenance_taint_merge(dest, src) dest = (dest) | (src)
 
@@ -143,7 +149,8 @@ union prov_identifier {
 
 
 
-#define basic_elements          union prov_identifier identifier; uint32_t epoch; uint32_t nepoch; uint32_t internal_flag; uint64_t jiffies; uint64_t taint
+#define basic_elements          union prov_identifier identifier; uint32_t epoch; uint32_t nepoch; uint32_t internal_flag; uint64_t jiffies; uint64_t taint; uint64_t ts; uint64_t seq
+#define relation_elements       uint8_t allowed; union prov_identifier snd; union prov_identifier rcv; uint8_t set; int64_t offset; uint64_t flags; uint64_t task_id
 #define shared_node_elements    uint64_t previous_id; uint32_t previous_version; uint64_t previous_type; uint32_t k_version; uint32_t secid; uint32_t uid; uint32_t gid; void *var_ptr
 
 struct msg_struct {
@@ -154,13 +161,22 @@ struct msg_struct {
 
 struct relation_struct {
 	basic_elements;
-	uint8_t allowed;
-	union prov_identifier snd;
-	union prov_identifier rcv;
-	uint8_t set;
-	int64_t offset;
-	uint64_t flags;
-	uint64_t task_id;
+	relation_elements;
+};
+
+/*
+ * Aggregate of repeated reads or writes (see PROV_AGGREGATE_FILE).
+ * Its type is the type of the relation with RL_AGGREGATE set; count identical
+ * relations were seen after the last one recorded, the first and last at
+ * first and last (real time), moving the file offset by bytes in total.
+ */
+struct aggregate_struct {
+	basic_elements;
+	relation_elements;
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t first;
+	uint64_t last;
 };
 
 struct node_struct {
@@ -244,6 +260,45 @@ struct pck_struct {
 	uint16_t len;
 };
 
+/* a node delta carries at most this many words */
+#define PROV_DELTA_WORDS        19
+/* number of words of a regular node following its basic elements */
+#define PROV_DELTA_SPAN         ((sizeof(union prov_elt) - \
+				  sizeof(struct msg_struct)) / sizeof(uint64_t))
+
+/*
+ * Version of a regular node recorded as the difference with a previous
+ * version of the same node.
+ * Its type is the type of the node with ND_DELTA set, the basic elements are
+ * those of the new version.
+ * Bit i of mask is set if the i-th 64 bits word following the basic elements
+ * of the node differs from version base_version; changed words follow in
+ * order.
+ * Deltas are not written with relay compression, nor while a channel uses
+ * PROV_RELAY_OVERWRITE; deltas written before that policy was selected may
+ * be based on versions that were overwritten.
+ */
+struct node_delta_struct {
+	basic_elements;
+	uint32_t base_version;
+	uint32_t mask;
+	uint64_t words[PROV_DELTA_WORDS];
+};
+
+/*
+ * Relations suppressed by a rate limit (see struct prov_rate) since the last
+ * report; task_id is set if they were suppressed by the limit of the task,
+ * relation_type and cpu otherwise.
+ */
+struct suppressed_struct {
+	basic_elements;
+	shared_node_elements;
+	uint64_t relation_type;
+	uint64_t count;
+	uint64_t task_id;
+	uint32_t cpu;
+};
+
 union prov_elt {
 	struct msg_struct msg_info;
 	struct relation_struct relation_info;
@@ -256,6 +311,9 @@ union prov_elt {
 	struct sb_struct sb_info;
 	struct pck_struct pck_info;
 	struct iattr_prov_struct iattr_info;
+	struct node_delta_struct delta_info;
+	struct suppressed_struct suppressed_info;
+	struct aggregate_struct aggregate_info;
 };
 
 struct str_struct {
@@ -323,6 +381,10 @@ struct machine_struct {
 	uint8_t cam_patch;
 	struct new_utsname utsname;
 	char commit[PROV_COMMIT_MAX_LENGTH];
+	/* node and relation ids are handed out by each CPU from blocks of
+	 * id_block ids; if greater than 1, ids are unique but their order does
+	 * not reflect the order in which elements were created */
+	uint32_t id_block;
 };
 
 union long_prov_elt {
@@ -337,6 +399,8 @@ union long_prov_elt {
 	struct sb_struct sb_info;
 	struct pck_struct pck_info;
 	struct iattr_prov_struct iattr_info;
+	struct node_delta_struct delta_info;
+	struct aggregate_struct aggregate_info;
 	struct str_struct str_info;
 	struct file_name_struct file_name_info;
 	struct arg_struct arg_info;
@@ -348,4 +412,313 @@ union long_prov_elt {
 };
 
 typedef union long_prov_elt prov_entry_t;
+
+/*
+ * Rebuild a node from a delta record and the content of the node at version
+ * base_version.
+ * node must hold base_version on entry, it holds the new version on return.
+ */
+static inline void prov_delta_apply(const struct node_delta_struct *delta,
+				    union prov_elt *node)
+{
+	uint8_t *words = (uint8_t *)node + sizeof(struct msg_struct);
+	unsigned int i, n = 0;
+
+	memcpy(node, delta, sizeof(struct msg_struct));
+	node->msg_info.identifier.node_id.type &= ~ND_DELTA;
+	for (i = 0; i < PROV_DELTA_SPAN && n < PROV_DELTA_WORDS; i++) {
+		if (!(delta->mask & (1U << i)))
+			continue;
+		memcpy(words + i * sizeof(uint64_t), &delta->words[n++],
+		       sizeof(uint64_t));
+	}
+}
+
+#define PROV_WIRE_FIXED                 0
+#define PROV_WIRE_VARLEN                1
+#define PROV_WIRE_COMPACT               2
+#define PROV_WIRE_MAX                   PROV_WIRE_COMPACT
+
+#define PROV_WIRE_VERSION               1
+#define PROV_WIRE_ALIGN                 8
+
+#define PROV_WIRE_MARKER_MAGIC          0x52495750 /* "PWIR" */
+
+/*
+ * The wire format can be changed at runtime, streams are in PROV_WIRE_FIXED
+ * format until a prov_wire_marker gives the format of the records following
+ * it. Every relay sub-buffer in another format starts with a marker, as does
+ * a sub-buffer following one in another format; in NUMA node files, a marker
+ * precedes each record in another format than the previous record.
+ * The magic never matches the start of a record in any format, readers check
+ * for it before parsing each record.
+ */
+struct prov_wire_marker {
+	uint32_t magic;
+	uint32_t format;
+};
+
+/*
+ * In PROV_WIRE_VARLEN format each relay record is a prov_wire_header
+ * followed by the first var_offset bytes of the element, var_length bytes
+ * of its variable-length field (to be placed at var_offset) and tail_length
+ * bytes (to be placed at tail_offset).
+ * Bytes that are not transmitted are zero.
+ * size is the total length of the record, header and padding included.
+ */
+struct prov_wire_header {
+	uint16_t version;
+	uint16_t size;
+	uint16_t var_offset;
+	uint16_t var_length;
+	uint16_t tail_offset;
+	uint16_t tail_length;
+	uint32_t reserved;
+};
+
+static inline void prov_wire_decode(const struct prov_wire_header *hdr,
+				    prov_entry_t *out)
+{
+	const uint8_t *src = (const uint8_t *)(hdr + 1);
+	uint8_t *dst = (uint8_t *)out;
+
+	memset(out, 0, sizeof(prov_entry_t));
+	memcpy(dst, src, hdr->var_offset);
+	src += hdr->var_offset;
+	memcpy(dst + hdr->var_offset, src, hdr->var_length);
+	src += hdr->var_length;
+	memcpy(dst + hdr->tail_offset, src, hdr->tail_length);
+}
+
+#define PROV_COMPACT_MAGIC              0x504d4350 /* "PCMP" */
+
+#define PROV_COMPACT_NODE               1
+#define PROV_COMPACT_RELATION           2
+
+/* the record does not depend on, nor update, the stream state */
+#define PROV_COMPACT_ABSOLUTE           0x01
+
+/* identifier tags */
+#define PROV_COMPACT_ID_FOREIGN         0x01 /* boot_id and machine_id follow */
+#define PROV_COMPACT_ID_RAW             0x02 /* the whole identifier follows */
+
+/*
+ * In PROV_WIRE_COMPACT format, each relay sub-buffer starts, after its
+ * prov_wire_marker, with a prov_compact_subbuf header carrying the identity of the machine, followed
+ * by records, each a prov_compact_header followed by size - 4 bytes.
+ * The header magic never matches a valid record header.
+ *
+ * Integers are unsigned LEB128 varints, deltas are zigzag encoded varints.
+ * An identifier is a tag byte and its 8 bytes type followed, unless RAW, by
+ * the delta of its id against the previous id of the same kind (node or
+ * relation) in the sub-buffer and its version.
+ * A record is made of:
+ * - the identifier of the element;
+ * - epoch, nepoch, internal_flag, jiffies and taint;
+ * - the delta of ts and seq against the previous record;
+ * - for relations: snd and rcv identifiers (as nodes), allowed and set (one
+ *   byte each), offset (zigzag), flags and task_id, followed for aggregates
+ *   by count, bytes, first and last;
+ * - for nodes: var_offset, var_length, tail_offset and tail_length, followed
+ *   by the element bytes between the end of the basic elements and
+ *   var_offset, var_length bytes to be placed at var_offset and tail_length
+ *   bytes to be placed at tail_offset.
+ * Deltas are reset at the start of each sub-buffer.
+ * ABSOLUTE records (e.g., records that were held in memory while the relay
+ * was full) are encoded against a zero state and carry their own identity.
+ */
+struct prov_compact_subbuf {
+	uint32_t magic;
+	uint32_t machine_id;
+	uint32_t boot_id;
+	uint32_t cpu;
+};
+
+struct prov_compact_header {
+	uint16_t size;
+	uint8_t kind;
+	uint8_t flags;
+};
+
+struct prov_compact_stream {
+	uint32_t machine_id;
+	uint32_t boot_id;
+	uint64_t node_id;
+	uint64_t relation_id;
+	uint64_t ts;
+	uint64_t seq;
+};
+
+struct prov_compact_cursor {
+	const uint8_t *p;
+	const uint8_t *end;
+	int error;
+};
+
+static inline uint64_t prov_compact_varint(struct prov_compact_cursor *c)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	while (c->p < c->end && shift < 64) {
+		v |= (uint64_t)(*c->p & 0x7f) << shift;
+		if (!(*c->p++ & 0x80))
+			return v;
+		shift += 7;
+	}
+	c->error = 1;
+	return 0;
+}
+
+static inline int64_t prov_compact_zigzag(struct prov_compact_cursor *c)
+{
+	uint64_t v = prov_compact_varint(c);
+
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline void prov_compact_raw(struct prov_compact_cursor *c,
+				    void *dst, size_t len)
+{
+	if ((size_t)(c->end - c->p) < len) {
+		c->error = 1;
+		return;
+	}
+	memcpy(dst, c->p, len);
+	c->p += len;
+}
+
+static inline void prov_compact_id(struct prov_compact_cursor *c,
+				   union prov_identifier *id,
+				   const struct prov_compact_stream *s,
+				   uint64_t *prev)
+{
+	uint8_t tag = 0;
+
+	prov_compact_raw(c, &tag, 1);
+	if (tag & PROV_COMPACT_ID_RAW) {
+		prov_compact_raw(c, id, sizeof(union prov_identifier));
+		return;
+	}
+	prov_compact_raw(c, &id->node_id.type, sizeof(uint64_t));
+	id->node_id.id = *prev + prov_compact_zigzag(c);
+	*prev = id->node_id.id;
+	id->node_id.version = prov_compact_varint(c);
+	if (tag & PROV_COMPACT_ID_FOREIGN) {
+		id->node_id.boot_id = prov_compact_varint(c);
+		id->node_id.machine_id = prov_compact_varint(c);
+	} else {
+		id->node_id.boot_id = s->boot_id;
+		id->node_id.machine_id = s->machine_id;
+	}
+}
+
+/*
+ * Decode the record or sub-buffer header at the start of buf.
+ * Returns the number of bytes consumed, 0 if buf does not hold a complete
+ * record, or -1 if the data is corrupted.
+ * *decoded is set to 1 if out holds an element, 0 for a sub-buffer header.
+ */
+static inline int prov_compact_decode(const uint8_t *buf, size_t len,
+				      struct prov_compact_stream *stream,
+				      prov_entry_t *out, int *decoded)
+{
+	struct prov_compact_stream zero, *s = stream;
+	struct prov_compact_subbuf sb;
+	struct prov_compact_header h;
+	struct prov_compact_cursor c;
+	uint16_t var_offset, var_length, tail_offset, tail_length;
+	size_t start = sizeof(struct msg_struct);
+
+	*decoded = 0;
+	if (len < sizeof(struct prov_compact_header))
+		return 0;
+	memcpy(&sb.magic, buf, sizeof(uint32_t));
+	if (sb.magic == PROV_COMPACT_MAGIC) {
+		if (len < sizeof(struct prov_compact_subbuf))
+			return 0;
+		memcpy(&sb, buf, sizeof(struct prov_compact_subbuf));
+		memset(stream, 0, sizeof(struct prov_compact_stream));
+		stream->machine_id = sb.machine_id;
+		stream->boot_id = sb.boot_id;
+		return sizeof(struct prov_compact_subbuf);
+	}
+	memcpy(&h, buf, sizeof(struct prov_compact_header));
+	if (h.size < sizeof(struct prov_compact_header) ||
+	    (h.kind != PROV_COMPACT_NODE && h.kind != PROV_COMPACT_RELATION))
+		return -1;
+	if (len < h.size)
+		return 0;
+	if (h.flags & PROV_COMPACT_ABSOLUTE) {
+		memset(&zero, 0, sizeof(struct prov_compact_stream));
+		s = &zero;
+	}
+
+	c.p = buf + sizeof(struct prov_compact_header);
+	c.end = buf + h.size;
+	c.error = 0;
+	memset(out, 0, sizeof(prov_entry_t));
+	prov_compact_id(&c, &out->msg_info.identifier, s,
+			h.kind == PROV_COMPACT_RELATION ?
+			&s->relation_id : &s->node_id);
+	out->msg_info.epoch = prov_compact_varint(&c);
+	out->msg_info.nepoch = prov_compact_varint(&c);
+	out->msg_info.internal_flag = prov_compact_varint(&c);
+	out->msg_info.jiffies = prov_compact_varint(&c);
+	out->msg_info.taint = prov_compact_varint(&c);
+	s->ts += prov_compact_zigzag(&c);
+	out->msg_info.ts = s->ts;
+	s->seq += prov_compact_zigzag(&c);
+	out->msg_info.seq = s->seq;
+	if (h.kind == PROV_COMPACT_RELATION) {
+		prov_compact_id(&c, &out->relation_info.snd, s, &s->node_id);
+		prov_compact_id(&c, &out->relation_info.rcv, s, &s->node_id);
+		prov_compact_raw(&c, &out->relation_info.allowed, 1);
+		prov_compact_raw(&c, &out->relation_info.set, 1);
+		out->relation_info.offset = prov_compact_zigzag(&c);
+		out->relation_info.flags = prov_compact_varint(&c);
+		out->relation_info.task_id = prov_compact_varint(&c);
+		if (prov_type_is_aggregate(prov_type(out))) {
+			out->aggregate_info.count = prov_compact_varint(&c);
+			out->aggregate_info.bytes = prov_compact_varint(&c);
+			out->aggregate_info.first = prov_compact_varint(&c);
+			out->aggregate_info.last = prov_compact_varint(&c);
+		}
+	} else {
+		var_offset = prov_compact_varint(&c);
+		var_length = prov_compact_varint(&c);
+		tail_offset = prov_compact_varint(&c);
+		tail_length = prov_compact_varint(&c);
+		if (var_offset < start ||
+		    var_offset + var_length > sizeof(prov_entry_t) ||
+		    tail_offset + tail_length > sizeof(prov_entry_t))
+			return -1;
+		prov_compact_raw(&c, (uint8_t *)out + start, var_offset - start);
+		prov_compact_raw(&c, (uint8_t *)out + var_offset, var_length);
+		prov_compact_raw(&c, (uint8_t *)out + tail_offset, tail_length);
+	}
+	if (c.error)
+		return -1;
+	*decoded = 1;
+	return h.size;
+}
+
+#define PROV_LZ4_MAGIC                  0x345a4c50 /* "PLZ4" */
+
+/*
+ * When relay compression is enabled, the "<channel>_lz4" relay files carry a
+ * sequence of frames, each a prov_lz4_frame followed by compressed_size bytes
+ * of an LZ4 block.
+ * Once decompressed, a frame holds the content of one sub-buffer of the
+ * uncompressed channel, i.e., original_size bytes of records.
+ * The uncompressed relay files cannot be opened, and the PROV_RELAY_OVERWRITE
+ * policy cannot be selected: frames that do not fit are dropped and counted
+ * in frames_dropped.
+ */
+struct prov_lz4_frame {
+	uint32_t magic;
+	uint32_t compressed_size;
+	uint32_t original_size;
+	uint32_t reserved;
+};
 #endif
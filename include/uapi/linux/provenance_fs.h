@@ -49,6 +49,7 @@
  #define PROV_LOG_FILE                           "/sys/kernel/security/provenance/log"
  #define PROV_LOGP_FILE                          "/sys/kernel/security/provenance/logp"
  #define PROV_POLICY_HASH_FILE                   "/sys/kernel/security/provenance/policy_hash"
+ #define PROV_POLICY_FILE                        "/sys/kernel/security/provenance/policy"
  #define PROV_UID_FILTER                         "/sys/kernel/security/provenance/uid"
  #define PROV_GID_FILTER                         "/sys/kernel/security/provenance/gid"
  #define PROV_TYPE                               "/sys/kernel/security/provenance/type"
@@ -57,6 +58,16 @@
  #define PROV_DUPLICATE_FILE                     "/sys/kernel/security/provenance/duplicate"
  #define PROV_EPOCH_FILE                         "/sys/kernel/security/provenance/epoch"
  #define PROV_DROPPED_FILE                       "/sys/kernel/security/provenance/dropped"
+ #define PROV_WIRE_FORMAT_FILE                   "/sys/kernel/security/provenance/wire_format"
+ #define PROV_RELAY_POLICY_FILE                  "/sys/kernel/security/provenance/relay_policy"
+ #define PROV_STATS_FILE                         "/sys/kernel/security/provenance/stats"
+ #define PROV_RELAY_SIZE_FILE                    "/sys/kernel/security/provenance/relay_size"
+ #define PROV_CHANNEL_FILE                       "/sys/kernel/security/provenance/channel"
+ #define PROV_CGROUP_FILTER_FILE                 "/sys/kernel/security/provenance/cgroup"
+ #define PROV_RATE_FILE                          "/sys/kernel/security/provenance/rate"
+ #define PROV_EDGE_CACHE_FILE                    "/sys/kernel/security/provenance/edge_cache"
+ #define PROV_BPF_FILTER_FILE                    "/sys/kernel/security/provenance/bpf_filter"
+ #define PROV_AGGREGATE_FILE                     "/sys/kernel/security/provenance/aggregate"
 
  #define PROV_RELAY_NAME                         "/sys/kernel/debug/provenance"
  #define PROV_LONG_RELAY_NAME                    "/sys/kernel/debug/long_provenance"
@@ -74,6 +85,12 @@ struct prov_filter {
  #define PROV_SET_TAINT          0x08
  #define PROV_SET_DELETE         0x10
  #define PROV_SET_RECORD         0x20
+ #define PROV_SET_REPLACE        0x40
+
+/* return values of a BPF record filter attached to prov_bpf_record */
+ #define PROV_BPF_KEEP           0
+ #define PROV_BPF_DROP           1
+ #define PROV_BPF_PROPAGATE      2
 
 struct prov_process_config {
 	union prov_elt prov;
@@ -109,6 +126,13 @@ struct groupinfo {
 	uint64_t taint;
 };
 
+/* a filter on a cgroup v2 id applies to its whole subtree */
+struct cgroupinfo {
+	uint64_t cgroupid;
+	uint8_t op;
+	uint64_t taint;
+};
+
  #define IGNORE_NS    0
 
 struct nsinfo {
@@ -122,8 +146,141 @@ struct nsinfo {
 	uint64_t taint;
 };
 
+/*
+ * A policy blob written to PROV_POLICY_FILE is a header followed by the
+ * filter arrays, in the order of the header counts. The capture flags and all
+ * filters are replaced at once; filter ops may not contain PROV_SET_DELETE or
+ * PROV_SET_REPLACE. Reserved fields must be 0.
+ */
+ #define PROV_POLICY_MAGIC       0x504f4c59
+ #define PROV_POLICY_VERSION     2
+
+struct prov_policy_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size; /* size of the whole blob */
+	uint8_t enabled;
+	uint8_t all;
+	uint8_t compress_node;
+	uint8_t compress_edge;
+	uint8_t duplicate;
+	uint8_t reserved[3];
+	uint64_t node_filter;
+	uint64_t derived_filter;
+	uint64_t generated_filter;
+	uint64_t used_filter;
+	uint64_t informed_filter;
+	uint64_t propagate_node_filter;
+	uint64_t propagate_derived_filter;
+	uint64_t propagate_generated_filter;
+	uint64_t propagate_used_filter;
+	uint64_t propagate_informed_filter;
+	uint32_t nr_ipv4_ingress; /* struct prov_ipv4_filter */
+	uint32_t nr_ipv4_egress; /* struct prov_ipv4_filter */
+	uint32_t nr_ns; /* struct nsinfo */
+	uint32_t nr_secctx; /* struct secinfo */
+	uint32_t nr_uid; /* struct userinfo */
+	uint32_t nr_gid; /* struct groupinfo */
+	uint32_t nr_cgroup; /* struct cgroupinfo */
+	uint32_t reserved2;
+};
+
+/*
+ * Rate limit of the relations of a type, or of each task if type is 0.
+ * Up to burst relations are emitted at once, then rate per second; the
+ * limit of a relation type applies on each CPU. If sample is greater than 1,
+ * only one in sample relations of the type is considered (relation types
+ * only). Writing a limit with a rate and a sample of 0 removes it.
+ * Suppressed relations are reported by ENT_SUPPRESSED nodes.
+ * Relations recorded at most once per object (names, arguments, addresses,
+ * terminations and links to the kernel node) are not limited.
+ */
+struct prov_rate {
+	uint64_t type;
+	uint32_t rate;
+	uint32_t burst;
+	uint32_t sample;
+};
+
+/* lookups of the recent-edge caches used to compress edges */
+struct prov_edge_cache_stats {
+	uint64_t hit;
+	uint64_t miss;
+};
+
 struct dropped {
 	uint64_t s;
 };
 
+ #define PROV_RELAY_DROP         0 /* drop newest elements */
+ #define PROV_RELAY_OVERWRITE    1 /* overwrite oldest elements, not with lz4 */
+ #define PROV_RELAY_BLOCK        2 /* sleepable hooks wait up to block_ms */
+ #define PROV_RELAY_SPILL        3 /* hold up to spill_max bytes in memory */
+
+ #define PROV_CHANNEL_NAME_LEN   64
+
+struct prov_relay_policy {
+	char channel[PROV_CHANNEL_NAME_LEN];
+	uint8_t policy;
+	uint32_t block_ms;
+	uint64_t spill_max;
+};
+
+/*
+ * A channel can only be resized while no reader is attached to it.
+ * In adaptive mode, the number of sub-buffers follows the fill rate observed
+ * while a reader is attached, and is changed once the reader detaches.
+ */
+struct prov_relay_size {
+	char channel[PROV_CHANNEL_NAME_LEN];
+	uint64_t subbuf_size;
+	uint32_t nb_subbuf;
+	uint8_t adaptive;
+};
+
+/*
+ * Writing to the channel file creates the relay channels "provenance_<name>"
+ * and "long_provenance_<name>" or updates their filters.
+ * Each channel receives the elements that pass the global filters and its own.
+ * name is limited to PROV_CHANNEL_USER_LEN characters.
+ */
+ #define PROV_CHANNEL_USER_LEN   47
+
+struct prov_channel_filter {
+	char channel[PROV_CHANNEL_NAME_LEN];
+	uint64_t node_filter;
+	uint64_t derived_filter;
+	uint64_t generated_filter;
+	uint64_t used_filter;
+	uint64_t informed_filter;
+};
+
+/*
+ * The stats file returns a prov_stats_header, followed for each channel by a
+ * prov_channel_stats_header and nr_entries prov_type_stats.
+ * Only types that have been seen on the channel are reported.
+ */
+ #define PROV_STATS_CATEGORIES   7
+ #define PROV_STATS_BITS         48
+
+struct prov_stats_header {
+	uint32_t nr_channels;
+	uint32_t nr_cpus;
+	uint64_t boot_overflow;
+};
+
+struct prov_channel_stats_header {
+	char channel[PROV_CHANNEL_NAME_LEN];
+	uint64_t spill_size;
+	uint64_t frames_dropped; /* compressed frames that did not fit */
+	uint32_t nr_entries;
+};
+
+struct prov_type_stats {
+	uint64_t type;
+	uint64_t emitted;
+	uint64_t bytes;
+	uint64_t dropped;
+};
+
 #endif
@@ -33,6 +33,10 @@
 #define DM_ACTIVITY                             0x4000000000000000UL
 #define DM_ENTITY                               0x2000000000000000UL
 #define DM_AGENT                                0x1000000000000000UL
+/* NODE IS A DELTA AGAINST A PREVIOUS VERSION */
+#define ND_DELTA                                0x0800000000000000UL
+/* RELATION AGGREGATES REPEATED FLOWS (SAME BIT AS ND_DELTA) */
+#define RL_AGGREGATE                            0x0800000000000000UL
 /* NODE IS LONG*/
 #define ND_LONG                                                   0x0400000000000000UL
 /* ALLOWED/DISALLOWED */
@@ -190,6 +194,7 @@
 #define ENT_PACKET                              (DM_ENTITY    | (0x0000000000000001ULL << 17))
 #define ENT_IATTR                               (DM_ENTITY    | (0x0000000000000001ULL << 18))
 #define ENT_PROC                                (DM_ENTITY    | (0x0000000000000001ULL << 19))
+#define ENT_SUPPRESSED                          (DM_ENTITY    | (0x0000000000000001ULL << 28))
 
 /* LONG NODE */
 #define ENT_STR                                 (DM_ENTITY | ND_LONG | (0x0000000000000001ULL << 20))
@@ -213,6 +218,8 @@
 #define prov_type_is_relation(val)      prov_is_type(val, DM_RELATION)
 #define prov_type_is_node(val)          (!prov_is_type(val, DM_RELATION))
 #define prov_type_is_long(val)          (prov_is_type(val, ND_LONG) && prov_type_is_node(val))
+#define prov_type_is_delta(val)         (prov_is_type(val, ND_DELTA) && prov_type_is_node(val))
+#define prov_type_is_aggregate(val)     (prov_is_type(val, RL_AGGREGATE) && prov_type_is_relation(val))
 #define prov_is_used(val)               prov_is_type(val, RL_USED)
 #define prov_is_informed(val)           prov_is_type(val, RL_INFORMED)
 #define prov_is_influenced(val)         prov_is_type(val, RL_INFLUENCED)
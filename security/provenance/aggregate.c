@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/timekeeping.h>
+
+#include "provenance.h"
+#include "provenance_relay.h"
+#include "provenance_aggregate.h"
+
+DEFINE_STATIC_KEY_FALSE(prov_aggregate_key);
+static DEFINE_MUTEX(prov_aggregate_lock);
+/* window in nanoseconds */
+static uint64_t prov_aggregate_window;
+
+static inline struct prov_aggregate *aggregate_flow(
+	struct prov_file_aggregate *fa, const uint64_t type)
+{
+	return &fa->flows[type == RL_WRITE ? PROV_AGGREGATE_WRITE :
+			  PROV_AGGREGATE_READ];
+}
+
+static inline bool aggregate_same_node(const union prov_identifier *a,
+				       const union prov_identifier *b)
+{
+	return a->node_id.id == b->node_id.id &&
+	       a->node_id.version == b->node_id.version;
+}
+
+/*!
+ * @brief Credit the bytes moved by the last coalesced flow of a file.
+ *
+ * Called with the aggregation lock held, before any other flow of the file is
+ * considered.
+ * @param fa The aggregation state of the file.
+ * @param pos The current file offset.
+ *
+ */
+static void aggregate_account(struct prov_file_aggregate *fa, int64_t pos)
+{
+	if (fa->credit && fa->credit->count && pos > fa->pos)
+		fa->credit->bytes += pos - fa->pos;
+	fa->credit = NULL;
+}
+
+/*!
+ * @brief Build the relation summarising the flows coalesced in a window.
+ *
+ * bytes is the advance of the file offset due to the coalesced flows; it is 0
+ * for files accessed without moving their offset (e.g., pread/pwrite or non
+ * seekable files).
+ * Called with the aggregation lock held, once the bytes of the last flow have
+ * been credited; the window is closed.
+ *
+ */
+static void aggregate_close(struct prov_aggregate *a, union prov_elt *relation)
+{
+	memset(relation, 0, sizeof(union prov_elt));
+	prov_type(relation) = a->type | RL_AGGREGATE;
+	relation_identifier(relation).id = prov_next_relation_id();
+	relation_identifier(relation).boot_id = prov_boot_id;
+	relation_identifier(relation).machine_id = prov_machine_id;
+	relation->relation_info.snd = a->snd;
+	relation->relation_info.rcv = a->rcv;
+	relation->relation_info.set = FILE_INFO_SET;
+	relation->relation_info.offset = a->offset;
+	relation->relation_info.flags = a->flags;
+	relation->relation_info.task_id = a->task_id;
+	relation->aggregate_info.count = a->count;
+	relation->aggregate_info.bytes = a->bytes;
+	relation->aggregate_info.first = a->first;
+	relation->aggregate_info.last = a->last;
+	rcu_read_lock();
+	relation->msg_info.epoch = *epoch;
+	rcu_read_unlock();
+	a->type = 0;
+	a->count = 0;
+	a->bytes = 0;
+}
+
+bool __prov_aggregate(const struct file *file, const uint64_t type,
+		      prov_entry_t *from, prov_entry_t *to)
+{
+	struct prov_file_aggregate *fa = provenance_file_aggregate(file);
+	struct prov_aggregate *a = aggregate_flow(fa, type);
+	uint64_t now = ktime_get_ns();
+	union prov_elt relation;
+	bool coalesced = false, flush = false;
+
+	spin_lock(&fa->lock);
+	aggregate_account(fa, file->f_pos);
+	if (a->type != type)
+		goto out;
+	if (aggregate_same_node(&a->snd, &get_prov_identifier(from)) &&
+	    aggregate_same_node(&a->rcv, &get_prov_identifier(to)) &&
+	    now - a->start < READ_ONCE(prov_aggregate_window)) {
+		now = ktime_get_real_ns();
+		if (!a->count) {
+			a->first = now;
+			a->offset = file->f_pos;
+		}
+		a->count++;
+		a->last = now;
+		fa->credit = a;
+		fa->pos = file->f_pos;
+		coalesced = true;
+		goto out;
+	}
+	if (a->count) {
+		aggregate_close(a, &relation);
+		flush = true;
+	}
+	a->type = 0;
+out:
+	spin_unlock(&fa->lock);
+	if (flush)
+		__write_aggregate(&relation);
+	return coalesced;
+}
+
+void __prov_aggregate_start(const struct file *file, const uint64_t type,
+			    prov_entry_t *from, prov_entry_t *to,
+			    const uint64_t flags)
+{
+	struct prov_file_aggregate *fa = provenance_file_aggregate(file);
+	struct prov_aggregate *a = aggregate_flow(fa, type);
+	union prov_elt relation;
+	unsigned long irqflags;
+	bool flush = false;
+
+	spin_lock_irqsave(&fa->lock, irqflags);
+	aggregate_account(fa, file->f_pos);
+	if (a->count) {
+		aggregate_close(a, &relation);
+		flush = true;
+	}
+	a->type = type;
+	a->snd = get_prov_identifier(from);
+	a->rcv = get_prov_identifier(to);
+	a->task_id = current_provid();
+	a->flags = flags;
+	a->start = ktime_get_ns();
+	spin_unlock_irqrestore(&fa->lock, irqflags);
+	if (flush)
+		__write_aggregate(&relation);
+}
+
+void prov_aggregate_init(const struct file *file)
+{
+	struct prov_file_aggregate *fa = provenance_file_aggregate(file);
+
+	// the security blob is not zeroed
+	memset(fa, 0, sizeof(struct prov_file_aggregate));
+	spin_lock_init(&fa->lock);
+}
+
+/*!
+ * @brief Emit the pending aggregates of a file, when it is released.
+ *
+ * Windows opened before aggregation was disabled are still emitted; the lock
+ * is not taken for files on which no flow was coalesced.
+ */
+void prov_aggregate_flush(const struct file *file)
+{
+	struct prov_file_aggregate *fa = provenance_file_aggregate(file);
+	union prov_elt relation;
+	unsigned long irqflags;
+	int i;
+
+	if (!READ_ONCE(fa->flows[PROV_AGGREGATE_READ].count) &&
+	    !READ_ONCE(fa->flows[PROV_AGGREGATE_WRITE].count))
+		return;
+	for (i = 0; i < ARRAY_SIZE(fa->flows); i++) {
+		spin_lock_irqsave(&fa->lock, irqflags);
+		aggregate_account(fa, file->f_pos);
+		if (!fa->flows[i].count) {
+			spin_unlock_irqrestore(&fa->lock, irqflags);
+			continue;
+		}
+		aggregate_close(&fa->flows[i], &relation);
+		spin_unlock_irqrestore(&fa->lock, irqflags);
+		__write_aggregate(&relation);
+	}
+}
+
+/*!
+ * @brief Set the aggregation window.
+ *
+ * Windows already open keep aggregating until their next flow or until their
+ * file is released.
+ * @param window The window in milliseconds, 0 disables aggregation.
+ * @return 0.
+ *
+ */
+int prov_aggregate_set(uint32_t window)
+{
+	mutex_lock(&prov_aggregate_lock);
+	WRITE_ONCE(prov_aggregate_window, (uint64_t)window * NSEC_PER_MSEC);
+	if (window && !static_key_enabled(&prov_aggregate_key))
+		static_branch_enable(&prov_aggregate_key);
+	else if (!window && static_key_enabled(&prov_aggregate_key))
+		static_branch_disable(&prov_aggregate_key);
+	mutex_unlock(&prov_aggregate_lock);
+	return 0;
+}
+
+uint32_t prov_aggregate_get(void)
+{
+	return div_u64(READ_ONCE(prov_aggregate_window), NSEC_PER_MSEC);
+}
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <linux/error-injection.h>
+#include <linux/string.h>
+
+#include "provenance.h"
+#include "provenance_relay.h"
+#include "provenance_bpf.h"
+
+DEFINE_STATIC_KEY_FALSE(prov_bpf_key);
+
+/*!
+ * @brief Attach point of BPF record filters.
+ *
+ * Called for every relation that passed the policy filters, before it or its
+ * end nodes are written. A BPF_MODIFY_RETURN (fmod_ret) program attached to
+ * this function decides the fate of the relation by returning PROV_BPF_KEEP,
+ * PROV_BPF_DROP or PROV_BPF_PROPAGATE; the arguments must not be modified.
+ * Must not be inlined, the default implementation keeps every relation.
+ * @param relation The relation, fully prepared.
+ * @param from The source node of the relation, NULL for aggregates.
+ * @param to The destination node of the relation, NULL for aggregates.
+ * @return One of PROV_BPF_KEEP, PROV_BPF_DROP or PROV_BPF_PROPAGATE.
+ *
+ */
+noinline int prov_bpf_record(const union prov_elt *relation,
+			     const prov_entry_t *from,
+			     const prov_entry_t *to)
+{
+	return PROV_BPF_KEEP;
+}
+ALLOW_ERROR_INJECTION(prov_bpf_record, ERRNO);
+
+/*!
+ * @brief Write a relation subject to the BPF record filter.
+ *
+ * Slow path of "__write_relation" while the BPF filter is enabled: the
+ * relation is prepared on the stack so that it can be handed to the filter
+ * before anything is written. When it is dropped, neither the relation nor
+ * its end nodes are recorded; when it is propagated, the destination node is
+ * marked for propagation before being recorded.
+ * @param type The type of the relation.
+ * @param from The source node.
+ * @param to The destination node.
+ * @param file Information related to LSM hooks.
+ * @param flags Information related to LSM hooks.
+ * @return 0 if no error occurred. Other error codes unknown.
+ *
+ */
+int prov_bpf_write_relation(const uint64_t type,
+			    prov_entry_t *from,
+			    prov_entry_t *to,
+			    const struct file *file,
+			    const uint64_t flags)
+{
+	union prov_elt relation;
+	int rc;
+
+	memset(&relation, 0, sizeof(union prov_elt));
+	__prepare_relation(type, &relation, from, to, file, flags);
+	switch (prov_bpf_record(&relation, from, to)) {
+	case PROV_BPF_DROP:
+		return 0;
+	case PROV_BPF_PROPAGATE:
+		set_propagate(to);
+		break;
+	default:
+		break;
+	}
+	__write_node(from);
+	__write_node(to);
+	rc = call_query_hooks(from, to, (prov_entry_t *)&relation);
+	prov_write(&relation, sizeof(union prov_elt));
+	return rc;
+}
+
+/*!
+ * @brief Enable or disable the BPF record filter.
+ *
+ * Userspace enables the filter once its program is attached to
+ * "prov_bpf_record" and disables it before detaching the program.
+ * @param enabled Whether relations should be handed to the filter.
+ *
+ */
+void prov_bpf_set(bool enabled)
+{
+	if (enabled)
+		static_branch_enable(&prov_bpf_key);
+	else
+		static_branch_disable(&prov_bpf_key);
+	// flows handled by the previous filter may not have been recorded
+	prov_policy_invalidate();
+}
@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/topology.h>
+
+#include "provenance.h"
+#include "provenance_relay.h"
+#include "provenance_delta.h"
+
+/* 0 means node deltas are disabled */
+static unsigned int prov_delta_bits __ro_after_init;
+static unsigned int prov_delta_size __initdata;
+static atomic_t prov_delta_global_gen = ATOMIC_INIT(0);
+static atomic_t prov_delta_suspended = ATOMIC_INIT(0);
+static DEFINE_PER_CPU(struct prov_delta_entry *, prov_delta_cache);
+DEFINE_PER_CPU(unsigned int, prov_delta_gen);
+
+/* provenance_delta=<number of node versions cached per CPU> */
+static int __init set_delta_size(char *str)
+{
+	unsigned int size;
+
+	if (kstrtouint(str, 0, &size))
+		return 0;
+	prov_delta_size = size;
+	return 1;
+}
+__setup("provenance_delta=", set_delta_size);
+
+static __always_inline unsigned int prov_delta_gen_now(void)
+{
+	return __this_cpu_read(prov_delta_gen) +
+	       atomic_read(&prov_delta_global_gen);
+}
+
+/*!
+ * @brief Invalidate the node versions cached by all the CPUs.
+ *
+ * Called when a consumer may not have seen the cached versions, e.g., when a
+ * fan-out channel is created.
+ *
+ */
+void prov_delta_invalidate_all(void)
+{
+	atomic_inc(&prov_delta_global_gen);
+}
+
+/*!
+ * @brief Stop writing nodes as deltas, e.g., while consumers may lose the
+ * versions deltas are based on.
+ *
+ * Calls nest, each must be matched by a call to "prov_delta_resume".
+ *
+ */
+void prov_delta_suspend(void)
+{
+	atomic_inc(&prov_delta_suspended);
+}
+
+/*!
+ * @brief Resume writing nodes as deltas.
+ *
+ * Versions cached while suspended may not have reached the consumers and are
+ * invalidated first.
+ *
+ */
+void prov_delta_resume(void)
+{
+	prov_delta_invalidate_all();
+	// pairs with prov_write_node
+	smp_mb__before_atomic();
+	atomic_dec(&prov_delta_suspended);
+}
+
+/*!
+ * @brief Build the delta between a node and the cached version of the same
+ * node.
+ * @param entry The cached version.
+ * @param node The node to be written.
+ * @param delta The delta element to fill, zeroed.
+ * @return false if too many words changed for a delta to be worth it.
+ *
+ */
+static bool prov_delta_encode(const struct prov_delta_entry *entry,
+			      const union prov_elt *node,
+			      union prov_elt *delta)
+{
+	const uint64_t *words = (const uint64_t *)((const uint8_t *)node +
+						   sizeof(struct msg_struct));
+	uint32_t mask = 0;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < PROV_DELTA_SPAN; i++) {
+		if (words[i] == entry->words[i])
+			continue;
+		if (n == PROV_DELTA_WORDS)
+			return false;
+		mask |= 1U << i;
+		delta->delta_info.words[n++] = words[i];
+	}
+	memcpy(delta, node, sizeof(struct msg_struct));
+	prov_type(delta) |= ND_DELTA;
+	delta->delta_info.base_version = entry->version;
+	delta->delta_info.mask = mask;
+	return true;
+}
+
+/*!
+ * @brief Write a regular provenance node, as a delta against the version of
+ * the node previously written on this CPU when possible.
+ *
+ * Deltas are only used with wire formats that do not pad elements to a fixed
+ * size, as they would not save anything otherwise, and not while suspended.
+ * The cache is updated with every node written, whatever the format, so that
+ * it always reflects what consumers have seen.
+ * @param node The node to be written.
+ *
+ */
+void prov_write_node(union prov_elt *node)
+{
+	struct prov_delta_entry *entry;
+	union prov_elt delta;
+	unsigned long flags;
+	unsigned int gen;
+	bool hit;
+
+	if (!prov_delta_bits || unlikely(!relay_ready) ||
+	    atomic_read(&prov_delta_suspended)) {
+		prov_write(node, sizeof(union prov_elt));
+		return;
+	}
+	// pairs with prov_delta_resume
+	smp_rmb();
+
+	local_irq_save(flags);
+	entry = __this_cpu_read(prov_delta_cache) +
+		hash_64(node_identifier(node).id, prov_delta_bits);
+	gen = prov_delta_gen_now();
+	hit = entry->gen == gen &&
+	      entry->type == prov_type(node) &&
+	      entry->id == node_identifier(node).id &&
+	      READ_ONCE(prov_wire_format) != PROV_WIRE_FIXED;
+	if (hit) {
+		memset(&delta, 0, sizeof(union prov_elt));
+		hit = prov_delta_encode(entry, node, &delta);
+	}
+	prov_write(hit ? &delta : node, sizeof(union prov_elt));
+	// the node did reach the consumers
+	if (gen == prov_delta_gen_now()) {
+		entry->type = prov_type(node);
+		entry->id = node_identifier(node).id;
+		entry->version = node_identifier(node).version;
+		entry->gen = gen;
+		memcpy(entry->words, (uint8_t *)node + sizeof(struct msg_struct),
+		       sizeof(entry->words));
+	}
+	local_irq_restore(flags);
+}
+
+/*!
+ * @brief Allocate the per-CPU caches of node versions.
+ *
+ * Node deltas are enabled with the "provenance_delta=" boot parameter, the
+ * number of entries is rounded up to a power of two.
+ * They are not used with relay compression: a compressed frame may be dropped
+ * after deltas based on its content have been written.
+ *
+ */
+void __init prov_delta_init(void)
+{
+	struct prov_delta_entry *cache;
+	unsigned int bits;
+	int cpu;
+
+	if (!prov_delta_size)
+		return;
+	if (prov_lz4_enabled()) {
+		pr_info("Provenance: node deltas disabled by relay compression.");
+		return;
+	}
+	bits = max_t(unsigned int, order_base_2(prov_delta_size), 1);
+	for_each_possible_cpu(cpu) {
+		cache = kvzalloc_node(sizeof(struct prov_delta_entry) << bits,
+				      GFP_KERNEL, cpu_to_node(cpu));
+		if (!cache)
+			goto out;
+		per_cpu(prov_delta_cache, cpu) = cache;
+	}
+	prov_delta_bits = bits;
+	pr_info("Provenance: %u node versions cached per CPU for deltas.",
+		1U << bits);
+	return;
+out:
+	for_each_possible_cpu(cpu) {
+		kvfree(per_cpu(prov_delta_cache, cpu));
+		per_cpu(prov_delta_cache, cpu) = NULL;
+	}
+	pr_err("Provenance: could not allocate node delta caches.");
+}
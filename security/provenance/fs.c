@@ -86,13 +86,17 @@ static ssize_t __read_flag(struct file *filp, char __user *buf,
 		return simple_read_from_buffer(buf, count, ppos, "0", 2);
 }
 
-#define declare_write_flag_fcn(fcn_name, flag)			    \
-	static ssize_t fcn_name(struct file *file,		    \
-				const char __user * buf,	    \
-				size_t count,			    \
-				loff_t * ppos)			    \
-	{							    \
-		return __write_flag(file, buf, count, ppos, &flag); \
+#define declare_write_flag_fcn(fcn_name, flag)				  \
+	static ssize_t fcn_name(struct file *file,			  \
+				const char __user * buf,		  \
+				size_t count,				  \
+				loff_t * ppos)				  \
+	{								  \
+		ssize_t rc = __write_flag(file, buf, count, ppos, &flag); \
+									  \
+		if (rc > 0)						  \
+			prov_policy_update();				  \
+		return rc;						  \
 	}
 
 #define declare_read_flag_fcn(fcn_name, flag)			  \
@@ -137,6 +141,30 @@ declare_file_operations(prov_duplicate_ops,
 			prov_write_duplicate,
 			prov_read_duplicate);
 
+#ifdef CONFIG_SECURITY_PROVENANCE_BPF
+static ssize_t prov_write_bpf_filter(struct file *file, const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	bool enabled;
+	ssize_t rc = __write_flag(file, buf, count, ppos, &enabled);
+
+	if (rc)
+		return rc;
+	prov_bpf_set(enabled);
+	return count;
+}
+
+static ssize_t prov_read_bpf_filter(struct file *filp, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	return __read_flag(filp, buf, count, ppos,
+			   static_key_enabled(&prov_bpf_key));
+}
+declare_file_operations(prov_bpf_filter_ops,
+			prov_write_bpf_filter,
+			prov_read_bpf_filter);
+#endif
+
 static ssize_t prov_write_machine_id(struct file *file, const char __user *buf,
 				     size_t count, loff_t *ppos)
 {
@@ -386,13 +414,17 @@ static inline ssize_t __read_filter(struct file *filp, char __user *buf,
 	return count;
 }
 
-#define declare_write_filter_fcn(fcn_name, filter)		  \
-	static ssize_t fcn_name(struct file *file,		  \
-				const char __user * buf,	  \
-				size_t count,			  \
-				loff_t * ppos)			  \
-	{							  \
-		return __write_filter(file, buf, count, &filter); \
+#define declare_write_filter_fcn(fcn_name, filter)			       \
+	static ssize_t fcn_name(struct file *file,			       \
+				const char __user * buf,		       \
+				size_t count,				       \
+				loff_t * ppos)				       \
+	{								       \
+		ssize_t rc = __write_filter(file, buf, count, &filter);	       \
+									       \
+		if (rc > 0)						       \
+			prov_policy_update();				       \
+		return rc;						       \
 	}
 
 #define declare_read_filter_fcn(fcn_name, filter)		\
@@ -550,85 +582,201 @@ declare_file_operations(prov_process_ops,
 			prov_write_process,
 			prov_read_process);
 
+/* maximum number of filters in a PROV_SET_REPLACE write */
+#define PROV_IPV4_FILTER_MAX    65536
+
+/*!
+ * @brief Replace the content of a filter list with a set of filters.
+ *
+ * Duplicate filters are merged, filters with PROV_SET_DELETE set are ignored
+ * (i.e., a single such filter clears the list).
+ * Readers switch from the old set to the new set at once.
+ * Must be called with prov_filter_lock held.
+ * @param rules The new filters, with their ip masked.
+ * @param nr The number of filters.
+ * @param filters The filter list.
+ * @param trie The trie of the filter list.
+ * @return 0 on success, -ENOMEM on failure, in which case the list is left
+ * unchanged.
+ *
+ */
+static int __replace_ipv4_filter(struct prov_ipv4_filter *rules, size_t nr,
+				 struct list_head *filters,
+				 struct prov_lpm_trie __rcu **trie)
+{
+	struct ipv4_filters *f, *tmp;
+	LIST_HEAD(list);
+	int rc;
+
+	rc = prov_lpm_filters(rules, nr, &list);
+	if (rc)
+		return rc;
+	rc = prov_lpm_rebuild(&list, trie);
+	if (!rc)        // swap the lists, the old filters are freed below
+		list_swap(&list, filters);
+	list_for_each_entry_safe(f, tmp, &list, list) {
+		list_del(&f->list);
+		kfree(f);
+	}
+	return rc;
+}
+
+/*!
+ * @brief Add, update or delete a filter of a filter list.
+ *
+ * The change is applied to a copy of the list, which only replaces the list
+ * once its trie has been rebuilt.
+ * Must be called with prov_filter_lock held.
+ * @param rule The filter, with its ip masked.
+ * @param filters The filter list.
+ * @param trie The trie of the filter list.
+ * @return 0 on success, -ENOMEM on failure, in which case the list and its
+ * trie are left unchanged.
+ *
+ */
+static int __update_ipv4_filter(const struct prov_ipv4_filter *rule,
+				struct list_head *filters,
+				struct prov_lpm_trie __rcu **trie)
+{
+	struct ipv4_filters *f, *tmp;
+	LIST_HEAD(list);
+	int rc = -ENOMEM;
+
+	list_for_each_entry(tmp, filters, list) {
+		f = kmemdup(tmp, sizeof(struct ipv4_filters), GFP_KERNEL);
+		if (!f)
+			goto out;
+		list_add_tail(&f->list, &list);
+	}
+	f = kzalloc(sizeof(struct ipv4_filters), GFP_KERNEL);
+	if (!f)
+		goto out;
+	f->filter = *rule;
+	// we are not trying to delete something
+	if ((f->filter.op & PROV_SET_DELETE) != PROV_SET_DELETE)
+		prov_ipv4_add_or_update(&list, f);
+	else
+		prov_ipv4_delete(&list, f);
+	rc = prov_lpm_rebuild(&list, trie);
+	if (!rc)        // swap the lists, the old filters are freed below
+		list_swap(&list, filters);
+out:
+	list_for_each_entry_safe(f, tmp, &list, list) {
+		list_del(&f->list);
+		kfree(f);
+	}
+	return rc;
+}
+
 static ssize_t __write_ipv4_filter(struct file *file, const char __user *buf,
-				   size_t count, struct list_head *filters)
+				   size_t count, int dir)
 {
-	struct ipv4_filters *f;
+	struct prov_filter_set *set;
+	struct prov_ipv4_filter *rules;
+	size_t nr = 1, i;
+	bool replace;
+	ssize_t rc;
 
 	if (!capable(CAP_AUDIT_CONTROL))
 		return -EPERM;
 	if (count < sizeof(struct prov_ipv4_filter))
 		return -ENOMEM;
-	f = kzalloc(sizeof(struct ipv4_filters), GFP_KERNEL);
-	if (!f)
-		return -ENOMEM;
-	if (copy_from_user(&(f->filter), buf, sizeof(struct prov_ipv4_filter))) {
-		kfree(f);
+	rules = memdup_user(buf, sizeof(struct prov_ipv4_filter));
+	if (IS_ERR(rules))
 		return -EAGAIN;
+	// a replacement carries the whole new filter set
+	replace = (rules->op & PROV_SET_REPLACE) == PROV_SET_REPLACE;
+	if (replace) {
+		kfree(rules);
+		nr = count / sizeof(struct prov_ipv4_filter);
+		if (nr > PROV_IPV4_FILTER_MAX)
+			return -E2BIG;
+		rules = vmemdup_user(buf, nr * sizeof(struct prov_ipv4_filter));
+		if (IS_ERR(rules))
+			return -EAGAIN;
 	}
-	f->filter.ip = f->filter.ip & f->filter.mask;
-	// we are not trying to delete something
-	if ((f->filter.op & PROV_SET_DELETE) != PROV_SET_DELETE)
-		prov_ipv4_add_or_update(filters, f);
+	for (i = 0; i < nr; i++) {
+		if (!prov_lpm_mask_valid(rules[i].mask)) {
+			rc = -EINVAL;
+			goto out;
+		}
+		rules[i].ip = rules[i].ip & rules[i].mask;
+		rules[i].op &= ~PROV_SET_REPLACE;
+	}
+
+	mutex_lock(&prov_filter_lock);
+	set = prov_filters_locked();
+	if (replace)
+		rc = __replace_ipv4_filter(rules, nr, &set->ipv4[dir],
+					   &set->ipv4trie[dir]);
 	else
-		prov_ipv4_delete(filters, f);
-	return sizeof(struct prov_ipv4_filter);
+		rc = __update_ipv4_filter(rules, &set->ipv4[dir],
+					  &set->ipv4trie[dir]);
+	prov_filter_changed();
+	mutex_unlock(&prov_filter_lock);
+out:
+	kvfree(rules);
+	if (rc)
+		return rc;
+	return nr * sizeof(struct prov_ipv4_filter);
 }
 
 static ssize_t __read_ipv4_filter(struct file *filp, char __user *buf,
-				  size_t count, struct list_head *filters)
+				  size_t count, int dir)
 {
-	struct list_head *listentry, *listtmp;
 	struct ipv4_filters *tmp;
-	size_t pos = 0;
+	ssize_t pos = 0;
 
 	if (count < sizeof(struct prov_ipv4_filter))
 		return -ENOMEM;
 
-	list_for_each_safe(listentry, listtmp, filters) {
-		tmp = list_entry(listentry, struct ipv4_filters, list);
-		if (count < pos + sizeof(struct prov_ipv4_filter))
-			return -ENOMEM;
-
+	mutex_lock(&prov_filter_lock);
+	list_for_each_entry(tmp, &prov_filters_locked()->ipv4[dir], list) {
+		if (count < pos + sizeof(struct prov_ipv4_filter)) {
+			pos = -ENOMEM;
+			break;
+		}
 		if (copy_to_user(buf + pos, &(tmp->filter),
-				 sizeof(struct prov_ipv4_filter)))
-			return -EAGAIN;
-
+				 sizeof(struct prov_ipv4_filter))) {
+			pos = -EAGAIN;
+			break;
+		}
 		pos += sizeof(struct prov_ipv4_filter);
 	}
+	mutex_unlock(&prov_filter_lock);
 	return pos;
 }
 
-#define declare_write_ipv4_filter_fcn(fcn_name, filter)		       \
-	static ssize_t fcn_name(struct file *file,		       \
-				const char __user * buf,	       \
-				size_t count,			       \
-				loff_t * ppos)			       \
-	{							       \
-		return __write_ipv4_filter(file, buf, count, &filter); \
+#define declare_write_ipv4_filter_fcn(fcn_name, dir)		   \
+	static ssize_t fcn_name(struct file *file,		   \
+				const char __user * buf,	   \
+				size_t count,			   \
+				loff_t * ppos)			   \
+	{							   \
+		return __write_ipv4_filter(file, buf, count, dir); \
 	}
 
-#define declare_reader_ipv4_filter_fcn(fcn_name, filter)	      \
-	static ssize_t fcn_name(struct file *filp,		      \
-				char __user * buf,		      \
-				size_t count,			      \
-				loff_t * ppos)			      \
-	{							      \
-		return __read_ipv4_filter(filp, buf, count, &filter); \
+#define declare_reader_ipv4_filter_fcn(fcn_name, dir)		  \
+	static ssize_t fcn_name(struct file *filp,		  \
+				char __user * buf,		  \
+				size_t count,			  \
+				loff_t * ppos)			  \
+	{							  \
+		return __read_ipv4_filter(filp, buf, count, dir); \
 	}
 
 declare_write_ipv4_filter_fcn(prov_write_ipv4_ingress_filter,
-			      ingress_ipv4filters);
+			      PROV_IPV4_INGRESS);
 declare_reader_ipv4_filter_fcn(prov_read_ipv4_ingress_filter,
-			       ingress_ipv4filters);
+			       PROV_IPV4_INGRESS);
 declare_file_operations(prov_ipv4_ingress_filter_ops,
 			prov_write_ipv4_ingress_filter,
 			prov_read_ipv4_ingress_filter);
 
 declare_write_ipv4_filter_fcn(prov_write_ipv4_egress_filter,
-			      egress_ipv4filters);
+			      PROV_IPV4_EGRESS);
 declare_reader_ipv4_filter_fcn(prov_read_ipv4_egress_filter,
-			       egress_ipv4filters);
+			       PROV_IPV4_EGRESS);
 declare_file_operations(prov_ipv4_egress_filter_ops,
 			prov_write_ipv4_egress_filter,
 			prov_read_ipv4_egress_filter);
@@ -676,6 +824,7 @@ declare_file_operations(prov_secctx_ops, no_write, prov_read_secctx);
 				     loff_t * ppos)						  \
 	{											  \
 		struct filters *s;								  \
+		int rc;										  \
 		if (count < sizeof(struct info))						  \
 		return -ENOMEM;									  \
 		s = kzalloc(sizeof(struct filters), GFP_KERNEL);				  \
@@ -685,11 +834,17 @@ declare_file_operations(prov_secctx_ops, no_write, prov_read_secctx);
 			kfree(s);								  \
 			return -EAGAIN;								  \
 		}										  \
+		mutex_lock(&prov_filter_lock);							  \
 		if ((s->filter.op & PROV_SET_DELETE) != PROV_SET_DELETE) {			  \
-			add_function(s);							  \
+			rc = add_function(prov_filters_locked(), s);				  \
 		} else {									  \
-			delete_function(s);							  \
-		} return sizeof(struct filters);						  \
+			rc = delete_function(prov_filters_locked(), s);				  \
+		}										  \
+		prov_filter_changed();								  \
+		mutex_unlock(&prov_filter_lock);						  \
+		if (rc)										  \
+		return rc;									  \
+		return sizeof(struct filters);							  \
 	}
 
 #define declare_generic_filter_read(function_name, filters, info)			    \
@@ -698,19 +853,21 @@ declare_file_operations(prov_secctx_ops, no_write, prov_read_secctx);
 				     size_t count,					    \
 				     loff_t * ppos)					    \
 	{										    \
-		struct list_head *listentry, *listtmp;					    \
 		struct filters *tmp;							    \
-		size_t pos = 0;								    \
+		ssize_t pos = 0;							    \
 		if (count < sizeof(struct info)) {					    \
 			return -ENOMEM; }						    \
-		list_for_each_safe(listentry, listtmp, &filters) {			    \
-			tmp = list_entry(listentry, struct filters, list);		    \
+		mutex_lock(&prov_filter_lock);						    \
+		list_for_each_entry(tmp, &prov_filters_locked()->filters, list) {	    \
 			if (count < pos + sizeof(struct info)) {			    \
-				return -ENOMEM; }					    \
+				pos = -ENOMEM;						    \
+				break; }						    \
 			if (copy_to_user(buf + pos, &(tmp->filter), sizeof(struct info))) { \
-				return -EAGAIN; }					    \
+				pos = -EAGAIN;						    \
+				break; }						    \
 			pos += sizeof(struct info);					    \
 		}									    \
+		mutex_unlock(&prov_filter_lock);					    \
 		return pos;								    \
 	}
 
@@ -720,6 +877,7 @@ static ssize_t prov_write_secctx_filter(struct file *file,
 					loff_t *ppos)
 {
 	struct secctx_filters *s;
+	int rc;
 
 	if (count < sizeof(struct secinfo))
 		return -ENOMEM;
@@ -736,10 +894,15 @@ static ssize_t prov_write_secctx_filter(struct file *file,
 	security_secctx_to_secid(s->filter.secctx,
 				 s->filter.len,
 				 &s->filter.secid);
+	mutex_lock(&prov_filter_lock);
 	if ((s->filter.op & PROV_SET_DELETE) != PROV_SET_DELETE)
-		prov_secctx_add_or_update(s);
+		rc = prov_secctx_add_or_update(prov_filters_locked(), s);
 	else
-		prov_secctx_delete(s);
+		rc = prov_secctx_delete(prov_filters_locked(), s);
+	prov_filter_changed();
+	mutex_unlock(&prov_filter_lock);
+	if (rc)
+		return rc;
 	return sizeof(struct secinfo);
 }
 
@@ -767,10 +930,22 @@ declare_file_operations(prov_gid_filter_ops,
 			prov_write_gid_filter,
 			prov_read_gid_filter);
 
+declare_generic_filter_write(prov_write_cgroup_filter,
+			     cgroup_filters, cgroupinfo,
+			     prov_cgroup_add_or_update,
+			     prov_cgroup_delete);
+declare_generic_filter_read(prov_read_cgroup_filter, cgroup_filters,
+			    cgroupinfo);
+declare_file_operations(prov_cgroup_filter_ops,
+			prov_write_cgroup_filter,
+			prov_read_cgroup_filter);
+
 static ssize_t prov_write_ns_filter(struct file *file, const char __user *buf,
 				    size_t count, loff_t *ppos)
 {
+	struct prov_filter_set *set;
 	struct ns_filters *s;
+	int rc;
 
 	if (count < sizeof(struct nsinfo))
 		return -ENOMEM;
@@ -784,32 +959,43 @@ static ssize_t prov_write_ns_filter(struct file *file, const char __user *buf,
 		return -EAGAIN;
 	}
 
+	mutex_lock(&prov_filter_lock);
+	set = prov_filters_locked();
 	if ((s->filter.op & PROV_SET_DELETE) != PROV_SET_DELETE)
-		prov_ns_add_or_update(s);
+		prov_ns_add_or_update(&set->ns_filters, s);
 	else
-		prov_ns_delete(s);
+		prov_ns_delete(&set->ns_filters, s);
+	rc = prov_ns_rebuild(&set->ns_filters, &set->ns_matcher);
+	prov_filter_changed();
+	mutex_unlock(&prov_filter_lock);
+	if (rc)
+		return rc;
 	return sizeof(struct nsinfo);
 }
 
 static ssize_t prov_read_ns_filter(struct file *filp, char __user *buf,
 				   size_t count, loff_t *ppos)
 {
-	struct list_head *listentry, *listtmp;
 	struct ns_filters *tmp;
-	size_t pos = 0;
+	ssize_t pos = 0;
 
 	if (count < sizeof(struct nsinfo))
 		return -ENOMEM;
 
-	list_for_each_safe(listentry, listtmp, &ns_filters) {
-		tmp = list_entry(listentry, struct ns_filters, list);
-		if (count < pos + sizeof(struct nsinfo))
-			return -ENOMEM;
+	mutex_lock(&prov_filter_lock);
+	list_for_each_entry(tmp, &prov_filters_locked()->ns_filters, list) {
+		if (count < pos + sizeof(struct nsinfo)) {
+			pos = -ENOMEM;
+			break;
+		}
 		if (copy_to_user(buf + pos, &(tmp->filter),
-				 sizeof(struct nsinfo)))
-			return -EAGAIN;
+				 sizeof(struct nsinfo))) {
+			pos = -EAGAIN;
+			break;
+		}
 		pos += sizeof(struct nsinfo);
 	}
+	mutex_unlock(&prov_filter_lock);
 	return pos;
 }
 declare_file_operations(prov_ns_filter_ops,
@@ -886,114 +1072,49 @@ static ssize_t prov_write_logp(struct file *file, const char __user *buf,
 }
 declare_file_operations(prov_logp_ops, prov_write_logp, no_read);
 
-#define hash_filters(filters, filters_type, tmp, tmp_type)						 \
-	do {												 \
-		list_for_each_safe(listentry, listtmp, &filters) {					 \
-			tmp = list_entry(listentry, struct filters_type, list);				 \
-			rc = crypto_shash_update(hashdesc, (u8 *)&tmp->filter, sizeof(struct tmp_type)); \
-			if (rc) {									 \
-				pr_err("Provenance: error updating hash.");				 \
-				pos = -EAGAIN;								 \
-				goto out;								 \
-			}										 \
-		}											 \
-	} while (0)
-
 static ssize_t prov_read_policy_hash(struct file *filp, char __user *buf,
 				     size_t count, loff_t *ppos)
 {
-	size_t pos = 0;
-	size_t size;
-	int rc;
-	struct crypto_shash *policy_shash_tfm;
-	struct shash_desc *hashdesc = NULL;
-	uint8_t *buff = NULL;
-	struct list_head *listentry, *listtmp;
-	struct ipv4_filters *ipv4_tmp;
-	struct ns_filters *ns_tmp;
-	struct secctx_filters *secctx_tmp;
-	struct user_filters *user_tmp;
-	struct group_filters *group_tmp;
-
-	policy_shash_tfm = crypto_alloc_shash(PROVENANCE_HASH, 0, 0);
-	if (IS_ERR(policy_shash_tfm))
+	uint8_t digest[HASH_MAX_DIGESTSIZE];
+	ssize_t len;
+
+	len = prov_policy_digest(digest, sizeof(digest));
+	if (len < 0)
+		return len;
+	if (count < len)
 		return -ENOMEM;
-	pos = crypto_shash_digestsize(policy_shash_tfm);
-	if (count < pos) {
-		pos = -ENOMEM;
-		goto out_shash;
-	}
-	size = sizeof(struct shash_desc) +
-	       crypto_shash_descsize(policy_shash_tfm);
-	hashdesc = kzalloc(size, GFP_KERNEL);
-	if (!hashdesc) {
-		pos = -ENOMEM;
-		goto out_shash;
-	}
-	buff = kzalloc(pos, GFP_KERNEL);
-	if (!buff) {
-		pos = -ENOMEM;
-		goto out_hashdesc;
-	}
-	hashdesc->tfm = policy_shash_tfm;
-	rc = crypto_shash_init(hashdesc);
-	if (rc) {
-		pos = -EAGAIN;
-		goto out;
-	}
-	/* LSM version */
-	rc = crypto_shash_update(hashdesc, (u8 *)CAMFLOW_VERSION_STR,
-				 strnlen(CAMFLOW_VERSION_STR, 32));
-	if (rc) {
-		pos = -EAGAIN;
-		goto out;
-	}
-	/* commit */
-	rc = crypto_shash_update(hashdesc,
-				 (u8 *)CAMFLOW_COMMIT,
-				 strnlen(CAMFLOW_COMMIT,
-					 PROV_COMMIT_MAX_LENGTH));
-	if (rc) {
-		pos = -EAGAIN;
-		goto out;
-	}
-	/* general policy */
-	rc = crypto_shash_update(hashdesc, (u8 *)&prov_policy,
-				 sizeof(struct capture_policy));
-	if (rc) {
-		pos = -EAGAIN;
-		goto out;
-	}
-	/* ingress network policy */
-	hash_filters(ingress_ipv4filters, ipv4_filters, ipv4_tmp, prov_ipv4_filter);
-	/* egress network policy */
-	hash_filters(egress_ipv4filters, ipv4_filters, ipv4_tmp, prov_ipv4_filter);
-	/* namespace policy */
-	hash_filters(ns_filters, ns_filters, ns_tmp, ns_filters);
-	/* secctx policy */
-	hash_filters(secctx_filters, secctx_filters, secctx_tmp, secinfo);
-	/* userid policy */
-	hash_filters(user_filters, user_filters, user_tmp, userinfo);
-	/* groupid policy */
-	hash_filters(group_filters, group_filters, group_tmp, groupinfo);
-
-	rc = crypto_shash_final(hashdesc, buff);
-	if (rc) {
-		pos = -EAGAIN;
-		goto out;
-	}
-	if (copy_to_user(buf, buff, pos))
-		pos = -EAGAIN;
-out:
-	kfree(buff);
-out_hashdesc:
-	kfree(hashdesc);
-out_shash:
-	crypto_free_shash(policy_shash_tfm);
-	return pos;
+	if (copy_to_user(buf, digest, len))
+		return -EAGAIN;
+	return len;
 }
 declare_file_operations(prov_policy_hash_ops, no_write, prov_read_policy_hash);
 
+/* maximum size of a policy blob */
+#define PROV_POLICY_MAX_SIZE    (64 << 20)
+
+static ssize_t prov_write_policy(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	void *blob;
+	int rc;
+
+	if (!capable(CAP_AUDIT_CONTROL))
+		return -EPERM;
+	if (count < sizeof(struct prov_policy_header))
+		return -EINVAL;
+	if (count > PROV_POLICY_MAX_SIZE)
+		return -E2BIG;
+	blob = vmemdup_user(buf, count);
+	if (IS_ERR(blob))
+		return -EAGAIN;
+	rc = prov_policy_load(blob, count);
+	kvfree(blob);
+	if (rc)
+		return rc;
+	return count;
+}
+declare_file_operations(prov_policy_ops, prov_write_policy, no_read);
+
 static ssize_t prov_read_prov_type(struct file *filp, char __user *buf,
 				   size_t count, loff_t *ppos)
 {
@@ -1087,7 +1208,7 @@ static ssize_t prov_read_dropped(struct file *filp, char __user *buf,
 	if (count < sizeof(struct dropped))
 		return -ENOMEM;
 
-	drop.s = atomic64_read(&prov_drop);
+	drop.s = prov_dropped();
 
 	if (copy_to_user(buf, &drop, sizeof(struct dropped)))
 		return -EAGAIN;
@@ -1095,6 +1216,439 @@ static ssize_t prov_read_dropped(struct file *filp, char __user *buf,
 }
 declare_file_operations(prov_dropped, no_write, prov_read_dropped);
 
+static ssize_t prov_read_edge_cache(struct file *filp, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct prov_edge_cache_stats stats = { 0 };
+	int cpu;
+
+	if (count < sizeof(struct prov_edge_cache_stats))
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		stats.hit += per_cpu(prov_edge_stats, cpu).hit;
+		stats.miss += per_cpu(prov_edge_stats, cpu).miss;
+	}
+	if (copy_to_user(buf, &stats, sizeof(struct prov_edge_cache_stats)))
+		return -EAGAIN;
+	return sizeof(struct prov_edge_cache_stats);
+}
+declare_file_operations(prov_edge_cache_ops, no_write, prov_read_edge_cache);
+
+static ssize_t prov_write_wire_format(struct file *file,
+				      const char __user *buf,
+				      size_t count,
+				      loff_t *ppos)
+{
+	char *str;
+	ssize_t rc;
+	uint8_t tmp;
+
+	if (!capable(CAP_AUDIT_CONTROL))
+		return -EPERM;
+
+	str = memdup_user_nul(buf, count);
+	if (IS_ERR(str))
+		return PTR_ERR(str);
+
+	rc = kstrtou8(str, 10, &tmp);
+	if (rc)
+		goto out;
+
+	if (tmp > PROV_WIRE_MAX) {
+		rc = -EINVAL;
+		goto out;
+	}
+	WRITE_ONCE(prov_wire_format, tmp);
+	pr_info("Provenance: wire format set to %u.", tmp);
+	rc = count;
+out:
+	kfree(str);
+	return rc;
+}
+
+static ssize_t prov_read_wire_format(struct file *filp, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	char tmpbuf[TMPBUFLEN];
+	ssize_t len;
+
+	len = scnprintf(tmpbuf, TMPBUFLEN, "%u", READ_ONCE(prov_wire_format));
+	return simple_read_from_buffer(buf, count, ppos, tmpbuf, len);
+}
+declare_file_operations(prov_wire_format_ops,
+			prov_write_wire_format,
+			prov_read_wire_format);
+
+static ssize_t prov_write_aggregate(struct file *file,
+				    const char __user *buf,
+				    size_t count,
+				    loff_t *ppos)
+{
+	char *str;
+	ssize_t rc;
+	uint32_t tmp;
+
+	if (!capable(CAP_AUDIT_CONTROL))
+		return -EPERM;
+
+	str = memdup_user_nul(buf, count);
+	if (IS_ERR(str))
+		return PTR_ERR(str);
+
+	rc = kstrtou32(str, 10, &tmp);
+	if (rc)
+		goto out;
+
+	rc = prov_aggregate_set(tmp);
+	if (rc)
+		goto out;
+	pr_info("Provenance: aggregation window set to %ums.", tmp);
+	rc = count;
+out:
+	kfree(str);
+	return rc;
+}
+
+static ssize_t prov_read_aggregate(struct file *filp, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	char tmpbuf[TMPBUFLEN];
+	ssize_t len;
+
+	len = scnprintf(tmpbuf, TMPBUFLEN, "%u", prov_aggregate_get());
+	return simple_read_from_buffer(buf, count, ppos, tmpbuf, len);
+}
+declare_file_operations(prov_aggregate_ops,
+			prov_write_aggregate,
+			prov_read_aggregate);
+
+static ssize_t prov_write_relay_policy(struct file *file,
+				       const char __user *buf,
+				       size_t count,
+				       loff_t *ppos)
+{
+	struct prov_relay_policy setting;
+	struct prov_channel *pc;
+
+	if (!capable(CAP_AUDIT_CONTROL))
+		return -EPERM;
+
+	if (count < sizeof(struct prov_relay_policy))
+		return -ENOMEM;
+
+	if (copy_from_user(&setting, buf, sizeof(struct prov_relay_policy)))
+		return -EAGAIN;
+
+	if (setting.policy > PROV_RELAY_SPILL)
+		return -EINVAL;
+
+	// sub-buffers awaiting compression are never overwritten
+	if (setting.policy == PROV_RELAY_OVERWRITE && prov_lz4_enabled())
+		return -EOPNOTSUPP;
+
+	setting.channel[PROV_CHANNEL_NAME_LEN - 1] = '\0';
+	pc = prov_channel_find(setting.channel);
+	if (!pc)
+		return -ENOENT;
+
+	WRITE_ONCE(pc->block_ms, setting.block_ms);
+	WRITE_ONCE(pc->spill_max, setting.spill_max);
+	prov_channel_set_policy(pc, setting.policy);
+	pr_info("Provenance: relay %s policy set to %u.", pc->name,
+		setting.policy);
+	return sizeof(struct prov_relay_policy);
+}
+
+static ssize_t prov_read_relay_policy(struct file *filp, char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct prov_relay_policy setting;
+	struct prov_channel *pc;
+	size_t pos = 0;
+	ssize_t rc;
+
+	if (count < sizeof(struct prov_relay_policy))
+		return -ENOMEM;
+
+	mutex_lock(&prov_channels_lock);
+	list_for_each_entry(pc, &prov_channels, list) {
+		if (count < pos + sizeof(struct prov_relay_policy)) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		memset(&setting, 0, sizeof(struct prov_relay_policy));
+		strscpy(setting.channel, pc->name, PROV_CHANNEL_NAME_LEN);
+		setting.policy = READ_ONCE(pc->policy);
+		setting.block_ms = READ_ONCE(pc->block_ms);
+		setting.spill_max = READ_ONCE(pc->spill_max);
+		if (copy_to_user(buf + pos, &setting,
+				 sizeof(struct prov_relay_policy))) {
+			rc = -EAGAIN;
+			goto out;
+		}
+		pos += sizeof(struct prov_relay_policy);
+	}
+	rc = pos;
+out:
+	mutex_unlock(&prov_channels_lock);
+	return rc;
+}
+declare_file_operations(prov_relay_policy_ops,
+			prov_write_relay_policy,
+			prov_read_relay_policy);
+
+static ssize_t prov_write_rate(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct prov_rate setting;
+	int rc;
+
+	if (!capable(CAP_AUDIT_CONTROL))
+		return -EPERM;
+
+	if (count < sizeof(struct prov_rate))
+		return -ENOMEM;
+
+	if (copy_from_user(&setting, buf, sizeof(struct prov_rate)))
+		return -EAGAIN;
+
+	rc = prov_rate_set(&setting);
+	if (rc)
+		return rc;
+	return sizeof(struct prov_rate);
+}
+
+static ssize_t prov_read_rate(struct file *filp, char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct prov_rate *settings;
+	ssize_t pos;
+	size_t nr;
+
+	nr = min_t(size_t, count / sizeof(struct prov_rate),
+		   PROV_STATS_SLOTS + 1);
+	if (!nr)
+		return -ENOMEM;
+	settings = kcalloc(nr, sizeof(struct prov_rate), GFP_KERNEL);
+	if (!settings)
+		return -ENOMEM;
+	pos = prov_rate_get(settings, nr) * sizeof(struct prov_rate);
+	if (copy_to_user(buf, settings, pos))
+		pos = -EAGAIN;
+	kfree(settings);
+	return pos;
+}
+declare_file_operations(prov_rate_ops, prov_write_rate, prov_read_rate);
+
+static ssize_t prov_write_relay_size(struct file *file,
+				     const char __user *buf,
+				     size_t count,
+				     loff_t *ppos)
+{
+	struct prov_relay_size setting;
+	struct prov_channel *pc;
+	int rc;
+
+	if (!capable(CAP_AUDIT_CONTROL))
+		return -EPERM;
+
+	if (count < sizeof(struct prov_relay_size))
+		return -ENOMEM;
+
+	if (copy_from_user(&setting, buf, sizeof(struct prov_relay_size)))
+		return -EAGAIN;
+
+	setting.channel[PROV_CHANNEL_NAME_LEN - 1] = '\0';
+	pc = prov_channel_find(setting.channel);
+	if (!pc)
+		return -ENOENT;
+
+	if (setting.subbuf_size != READ_ONCE(pc->subbuf_size) ||
+	    setting.nb_subbuf != READ_ONCE(pc->nb_subbuf)) {
+		rc = prov_channel_resize(pc, setting.subbuf_size,
+					 setting.nb_subbuf);
+		if (rc)
+			return rc;
+	}
+	prov_channel_set_adaptive(pc, setting.adaptive);
+	return sizeof(struct prov_relay_size);
+}
+
+static ssize_t prov_read_relay_size(struct file *filp, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct prov_relay_size setting;
+	struct prov_channel *pc;
+	size_t pos = 0;
+	ssize_t rc;
+
+	if (count < sizeof(struct prov_relay_size))
+		return -ENOMEM;
+
+	mutex_lock(&prov_channels_lock);
+	list_for_each_entry(pc, &prov_channels, list) {
+		if (count < pos + sizeof(struct prov_relay_size)) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		memset(&setting, 0, sizeof(struct prov_relay_size));
+		strscpy(setting.channel, pc->name, PROV_CHANNEL_NAME_LEN);
+		setting.subbuf_size = READ_ONCE(pc->subbuf_size);
+		setting.nb_subbuf = READ_ONCE(pc->nb_subbuf);
+		setting.adaptive = READ_ONCE(pc->adaptive);
+		if (copy_to_user(buf + pos, &setting,
+				 sizeof(struct prov_relay_size))) {
+			rc = -EAGAIN;
+			goto out;
+		}
+		pos += sizeof(struct prov_relay_size);
+	}
+	rc = pos;
+out:
+	mutex_unlock(&prov_channels_lock);
+	return rc;
+}
+declare_file_operations(prov_relay_size_ops,
+			prov_write_relay_size,
+			prov_read_relay_size);
+
+static ssize_t prov_write_channel(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct prov_channel_filter filter;
+	int rc;
+
+	if (!capable(CAP_AUDIT_CONTROL))
+		return -EPERM;
+
+	if (count < sizeof(struct prov_channel_filter))
+		return -ENOMEM;
+
+	if (copy_from_user(&filter, buf, sizeof(struct prov_channel_filter)))
+		return -EAGAIN;
+
+	filter.channel[PROV_CHANNEL_NAME_LEN - 1] = '\0';
+	rc = prov_channel_create(&filter);
+	if (rc)
+		return rc;
+	return sizeof(struct prov_channel_filter);
+}
+
+static ssize_t prov_read_channel(struct file *filp, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct prov_channel *pc;
+	size_t pos = 0;
+	ssize_t rc;
+
+	mutex_lock(&prov_channels_lock);
+	list_for_each_entry(pc, &prov_fanout, fanout) {
+		if (count < pos + sizeof(struct prov_channel_filter)) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		if (copy_to_user(buf + pos, &pc->filter,
+				 sizeof(struct prov_channel_filter))) {
+			rc = -EAGAIN;
+			goto out;
+		}
+		pos += sizeof(struct prov_channel_filter);
+	}
+	rc = pos;
+out:
+	mutex_unlock(&prov_channels_lock);
+	return rc;
+}
+declare_file_operations(prov_channel_ops,
+			prov_write_channel,
+			prov_read_channel);
+
+/*!
+ * @brief Take a snapshot of the per-CPU relay statistics.
+ *
+ * Counters are summed over all CPUs, types that have not been seen are
+ * omitted.
+ * Counters are read without synchronisation with the writers, each value is
+ * therefore only approximately consistent with the others.
+ * @param size The size of the snapshot.
+ * @return The snapshot, to be freed with kvfree, or NULL if no memory could
+ * be allocated.
+ *
+ */
+static void *prov_stats_snapshot(size_t *size)
+{
+	struct prov_stats_header *hdr;
+	struct prov_channel_stats_header *chdr;
+	struct prov_type_stats *entry, *stats;
+	struct prov_channel *pc;
+	uint32_t nr_channels = 0;
+	uint8_t *snapshot, *pos;
+	int cpu, i;
+
+	// channels created while the snapshot is taken would not fit in it
+	mutex_lock(&prov_channels_lock);
+	list_for_each_entry(pc, &prov_channels, list)
+		nr_channels++;
+	snapshot = kvzalloc(sizeof(struct prov_stats_header) +
+			    nr_channels *
+			    (sizeof(struct prov_channel_stats_header) +
+			     PROV_STATS_SLOTS * sizeof(struct prov_type_stats)),
+			    GFP_KERNEL);
+	if (!snapshot)
+		goto out;
+
+	hdr = (struct prov_stats_header *)snapshot;
+	hdr->nr_channels = nr_channels;
+	hdr->nr_cpus = num_possible_cpus();
+	hdr->boot_overflow = atomic64_read(&prov_boot_overflow);
+	pos = snapshot + sizeof(struct prov_stats_header);
+	list_for_each_entry(pc, &prov_channels, list) {
+		chdr = (struct prov_channel_stats_header *)pos;
+		strscpy(chdr->channel, pc->name, PROV_CHANNEL_NAME_LEN);
+		chdr->spill_size = atomic64_read(&pc->spill_size);
+		if (pc->lz4)
+			chdr->frames_dropped = atomic64_read(&pc->lz4->dropped);
+		entry = (struct prov_type_stats *)(chdr + 1);
+		for (i = 0; i < PROV_STATS_SLOTS; i++) {
+			for_each_possible_cpu(cpu) {
+				stats = &per_cpu_ptr(pc->stats, cpu)->types[i];
+				if (!stats->type)
+					continue;
+				entry->type = stats->type;
+				entry->emitted += stats->emitted;
+				entry->bytes += stats->bytes;
+				entry->dropped += stats->dropped;
+			}
+			if (entry->type) {
+				entry++;
+				chdr->nr_entries++;
+			}
+		}
+		pos = (uint8_t *)entry;
+	}
+	*size = pos - snapshot;
+out:
+	mutex_unlock(&prov_channels_lock);
+	return snapshot;
+}
+
+static ssize_t prov_read_stats(struct file *filp, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	void *snapshot;
+	size_t size;
+	ssize_t rc;
+
+	snapshot = prov_stats_snapshot(&size);
+	if (!snapshot)
+		return -ENOMEM;
+	rc = simple_read_from_buffer(buf, count, ppos, snapshot, size);
+	kvfree(snapshot);
+	return rc;
+}
+declare_file_operations(prov_stats_ops, no_write, prov_read_stats);
+
 #define prov_create_file(name, perm, fun_ptr)					      \
 	do {									      \
 		dentry = securityfs_create_file(name, perm, prov_dir, NULL, fun_ptr); \
@@ -1145,14 +1699,27 @@ static int __init init_prov_fs(void)
 	prov_create_file("log", 0666, &prov_log_ops);
 	prov_create_file("logp", 0666, &prov_logp_ops);
 	prov_create_file("policy_hash", 0444, &prov_policy_hash_ops);
+	prov_create_file("policy", 0600, &prov_policy_ops);
 	prov_create_file("uid", 0644, &prov_uid_filter_ops);
 	prov_create_file("gid", 0644, &prov_gid_filter_ops);
+	prov_create_file("cgroup", 0644, &prov_cgroup_filter_ops);
 	prov_create_file("type", 0444, &prov_type_ops);
 	prov_create_file("version", 0444, &prov_version);
 	prov_create_file("commit", 0444, &prov_commit);
 	prov_create_file("duplicate", 0644, &prov_duplicate_ops);
 	prov_create_file("epoch", 0644, &prov_epoch_ops);
 	prov_create_file("dropped", 0444, &prov_dropped);
+	prov_create_file("edge_cache", 0444, &prov_edge_cache_ops);
+	prov_create_file("wire_format", 0644, &prov_wire_format_ops);
+	prov_create_file("relay_policy", 0644, &prov_relay_policy_ops);
+	prov_create_file("stats", 0444, &prov_stats_ops);
+	prov_create_file("relay_size", 0644, &prov_relay_size_ops);
+	prov_create_file("channel", 0644, &prov_channel_ops);
+	prov_create_file("rate", 0644, &prov_rate_ops);
+	prov_create_file("aggregate", 0644, &prov_aggregate_ops);
+#ifdef CONFIG_SECURITY_PROVENANCE_BPF
+	prov_create_file("bpf_filter", 0644, &prov_bpf_filter_ops);
+#endif
 	pr_info("Provenance: fs ready.\n");
 	return 0;
 }
@@ -30,6 +30,7 @@
 #include "provenance_inode.h"
 #include "provenance_task.h"
 #include "provenance_machine.h"
+#include "provenance_flow.h"
 #include "memcpy_ss.h"
 
 #ifdef CONFIG_SECURITY_PROVENANCE_PERSISTENCE
@@ -111,7 +112,7 @@ static int provenance_task_alloc(struct task_struct *task,
 	init_provenance_struct(ACT_TASK, ntprov);
 	update_task_namespaces(task, ntprov);
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	if (t != NULL) {
@@ -141,13 +142,15 @@ static void provenance_task_free(struct task_struct *task)
 {
 	struct provenance *tprov;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return;
 
 	tprov = provenance_task(task);
 
-	if (tprov)
+	if (tprov) {
+		prov_rate_task_free(task);
 		record_terminate(RL_TERMINATE_TASK, tprov);
+	}
 }
 
 /*!
@@ -185,7 +188,7 @@ static int provenance_ptrace_access_check(struct task_struct *child,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -266,7 +269,7 @@ static void provenance_cred_free(struct cred *cred)
 {
 	struct provenance *cprov;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return;
 
 	cprov = provenance_cred(cred);
@@ -306,7 +309,7 @@ static int provenance_cred_prepare(struct cred *new,
 	node_uid(prov_elt(nprov)) = __kuid_val(new->euid);
 	node_gid(prov_elt(nprov)) = __kgid_val(new->egid);
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	spin_lock_irqsave_nested(prov_lock(old_prov), irqflags, PROVENANCE_LOCK_PROC);
@@ -369,7 +372,7 @@ static int provenance_task_fix_setuid(struct cred *new,
 	unsigned long irqflags;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	old_prov = provenance_cred(old);
@@ -409,7 +412,7 @@ static int provenance_task_setpgid(struct task_struct *p, pid_t pgid)
 	struct provenance *nprov;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -428,7 +431,7 @@ static int provenance_task_getpgid(struct task_struct *p)
 	struct provenance *nprov;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -514,7 +517,7 @@ static void provenance_inode_free_security(struct inode *inode)
 {
 	struct provenance *iprov;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return;
 
 	iprov = provenance_inode(inode);
@@ -547,7 +550,7 @@ static int provenance_inode_create(struct inode *dir,
 	unsigned long irqflags;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -599,7 +602,7 @@ static int provenance_inode_permission(struct inode *inode, int mask)
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	if (!mask)
@@ -657,7 +660,7 @@ static int provenance_inode_link(struct dentry *old_dentry,
 	unsigned long irqflags;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -689,7 +692,7 @@ static int provenance_inode_unlink(struct inode *dir, struct dentry *dentry)
 	unsigned long irqflags;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -724,7 +727,7 @@ static int provenance_inode_symlink(struct inode *dir,
 	unsigned long irqflags;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -767,7 +770,7 @@ static int provenance_inode_rename(struct inode *old_dir,
 	unsigned long irqflags;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -821,7 +824,7 @@ static int provenance_inode_setattr(struct dentry *dentry, struct iattr *iattr)
 	unsigned long irqflags;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -877,7 +880,7 @@ static int provenance_inode_getattr(const struct path *path)
 	unsigned long irqflags;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -915,7 +918,7 @@ static int provenance_inode_readlink(struct dentry *dentry)
 	unsigned long irqflags;
 	int rc;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -1013,7 +1016,7 @@ static void provenance_inode_post_setxattr(struct dentry *dentry,
 	struct provenance *iprov;
 	unsigned long irqflags;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return;
 
 	if (strcmp(name, XATTR_NAME_PROVENANCE) == 0)
@@ -1057,7 +1060,7 @@ static int provenance_inode_getxattr(struct dentry *dentry, const char *name)
 	int rc = 0;
 	unsigned long irqflags;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	if (strcmp(name, XATTR_NAME_PROVENANCE) == 0)
@@ -1099,7 +1102,7 @@ static int provenance_inode_listxattr(struct dentry *dentry)
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -1142,7 +1145,7 @@ static int provenance_inode_removexattr(struct user_namespace *mnt_userns,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -1233,6 +1236,34 @@ static int provenance_inode_listsecurity(struct inode *inode,
 	return len;
 }
 
+/*!
+ * @brief Initialise the aggregation state and the flow cache of a file when
+ * file_alloc_security hook is triggered.
+ *
+ * @param file The file structure being allocated.
+ * @return 0.
+ *
+ */
+static int provenance_file_alloc_security(struct file *file)
+{
+	prov_aggregate_init(file);
+	prov_flow_init(file);
+	return 0;
+}
+
+/*!
+ * @brief Emit the pending aggregates of a file when file_free_security hook is
+ * triggered.
+ *
+ * This hook is triggered when the file is released (i.e., on last close).
+ * @param file The file structure being released.
+ *
+ */
+static void provenance_file_free_security(struct file *file)
+{
+	prov_aggregate_flush(file);
+}
+
 /*!
  * @brief Record provenance when file_permission hook is triggered.
  *
@@ -1255,6 +1286,8 @@ static int provenance_inode_listsecurity(struct inode *inode,
  * and the requested permission from @mask,
  * record various provenance relations, including:
  * RL_WRITE, RL_READ, RL_SEARCH, RL_SND, RL_RCV, RL_EXEC.
+ * A read or write of a regular file repeating the last one handled for the
+ * file returns early, before any lock is taken (see "prov_flow_cached").
  * @param file The file structure being accessed.
  * @param mask The requested permissions.
  * @return 0 if permission is granted; -ENOMEM if inode provenance is NULL.
@@ -1267,12 +1300,20 @@ static int provenance_file_permission(struct file *file, int mask)
 	struct provenance *tprov;
 	struct provenance *iprov;
 	struct inode *inode;
-	uint32_t perms;
+	uint32_t perms, filter_gen, policy_gen;
 	unsigned long irqflags;
+	bool regular;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
+		return 0;
+
+	inode = file_inode(file);
+	perms = file_mask_to_perms(inode->i_mode, mask);
+	if (S_ISREG(inode->i_mode) && prov_flow_cached(file, perms))
 		return 0;
+	filter_gen = smp_load_acquire(&prov_filter_gen);
+	policy_gen = READ_ONCE(prov_policy_gen);
 
 	cprov = get_cred_provenance();
 	tprov = get_task_provenance(true);
@@ -1281,8 +1322,6 @@ static int provenance_file_permission(struct file *file, int mask)
 	if (!iprov)
 		return -ENOMEM;
 
-	inode = file_inode(file);
-	perms = file_mask_to_perms(inode->i_mode, mask);
 	spin_lock_irqsave_nested(prov_lock(cprov), irqflags, PROVENANCE_LOCK_PROC);
 	spin_lock_nested(prov_lock(iprov), PROVENANCE_LOCK_INODE);
 	if (is_inode_dir(inode)) {
@@ -1313,12 +1352,17 @@ static int provenance_file_permission(struct file *file, int mask)
 				goto out;
 		}
 	} else {
-		if ((perms & (FILE__WRITE | FILE__APPEND)) != 0) {
+		// Repeated reads and writes of regular files may be coalesced
+		// into an aggregate.
+		regular = S_ISREG(inode->i_mode);
+		if ((perms & (FILE__WRITE | FILE__APPEND)) != 0 &&
+		    !(regular && prov_aggregate(file, RL_WRITE, tprov, iprov))) {
 			rc = generates(RL_WRITE, cprov, tprov, iprov, file, mask);
 			if (rc < 0)
 				goto out;
 		}
-		if ((perms & (FILE__READ)) != 0) {
+		if ((perms & (FILE__READ)) != 0 &&
+		    !(regular && prov_aggregate(file, RL_READ, iprov, tprov))) {
 			rc = uses(RL_READ, iprov, tprov, cprov, file, mask);
 			if (rc < 0)
 				goto out;
@@ -1329,6 +1373,9 @@ static int provenance_file_permission(struct file *file, int mask)
 			else
 				rc = derives(RL_EXEC, iprov, cprov, file, mask);
 		}
+		if (regular && rc >= 0)
+			prov_flow_save(file, perms, filter_gen, policy_gen,
+				       tprov, cprov, iprov);
 	}
 out:
 	queue_save_provenance(iprov, file_dentry(file));
@@ -1361,7 +1408,7 @@ static int provenance_file_splice_pipe_to_pipe(struct file *in,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -1394,7 +1441,7 @@ static int provenance_kernel_read_file(struct file *file,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	tprov = get_task_provenance(true);
@@ -1457,9 +1504,10 @@ static int provenance_file_open(struct file *file)
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
+	prov_relay_throttle();
 	cprov = get_cred_provenance();
 	tprov = get_task_provenance(true);
 	iprov = get_file_provenance(file, true);
@@ -1496,7 +1544,7 @@ static int provenance_file_receive(struct file *file)
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -1529,7 +1577,7 @@ static int provenance_file_lock(struct file *file, unsigned int cmd)
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -1567,7 +1615,7 @@ static int provenance_file_send_sigiotask(struct task_struct *task,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	file = container_of(fown, struct file, f_owner);
@@ -1621,7 +1669,7 @@ static int provenance_mmap_file(struct file *file,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	if (unlikely(!file))
@@ -1677,7 +1725,7 @@ static void provenance_mmap_munmap(struct mm_struct *mm,
 	unsigned long irqflags;
 	vm_flags_t flags = vma->vm_flags;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return;
 
 	if (vm_mayshare(flags)) {       // It is a shared mmap.
@@ -1728,7 +1776,7 @@ static int provenance_file_ioctl(struct file *file,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -1785,7 +1833,7 @@ static int provenance_msg_msg_alloc_security(struct msg_msg *msg)
 	init_provenance_struct(ENT_MSG, mprov);
 	prov_elt(mprov)->msg_msg_info.type = msg->m_type;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -1813,7 +1861,7 @@ static void provenance_msg_msg_free_security(struct msg_msg *msg)
 {
 	struct provenance *mprov;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return;
 
 	mprov = provenance_msg_msg(msg);
@@ -1871,7 +1919,7 @@ static int provenance_msg_queue_msgsnd(struct kern_ipc_perm *msq,
 				       struct msg_msg *msg,
 				       int msqflg)
 {
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 	return __mq_msgsnd(msg);
 }
@@ -1892,7 +1940,7 @@ static int provenance_msg_queue_msgsnd(struct kern_ipc_perm *msq,
 static int provenance_mq_timedsend(struct inode *inode, struct msg_msg *msg,
 				   struct timespec64 *ts)
 {
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 	return __mq_msgsnd(msg);
 }
@@ -1959,7 +2007,7 @@ static int provenance_msg_queue_msgrcv(struct kern_ipc_perm *msq,
 	struct provenance *cprov;
 	struct provenance *tprov;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = provenance_cred_from_task(target);
@@ -1989,7 +2037,7 @@ static int provenance_mq_timedreceive(struct inode *inode, struct msg_msg *msg,
 	struct provenance *cprov;
 	struct provenance *tprov;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2037,7 +2085,7 @@ static int provenance_shm_alloc_security(struct kern_ipc_perm *shp)
 	init_provenance_struct(ENT_SHM, sprov);
 	prov_elt(sprov)->shm_info.mode = shp->mode;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2063,7 +2111,7 @@ static void provenance_shm_free_security(struct kern_ipc_perm *shp)
 {
 	struct provenance *sprov;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return;
 
 	sprov = provenance_ipc(shp);
@@ -2103,7 +2151,7 @@ static int provenance_shm_shmat(struct kern_ipc_perm *shp, char __user *shmaddr,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2141,7 +2189,7 @@ static void provenance_shm_shmdt(struct kern_ipc_perm *shp)
 	struct provenance *sprov;
 	unsigned long irqflags;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return;
 
 	cprov = get_cred_provenance();
@@ -2229,7 +2277,7 @@ static int provenance_socket_post_create(struct socket *sock,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2263,7 +2311,7 @@ static int provenance_socket_socketpair(struct socket *socka,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2323,7 +2371,7 @@ static int provenance_socket_bind(struct socket *sock,
 	struct provenance *iprov;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2336,7 +2384,7 @@ static int provenance_socket_bind(struct socket *sock,
 	// start tracking/propagating @iprov and @cprov
 	if (provenance_is_opaque(prov_elt(cprov)))
 		return 0;
-	rc = check_track_socket(address, addrlen, &ingress_ipv4filters, cprov, iprov);
+	rc = check_track_socket(address, addrlen, PROV_IPV4_INGRESS, cprov, iprov);
 	if (rc < 0)
 		return rc;
 	rc = record_address(address, addrlen, iprov);
@@ -2373,7 +2421,7 @@ static int provenance_socket_connect(struct socket *sock,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2387,7 +2435,7 @@ static int provenance_socket_connect(struct socket *sock,
 	spin_lock_nested(prov_lock(iprov), PROVENANCE_LOCK_INODE);
 	if (provenance_is_opaque(prov_elt(cprov)))
 		goto out;
-	rc = check_track_socket(address, addrlen, &egress_ipv4filters, cprov, iprov);
+	rc = check_track_socket(address, addrlen, PROV_IPV4_EGRESS, cprov, iprov);
 	if (rc < 0)
 		goto out;
 	rc = record_address(address, addrlen, iprov);
@@ -2420,7 +2468,7 @@ static int provenance_socket_listen(struct socket *sock, int backlog)
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2467,7 +2515,7 @@ static int provenance_socket_accept(struct socket *sock, struct socket *newsock)
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2527,7 +2575,7 @@ static int provenance_socket_sendmsg(struct socket *sock,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2605,7 +2653,7 @@ static int provenance_socket_recvmsg(struct socket *sock,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2668,7 +2716,7 @@ static int provenance_socket_sock_rcv_skb(struct sock *sk, struct sk_buff *skb)
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	if (family != PF_INET)
@@ -2724,7 +2772,7 @@ static int provenance_unix_stream_connect(struct sock *sock,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	cprov = get_cred_provenance();
@@ -2761,7 +2809,7 @@ static int provenance_unix_may_send(struct socket *sock,
 	unsigned long irqflags;
 	int rc = 0;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	iprov = get_socket_inode_provenance(sock);
@@ -2814,7 +2862,7 @@ static int provenance_bprm_creds_for_exec(struct linux_binprm *bprm)
 		return 0;
 	}
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return 0;
 
 	spin_lock_irqsave(prov_lock(iprov), irqflags);
@@ -2851,6 +2899,8 @@ static int provenance_bprm_check_security(struct linux_binprm *bprm)
 	if (!nprov)
 		return -ENOMEM;
 
+	prov_relay_throttle();
+
 	if (provenance_is_opaque(prov_elt(iprov))) {
 		set_opaque(prov_elt(nprov));
 		set_opaque(prov_elt(tprov));
@@ -2893,7 +2943,7 @@ static void provenance_bprm_committing_creds(struct linux_binprm *bprm)
 	struct provenance *nprov;
 	unsigned long irqflags;
 
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return;
 
 	tprov = get_task_provenance(true);
@@ -2962,11 +3012,13 @@ static int provenance_sb_kern_mount(struct super_block *sb)
 
 struct lsm_blob_sizes provenance_blob_sizes __lsm_ro_after_init = {
 	.lbs_cred = sizeof(struct provenance),
-	.lbs_file = sizeof(struct provenance),
+	.lbs_file = sizeof(struct provenance) +
+		    sizeof(struct prov_file_aggregate) +
+		    sizeof(struct prov_file_flows),
 	.lbs_inode = sizeof(struct provenance),
 	.lbs_ipc = sizeof(struct provenance),
 	.lbs_msg_msg = sizeof(struct provenance),
-	.lbs_task = sizeof(struct provenance),
+	.lbs_task = sizeof(struct provenance) + sizeof(struct prov_rate_bucket),
 	.lbs_superblock = sizeof(struct provenance),
 };
 
@@ -3011,6 +3063,8 @@ static struct security_hook_list provenance_hooks[] __lsm_ro_after_init = {
 	LSM_HOOK_INIT(inode_listsecurity,       provenance_inode_listsecurity),
 
 	/* file related hooks */
+	LSM_HOOK_INIT(file_alloc_security,      provenance_file_alloc_security),
+	LSM_HOOK_INIT(file_free_security,       provenance_file_free_security),
 	LSM_HOOK_INIT(file_permission,          provenance_file_permission),
 	LSM_HOOK_INIT(mmap_file,                provenance_mmap_file),
 #ifdef CONFIG_SECURITY_FLOW_FRIENDLY
@@ -3074,23 +3128,76 @@ static struct security_hook_list provenance_hooks[] __lsm_ro_after_init = {
 struct kmem_cache *provenance_cache __ro_after_init;
 struct kmem_cache *long_provenance_cache __ro_after_init;
 
-struct kmem_cache *boot_buffer_cache __ro_after_init;
-spinlock_t lock_buffer;
-LIST_HEAD(buffer_list);
-
-struct kmem_cache *long_boot_buffer_cache __ro_after_init;
-spinlock_t lock_long_buffer;
-LIST_HEAD(long_buffer_list);
-
-LIST_HEAD(ingress_ipv4filters);
-LIST_HEAD(egress_ipv4filters);
-LIST_HEAD(secctx_filters);
-LIST_HEAD(user_filters);
-LIST_HEAD(group_filters);
-LIST_HEAD(ns_filters);
+struct prov_filter_set __rcu *prov_filters;
+DEFINE_MUTEX(prov_filter_lock);
+uint32_t prov_filter_gen = 1;
+DEFINE_PER_CPU(struct prov_edge_cache_stats, prov_edge_stats);
 LIST_HEAD(provenance_query_hooks);
 
 struct capture_policy prov_policy;
+DEFINE_STATIC_KEY_FALSE(prov_enabled_key);
+DEFINE_STATIC_KEY_FALSE(prov_all_key);
+DEFINE_STATIC_KEY_TRUE(prov_compress_node_key);
+DEFINE_STATIC_KEY_TRUE(prov_compress_edge_key);
+DEFINE_STATIC_KEY_FALSE(prov_duplicate_key);
+DEFINE_STATIC_KEY_FALSE(prov_filter_key);
+static DEFINE_MUTEX(prov_policy_lock);
+uint32_t prov_policy_gen = 1;
+
+#define prov_key_set(key, value)			\
+	do {						\
+		if (value)				\
+			static_branch_enable(key);	\
+		else					\
+			static_branch_disable(key);	\
+	} while (0)
+
+/*!
+ * @brief Mirror the capture policy in the static keys tested on the hot path.
+ *
+ * Must be called, from a context that may sleep, whenever prov_policy is
+ * modified. The policy generation is incremented, invalidating the flows
+ * cached by file_permission.
+ *
+ */
+void prov_policy_update(void)
+{
+	mutex_lock(&prov_policy_lock);
+	prov_key_set(&prov_enabled_key, READ_ONCE(prov_policy.prov_enabled));
+	prov_key_set(&prov_all_key, READ_ONCE(prov_policy.prov_all));
+	prov_key_set(&prov_compress_node_key,
+		     READ_ONCE(prov_policy.should_compress_node));
+	prov_key_set(&prov_compress_edge_key,
+		     READ_ONCE(prov_policy.should_compress_edge));
+	prov_key_set(&prov_duplicate_key,
+		     READ_ONCE(prov_policy.should_duplicate));
+	prov_key_set(&prov_filter_key,
+		     READ_ONCE(prov_policy.prov_node_filter) ||
+		     READ_ONCE(prov_policy.prov_derived_filter) ||
+		     READ_ONCE(prov_policy.prov_generated_filter) ||
+		     READ_ONCE(prov_policy.prov_used_filter) ||
+		     READ_ONCE(prov_policy.prov_informed_filter) ||
+		     READ_ONCE(prov_policy.prov_propagate_node_filter) ||
+		     READ_ONCE(prov_policy.prov_propagate_derived_filter) ||
+		     READ_ONCE(prov_policy.prov_propagate_generated_filter) ||
+		     READ_ONCE(prov_policy.prov_propagate_used_filter) ||
+		     READ_ONCE(prov_policy.prov_propagate_informed_filter));
+	WRITE_ONCE(prov_policy_gen, prov_policy_gen + 1);
+	mutex_unlock(&prov_policy_lock);
+}
+
+/*!
+ * @brief Invalidate the flows cached by file_permission when a setting that
+ * is not part of the capture policy decides whether relations are recorded
+ * (e.g., rate limits or the BPF filter).
+ *
+ */
+void prov_policy_invalidate(void)
+{
+	mutex_lock(&prov_policy_lock);
+	WRITE_ONCE(prov_policy_gen, prov_policy_gen + 1);
+	mutex_unlock(&prov_policy_lock);
+}
 
 uint32_t prov_machine_id;
 uint32_t prov_boot_id;
@@ -3112,23 +3219,17 @@ static void __init init_prov_policy(void)
 	prov_policy.prov_all = false;
 	pr_info("Provenance: capture at boot off.");
 #endif
+	prov_policy_update();
 	pr_info("Provenance: policy initialization finished.");
 }
 
-static void __init init_boot_cache(void)
+static void __init init_prov_filters(void)
 {
-	pr_info("Provenance: boot cache initialization started...");
-	boot_buffer_cache = kmem_cache_create("boot_buffer_cache",
-					      sizeof(struct boot_buffer),
-					      0, SLAB_PANIC, NULL);
-	if (unlikely(!boot_buffer_cache))
-		panic("Provenance: could not allocate boot_buffer_cache.");
-	long_boot_buffer_cache = kmem_cache_create("long_boot_buffer_cache",
-						   sizeof(struct long_boot_buffer),
-						   0, SLAB_PANIC, NULL);
-	if (unlikely(!long_boot_buffer_cache))
-		panic("Provenance: could not allocate long_boot_buffer_cache.");
-	pr_info("Provenance: boot cache initialization finished.");
+	struct prov_filter_set *s = prov_filter_set_alloc();
+
+	if (!s)
+		panic("Provenance: could not allocate filter tables.");
+	RCU_INIT_POINTER(prov_filters, s);
 }
 
 static void __init init_prov_cache(void)
@@ -3151,14 +3252,14 @@ static void __init init_prov_cache(void)
  * @brief Operations to start provenance capture.
  *
  * Those operations are:
- * 1. Set up default capture policies.
+ * 1. Set up default capture policies and the filter tables.
  * 2. Machine ID is default to 1.
  * 3. Boot ID is default to 0.
  * 4. Set up kernel memory cache for regular provenance entries (NULL on
  * failure).
  * 5. Set up kernel memory cache for long provenance entries (NULL on failure).
- * 6. Set up boot buffer for regualr provenance entries (NULL on failure).
- * 7. Set up boot buffer for long provenance entries (NULL on failure).
+ * 6. Set up per-CPU boot buffer for regular provenance entries.
+ * 7. Set up per-CPU boot buffer for long provenance entries.
  * (Note that we set up boot buffer because relayfs is not ready at this point.)
  * 8. Initialize a workqueue (NULL on failure).
  * 9. Initialize security for provenance task ("task_init_provenance" function).
@@ -3173,15 +3274,14 @@ static int __init provenance_init(void)
 {
 	pr_info("Provenance: initialization started...");
 	init_prov_policy();
+	init_prov_filters();
 	prov_machine_id = 0;
 	prov_boot_id = 0;
 	epoch = kmalloc(sizeof(uint32_t), GFP_KERNEL);
 	*epoch = 1;
 	prov_written = false;
 	init_prov_cache();
-	init_boot_cache();
-	spin_lock_init(&lock_buffer);
-	spin_lock_init(&lock_long_buffer);
+	init_boot_buffer();
 	relay_initialized = false;
 	relay_ready = false;
 #ifdef CONFIG_SECURITY_PROVENANCE_PERSISTENCE
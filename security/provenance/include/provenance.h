@@ -35,18 +35,63 @@
 #include "provenance_filter.h"
 #include "provenance_query.h"
 
+/* number of ids a CPU reserves at once, by default */
+#define PROV_ID_BLOCK   64
+
 extern atomic64_t prov_relation_id;
 extern atomic64_t prov_node_id;
-extern atomic64_t prov_drop;
 extern uint32_t prov_machine_id;
 extern uint32_t prov_boot_id;
 extern uint32_t __rcu *epoch;
 extern bool prov_written;
+extern unsigned int prov_id_block;
+
+/*!
+ * @brief Range of ids reserved by a CPU from a global id counter.
+ *
+ * Ids in (next, end] remain to be handed out.
+ */
+struct prov_id_range {
+	uint64_t next;
+	uint64_t end;
+};
+
+DECLARE_PER_CPU(struct prov_id_range, prov_node_ids);
+DECLARE_PER_CPU(struct prov_id_range, prov_relation_ids);
+
+/*!
+ * @brief Hand out the next id of the current CPU range, reserving a new block
+ * of prov_id_block ids from the global counter once the range is exhausted.
+ *
+ * Ids may be allocated from interrupt context, the range is updated with
+ * interrupts disabled.
+ * @param range The per-CPU ranges.
+ * @param counter The global counter.
+ * @return A new unique id.
+ *
+ */
+static __always_inline uint64_t prov_next_id(struct prov_id_range __percpu *range,
+					     atomic64_t *counter)
+{
+	struct prov_id_range *r;
+	unsigned long flags;
+	uint64_t id;
+
+	local_irq_save(flags);
+	r = this_cpu_ptr(range);
+	if (unlikely(r->next == r->end)) {
+		r->end = atomic64_add_return(prov_id_block, counter);
+		r->next = r->end - prov_id_block;
+	}
+	id = ++r->next;
+	local_irq_restore(flags);
+	return id;
+}
 
 #define prov_next_relation_id()	\
-	((uint64_t)atomic64_inc_return(&prov_relation_id))
+	prov_next_id(&prov_relation_ids, &prov_relation_id)
 #define prov_next_node_id() \
-	((uint64_t)atomic64_inc_return(&prov_node_id))
+	prov_next_id(&prov_node_ids, &prov_node_id)
 
 enum {
 	PROVENANCE_LOCK_PROC,
@@ -58,9 +103,35 @@ enum {
 	PROVENANCE_LOCK_SOCK
 };
 
+#define PROV_EDGE_CACHE_SIZE    4
+
+/*!
+ * @brief The recent incoming edges of a node, used to compress edges.
+ *
+ * Each entry holds the id and version of the source node and the type of an
+ * edge; entries are replaced in round-robin order, next is the next to go.
+ */
+struct prov_edge_cache {
+	uint64_t id[PROV_EDGE_CACHE_SIZE];
+	uint64_t type[PROV_EDGE_CACHE_SIZE];
+	uint32_t version[PROV_EDGE_CACHE_SIZE];
+	uint8_t next;
+};
+
 struct provenance {
 	union prov_elt msg;
 	spinlock_t lock;
+	/* op value cached by apply_target() and the inputs it depends on */
+	uint32_t target_gen;
+	uint32_t target_uid;
+	uint32_t target_gid;
+	uint32_t target_secid;
+	uint8_t target_op;
+	/* op value of the cgroup of a task, see update_task_cgroup() */
+	uint64_t cgroup_id;
+	uint32_t cgroup_gen;
+	uint8_t cgroup_op;
+	struct prov_edge_cache edges;
 };
 
 #define prov_elt(provenance)            (&(provenance->msg))
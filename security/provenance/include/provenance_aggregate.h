@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_AGGREGATE_H
+#define _PROVENANCE_AGGREGATE_H
+
+#include <linux/jump_label.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "provenance.h"
+#include "provenance_bpf.h"
+#include "provenance_filter.h"
+
+#define PROV_AGGREGATE_READ     0
+#define PROV_AGGREGATE_WRITE    1
+
+/*!
+ * @brief A flow being aggregated.
+ *
+ * The window starts at start (monotonic), when the flow between snd and rcv
+ * is recorded; the following identical flows are only counted, the first and
+ * last of them at first and last (real time), starting at file offset offset
+ * and moving it by bytes in total.
+ * type is 0 when no window is open.
+ */
+struct prov_aggregate {
+	uint64_t type;
+	union prov_identifier snd;
+	union prov_identifier rcv;
+	uint64_t task_id;
+	uint64_t flags;
+	int64_t offset;
+	uint64_t bytes;
+	uint64_t count;
+	uint64_t start;
+	uint64_t first;
+	uint64_t last;
+};
+
+/*!
+ * @brief The aggregation state of an open file, stored after its provenance
+ * in the file security blob.
+ *
+ * Reads and writes share the file offset: the offset moved from pos by the
+ * last coalesced flow is credited to the aggregate credit (NULL if the last
+ * flow was not coalesced) when the next flow of either direction is seen.
+ */
+struct prov_file_aggregate {
+	spinlock_t lock;
+	struct prov_aggregate *credit;
+	int64_t pos;
+	struct prov_aggregate flows[2];
+};
+
+/*
+ * Enabled while an aggregation window is configured, reads and writes of
+ * regular files are then checked by "__prov_aggregate".
+ */
+DECLARE_STATIC_KEY_FALSE(prov_aggregate_key);
+
+#define prov_aggregate_enabled()        static_branch_unlikely(&prov_aggregate_key)
+
+static inline struct prov_file_aggregate *provenance_file_aggregate(
+	const struct file *file)
+{
+	return (struct prov_file_aggregate *)(provenance_file(file) + 1);
+}
+
+void prov_aggregate_init(const struct file *file);
+bool __prov_aggregate(const struct file *file, const uint64_t type,
+		      prov_entry_t *from, prov_entry_t *to);
+void __prov_aggregate_start(const struct file *file, const uint64_t type,
+			    prov_entry_t *from, prov_entry_t *to,
+			    const uint64_t flags);
+void prov_aggregate_flush(const struct file *file);
+int prov_aggregate_set(uint32_t window);
+uint32_t prov_aggregate_get(void);
+
+/*!
+ * @brief Whether a read or write of a file is coalesced into an open window.
+ *
+ * A flow is coalesced if it is identical (same type and same versions of its
+ * end nodes) to the flow that opened the window, and the window has not
+ * expired; a pending aggregate is otherwise emitted and the window closed.
+ * Called with the node locks held.
+ * @param file The file being read or written.
+ * @param type RL_READ or RL_WRITE.
+ * @param from The source node of the flow.
+ * @param to The destination node of the flow.
+ * @return true if the flow must not be recorded.
+ *
+ */
+static __always_inline bool prov_aggregate(const struct file *file,
+					   const uint64_t type,
+					   struct provenance *from,
+					   struct provenance *to)
+{
+	if (!prov_aggregate_enabled())
+		return false;
+	return __prov_aggregate(file, type, prov_entry(from), prov_entry(to));
+}
+
+/*!
+ * @brief Open an aggregation window on a recorded read or write of a file.
+ *
+ * Only relations that pass the filters are aggregated, and none while the BPF
+ * record filter is enabled as it must see every relation.
+ */
+static __always_inline void prov_aggregate_start(const uint64_t type,
+						 prov_entry_t *from,
+						 prov_entry_t *to,
+						 const struct file *file,
+						 const uint64_t flags)
+{
+	if (!prov_aggregate_enabled() || !file)
+		return;
+	if (type != RL_READ && type != RL_WRITE)
+		return;
+	if (!S_ISREG(file_inode(file)->i_mode))
+		return;
+	if (prov_bpf_filtered() || !should_record_relation(type, from, to))
+		return;
+	__prov_aggregate_start(file, type, from, to, flags);
+}
+#endif
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_BPF_H
+#define _PROVENANCE_BPF_H
+
+#include <linux/jump_label.h>
+#include <uapi/linux/provenance.h>
+#include <uapi/linux/provenance_fs.h>
+
+struct file;
+
+#ifdef CONFIG_SECURITY_PROVENANCE_BPF
+/*
+ * Set while a program is expected to be attached to "prov_bpf_record";
+ * relations are only handed to it when the key is enabled.
+ */
+DECLARE_STATIC_KEY_FALSE(prov_bpf_key);
+
+#define prov_bpf_filtered()     static_branch_unlikely(&prov_bpf_key)
+
+int prov_bpf_record(const union prov_elt *relation,
+		    const prov_entry_t *from,
+		    const prov_entry_t *to);
+int prov_bpf_write_relation(const uint64_t type,
+			    prov_entry_t *from,
+			    prov_entry_t *to,
+			    const struct file *file,
+			    const uint64_t flags);
+void prov_bpf_set(bool enabled);
+#else
+#define prov_bpf_filtered()     false
+
+static inline int prov_bpf_record(const union prov_elt *relation,
+				  const prov_entry_t *from,
+				  const prov_entry_t *to)
+{
+	return PROV_BPF_KEEP;
+}
+
+static inline int prov_bpf_write_relation(const uint64_t type,
+					  prov_entry_t *from,
+					  prov_entry_t *to,
+					  const struct file *file,
+					  const uint64_t flags)
+{
+	return 0;
+}
+#endif
+#endif
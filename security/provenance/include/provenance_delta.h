@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_DELTA_H
+#define _PROVENANCE_DELTA_H
+
+#include <linux/percpu.h>
+#include <uapi/linux/provenance.h>
+
+/*!
+ * @brief Last version of a node written by a CPU, as seen by consumers.
+ *
+ * An entry is only valid if gen matches the current generation of the CPU,
+ * i.e., no element was dropped or delayed on this CPU since it was written.
+ * type is 0 for an empty entry.
+ */
+struct prov_delta_entry {
+	uint64_t type;
+	uint64_t id;
+	uint32_t version;
+	uint32_t gen;
+	uint64_t words[PROV_DELTA_SPAN];
+};
+
+DECLARE_PER_CPU(unsigned int, prov_delta_gen);
+
+void prov_write_node(union prov_elt *node);
+void prov_delta_invalidate_all(void);
+void prov_delta_suspend(void);
+void prov_delta_resume(void);
+void __init prov_delta_init(void);
+
+/*!
+ * @brief Invalidate the node versions cached by the current CPU.
+ *
+ * Called when an element written on this CPU is dropped or delayed, as
+ * consumers may then miss the version a delta would be based on.
+ * Must be called with interrupts disabled.
+ *
+ */
+static __always_inline void prov_delta_invalidate(void)
+{
+	__this_cpu_inc(prov_delta_gen);
+}
+#endif
@@ -15,11 +15,16 @@
 #ifndef _PROVENANCE_FILTER_H
 #define _PROVENANCE_FILTER_H
 
+#include <linux/cgroup.h>
+#include <linux/mutex.h>
+#include <linux/rhashtable.h>
+#include <linux/slab.h>
 #include <uapi/linux/provenance.h>
 #include <uapi/linux/provenance_fs.h>
 
 #include "provenance_policy.h"
 #include "provenance_ns.h"
+#include "provenance_lpm.h"
 
 #define HIT_FILTER(filter, data)        ((filter & data) != 0)
 
@@ -45,11 +50,12 @@
  */
 static __always_inline bool __filter_node(uint64_t filter, prov_entry_t *node)
 {
-	if (!prov_policy.prov_enabled)
+	if (!prov_policy_enabled())
 		return true;
 	if (provenance_is_opaque(node))
 		return true;
-	if (HIT_FILTER(filter, node_identifier(node).type))
+	if (prov_policy_filtered() &&
+	    HIT_FILTER(filter, node_identifier(node).type))
 		return true;
 	return false;
 }
@@ -90,6 +96,8 @@ static __always_inline bool filter_update_node(const uint64_t relation_type)
  */
 static __always_inline bool filter_relation(const uint64_t type)
 {
+	if (!prov_policy_filtered())
+		return false;
 	if (prov_is_derived(type)) {
 		if (HIT_FILTER(prov_policy.prov_derived_filter, type))
 			return true;
@@ -122,6 +130,8 @@ static __always_inline bool filter_relation(const uint64_t type)
  */
 static __always_inline bool filter_propagate_relation(uint64_t type)
 {
+	if (!prov_policy_filtered())
+		return false;
 	if (prov_is_derived(type)) {
 		if (HIT_FILTER(prov_policy.prov_propagate_derived_filter, type))
 			return true;
@@ -168,76 +178,167 @@ static __always_inline bool should_record_relation(const uint64_t type,
 }
 
 /*!
- * @brief Define an abstract list. See concrete example below.
+ * @brief Serializes the writers of the filters.
+ *
+ * Readers only hold rcu_read_lock; the filter lists, from which the lookup
+ * structures are built, are kept in insertion order for the securityfs reads
+ * and the policy hash, and are only walked under this mutex.
+ */
+extern struct mutex prov_filter_lock;
+
+/*!
+ * @brief Generation of the filters, never 0.
+ *
+ * Bumped, once the new filters are visible, whenever a filter changes so that
+ * the op values cached in the nodes are recomputed.
  */
-#define declare_filter_list(filter_name, type) \
-	struct filter_name {		       \
-		struct list_head list;	       \
-		struct type filter;	       \
-	};				       \
-	extern struct list_head filter_name;
+extern uint32_t prov_filter_gen;
+
+/*!
+ * @brief Invalidate the op values cached in the nodes.
+ *
+ * Must be called with prov_filter_lock held, after the modified filters have
+ * been published.
+ *
+ */
+static inline void prov_filter_changed(void)
+{
+	uint32_t gen = prov_filter_gen + 1;
+
+	lockdep_assert_held(&prov_filter_lock);
+
+	if (unlikely(!gen))
+		gen = 1;
+	smp_store_release(&prov_filter_gen, gen);
+}
+
+/*!
+ * @brief The filters of the capture policy.
+ *
+ * The set is published in prov_filters and read under rcu_read_lock; a policy
+ * load (see prov_policy_load) replaces it as a whole. Filters are otherwise
+ * modified in place, one at a time, with prov_filter_lock held.
+ * The lists hold the filters in insertion order, the other members are the
+ * structures they are looked up from.
+ */
+struct prov_filter_set {
+	struct list_head ipv4[2];
+	struct prov_lpm_trie __rcu *ipv4trie[2];
+	struct list_head ns_filters;
+	struct prov_ns_matcher __rcu *ns_matcher;
+	struct list_head secctx_filters;
+	struct rhashtable secctx_filters_table;
+	struct list_head user_filters;
+	struct rhashtable user_filters_table;
+	struct list_head group_filters;
+	struct rhashtable group_filters_table;
+	struct list_head cgroup_filters;
+	struct rhashtable cgroup_filters_table;
+};
+
+#define PROV_IPV4_INGRESS       0
+#define PROV_IPV4_EGRESS        1
+
+extern struct prov_filter_set __rcu *prov_filters;
+
+#define prov_filters_locked() \
+	rcu_dereference_protected(prov_filters, lockdep_is_held(&prov_filter_lock))
+
+struct prov_filter_set *prov_filter_set_alloc(void);
+void prov_filter_set_free(struct prov_filter_set *s);
+int prov_policy_load(void *blob, size_t size);
+ssize_t prov_policy_digest(uint8_t *buf, size_t size);
+
+/*!
+ * @brief Define an abstract filter table, hashed on variable.
+ * See concrete example below.
+ */
+#define declare_filter_list(filter_name, type, variable)			\
+	struct filter_name {							\
+		struct list_head list;						\
+		struct rhash_head node;						\
+		struct rcu_head rcu;						\
+		struct type filter;						\
+	};									\
+	static const struct rhashtable_params filter_name ## _params = {	\
+		.key_len = sizeof_field(struct filter_name, filter.variable),	\
+		.key_offset = offsetof(struct filter_name, filter.variable),	\
+		.head_offset = offsetof(struct filter_name, node),		\
+		.automatic_shrinking = true,					\
+	};
 
 /*!
  * @brief Define an abstract operation that returns op value of an item in a
- * list. See concrete example below.
+ * table. Called under rcu_read_lock. See concrete example below.
  */
-#define declare_filter_whichOP(function_name, type, variable)		\
-	static __always_inline uint8_t function_name(uint32_t variable)	\
-	{								\
-		struct list_head *listentry, *listtmp;			\
-		struct type *tmp;					\
-		list_for_each_safe(listentry, listtmp, &type) {		\
-			tmp = list_entry(listentry, struct type, list);	\
-			if (tmp->filter.variable == variable) {		\
-				return tmp->filter.op; }		\
-		}							\
-		return 0;						\
+#define declare_filter_whichOP(function_name, type, variable)			\
+	static __always_inline uint8_t function_name(struct prov_filter_set *s,	\
+						     typeof_member(struct type,	\
+								   filter.variable) \
+						     variable)			\
+	{									\
+		struct type *tmp;						\
+		tmp = rhashtable_lookup(&s->type ## _table, &variable,		\
+					type ## _params);			\
+		if (tmp)							\
+			return READ_ONCE(tmp->filter.op);			\
+		return 0;							\
 	}
 
 /*!
- * @brief Define an abstract operation that deletes an item from a list.
- * See concrete example below.
+ * @brief Define an abstract operation that deletes an item from a table.
+ * Called with prov_filter_lock held, f is consumed. See concrete example below.
  */
-#define declare_filter_delete(function_name, type, variable)		  \
-	static __always_inline uint8_t function_name(struct type *f)	  \
-	{								  \
-		struct list_head *listentry, *listtmp;			  \
-		struct type *tmp;					  \
-		list_for_each_safe(listentry, listtmp, &type) {		  \
-			tmp = list_entry(listentry, struct type, list);	  \
-			if (tmp->filter.variable == f->filter.variable) { \
-				list_del(listentry);			  \
-				kfree(tmp);				  \
-				return 0;				  \
-			}						  \
-		}							  \
-		return 0;						  \
+#define declare_filter_delete(function_name, type, variable)			\
+	static inline int function_name(struct prov_filter_set *s,		\
+					struct type *f)				\
+	{									\
+		struct type *tmp;						\
+		tmp = rhashtable_lookup_fast(&s->type ## _table,		\
+					     &f->filter.variable,		\
+					     type ## _params);			\
+		if (tmp) {							\
+			rhashtable_remove_fast(&s->type ## _table, &tmp->node,	\
+					       type ## _params);		\
+			list_del(&tmp->list);					\
+			kfree_rcu(tmp, rcu);					\
+		}								\
+		kfree(f);							\
+		return 0;							\
 	}
 
 /*!
  * @brief Define an abstract operation that adds/updates the op value of an item
- * from a list. See concrete example below.
+ * from a table. Called with prov_filter_lock held, f is consumed.
+ * See concrete example below.
  */
-#define declare_filter_add_or_update(function_name, type, variable)	  \
-	static __always_inline uint8_t function_name(struct type *f)	  \
-	{								  \
-		struct list_head *listentry, *listtmp;			  \
-		struct type *tmp;					  \
-		list_for_each_safe(listentry, listtmp, &type) {		  \
-			tmp = list_entry(listentry, struct type, list);	  \
-			if (tmp->filter.variable == f->filter.variable) { \
-				tmp->filter.op = f->filter.op;		  \
-				return 0;				  \
-			}						  \
-		}							  \
-		list_add_tail(&(f->list), &type);			  \
-		return 0;						  \
+#define declare_filter_add_or_update(function_name, type, variable)		\
+	static inline int function_name(struct prov_filter_set *s,		\
+					struct type *f)				\
+	{									\
+		struct type *tmp;						\
+		int rc;								\
+		tmp = rhashtable_lookup_fast(&s->type ## _table,		\
+					     &f->filter.variable,		\
+					     type ## _params);			\
+		if (tmp) {							\
+			WRITE_ONCE(tmp->filter.op, f->filter.op);		\
+			kfree(f);						\
+			return 0;						\
+		}								\
+		rc = rhashtable_insert_fast(&s->type ## _table, &f->node,	\
+					    type ## _params);			\
+		if (!rc)							\
+			list_add_tail(&f->list, &s->type);			\
+		else								\
+			kfree(f);						\
+		return rc;							\
 	}
 /*
- * A list of secinfo structs (defined in /include/uapi/linux/provenance.h, same
+ * A table of secinfo structs (defined in /include/uapi/linux/provenance.h, same
  * as the following)
  */
-declare_filter_list(secctx_filters, secinfo);
+declare_filter_list(secctx_filters, secinfo, secid);
 
 /*
  * Return op value of an item of a specific secid in the secctx_filters list if
@@ -260,7 +361,7 @@ declare_filter_add_or_update(prov_secctx_add_or_update, secctx_filters, secid);
 /*!
  * @brief Same set of operations as above but operate on "userinfo" list.
  */
-declare_filter_list(user_filters, userinfo);
+declare_filter_list(user_filters, userinfo, uid);
 declare_filter_whichOP(prov_uid_whichOP, user_filters, uid);
 declare_filter_delete(prov_uid_delete, user_filters, uid);
 declare_filter_add_or_update(prov_uid_add_or_update, user_filters, uid);
@@ -268,14 +369,51 @@ declare_filter_add_or_update(prov_uid_add_or_update, user_filters, uid);
 /*!
  * @brief Same set of operations as above but operate on "groupinfo" list.
  */
-declare_filter_list(group_filters, groupinfo);
+declare_filter_list(group_filters, groupinfo, gid);
 declare_filter_whichOP(prov_gid_whichOP, group_filters, gid);
 declare_filter_delete(prov_gid_delete, group_filters, gid);
 declare_filter_add_or_update(prov_gid_add_or_update, group_filters, gid);
 
 /*!
- * @brief Based on "op" value of a provenance node, decide whether it should be
- * tracked/propagated/opaque.
+ * @brief Same set of operations as above but operate on "cgroupinfo" list.
+ */
+declare_filter_list(cgroup_filters, cgroupinfo, cgroupid);
+declare_filter_whichOP(__prov_cgroup_whichOP, cgroup_filters, cgroupid);
+declare_filter_delete(prov_cgroup_delete, cgroup_filters, cgroupid);
+declare_filter_add_or_update(prov_cgroup_add_or_update, cgroup_filters, cgroupid);
+
+#ifdef CONFIG_CGROUPS
+/*!
+ * @brief Return the op value of the closest filtered ancestor of a cgroup.
+ *
+ * The cgroup itself is looked up first, then its ancestors up to the root; a
+ * filter on a cgroup therefore covers its whole subtree, unless a more
+ * specific filter applies. Called under rcu_read_lock.
+ * @param s The filter set.
+ * @param cgrp The cgroup (in the default hierarchy).
+ * @return The op value or 0 if no filter applies.
+ *
+ */
+static __always_inline uint8_t prov_cgroup_whichOP(struct prov_filter_set *s,
+						   struct cgroup *cgrp)
+{
+	uint8_t op;
+	int level;
+
+	if (!atomic_read(&s->cgroup_filters_table.nelems))
+		return 0;
+	for (level = cgrp->level; level >= 0; level--) {
+		op = __prov_cgroup_whichOP(s, cgrp->ancestor_ids[level]);
+		if (op)
+			return op;
+	}
+	return 0;
+}
+#endif
+
+/*!
+ * @brief Compute the "op" value of a provenance node, which decides whether it
+ * should be tracked/propagated/opaque.
  *
  * "op" value is contingent upon "op" values of:
  * 1. ns (i.e., namespace) elements: ipcns, mntns, pidns, netns, cgroupns,
@@ -283,16 +421,23 @@ declare_filter_add_or_update(prov_gid_add_or_update, group_filters, gid);
  * 2. secctx (i.e., security context) element if it has secctx, and
  * 3. uid element if it has uid, and
  * 4. gid element if it has gid.
+ * The op value of the cgroup of a task is resolved separately, see
+ * update_task_cgroup.
  * @param prov The provenance node in question.
+ * @return The op value.
  *
  */
-static __always_inline void apply_target(union prov_elt *prov)
+static __always_inline uint8_t target_op(union prov_elt *prov)
 {
+	struct prov_filter_set *s;
 	uint8_t op = 0;
 
+	rcu_read_lock();
+	s = rcu_dereference(prov_filters);
 	// track based on ns
 	if (prov_type(prov) == ACT_TASK)
-		op |= prov_ns_whichOP(prov->task_info.utsns,
+		op |= prov_ns_whichOP(&s->ns_matcher,
+				      prov->task_info.utsns,
 				      prov->task_info.ipcns,
 				      prov->task_info.mntns,
 				      prov->task_info.pidns,
@@ -300,20 +445,13 @@ static __always_inline void apply_target(union prov_elt *prov)
 				      prov->task_info.cgroupns);
 
 	if (prov_has_secid(node_type(prov)))
-		op |= prov_secctx_whichOP(node_secid(prov));
+		op |= prov_secctx_whichOP(s, node_secid(prov));
 
 	if (prov_has_uidgid(node_type(prov))) {
-		op |= prov_uid_whichOP(node_uid(prov));
-		op |= prov_gid_whichOP(node_gid(prov));
-	}
-
-	if (unlikely(op != 0)) {
-		if ((op & PROV_SET_TRACKED) != 0)
-			set_tracked(prov);
-		if ((op & PROV_SET_PROPAGATE) != 0)
-			set_propagate(prov);
-		if ((op & PROV_SET_OPAQUE) != 0)
-			set_opaque(prov);
+		op |= prov_uid_whichOP(s, node_uid(prov));
+		op |= prov_gid_whichOP(s, node_gid(prov));
 	}
+	rcu_read_unlock();
+	return op;
 }
 #endif
@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_FLOW_H
+#define _PROVENANCE_FLOW_H
+
+#include <linux/cgroup.h>
+#include <linux/fs.h>
+#include <linux/nsproxy.h>
+#include <linux/seqlock.h>
+
+#include "provenance.h"
+#include "provenance_aggregate.h"
+#include "provenance_bpf.h"
+#include "provenance_filter.h"
+#include "provenance_inode.h"
+#include "provenance_policy.h"
+#include "provenance_rate.h"
+
+#define PROV_FLOW_READ          0
+#define PROV_FLOW_WRITE         1
+
+/*!
+ * @brief The state of a node at the end of a recorded flow.
+ */
+struct prov_flow_node {
+	uint64_t id;
+	uint32_t version;
+	uint32_t flag;
+};
+
+/*!
+ * @brief The last read or write of an open file handled on the slow path.
+ *
+ * The flow is identified by the permissions requested, the task, cred and
+ * inode nodes in the state they were left in, and the context deciding
+ * whether and how it is recorded (filter and policy generations, namespaces
+ * and cgroups of the task). perms is 0 when no flow is cached.
+ */
+struct prov_flow {
+	uint32_t perms;
+	uint32_t filter_gen;
+	uint32_t policy_gen;
+	struct prov_flow_node task;
+	struct prov_flow_node cred;
+	struct prov_flow_node inode;
+	const void *nsproxy;
+	const void *cgroups;
+};
+
+/*!
+ * @brief The flows cached for an open file, stored after its aggregation state
+ * in the file security blob.
+ *
+ * Updates are serialised by the lock of the inode provenance, readers validate
+ * their copy with seq and never wait.
+ */
+struct prov_file_flows {
+	seqcount_t seq;
+	struct prov_flow flows[2];
+};
+
+static inline struct prov_file_flows *provenance_file_flows(
+	const struct file *file)
+{
+	return (struct prov_file_flows *)(provenance_file_aggregate(file) + 1);
+}
+
+static inline void prov_flow_init(const struct file *file)
+{
+	struct prov_file_flows *ff = provenance_file_flows(file);
+
+	// the security blob is not zeroed
+	memset(ff, 0, sizeof(struct prov_file_flows));
+	seqcount_init(&ff->seq);
+}
+
+static __always_inline struct prov_flow *prov_flow_slot(
+	struct prov_file_flows *ff, uint32_t perms)
+{
+	return &ff->flows[(perms & FILE__READ) ? PROV_FLOW_READ :
+			  PROV_FLOW_WRITE];
+}
+
+static __always_inline void prov_flow_node_get(struct prov_flow_node *n,
+					       struct provenance *prov)
+{
+	union prov_elt *elt = prov_elt(prov);
+
+	n->id = READ_ONCE(node_identifier(elt).id);
+	n->version = READ_ONCE(node_identifier(elt).version);
+	n->flag = READ_ONCE(prov_flag(elt));
+}
+
+static __always_inline void prov_flow_get(struct prov_flow *flow,
+					  uint32_t perms,
+					  uint32_t filter_gen,
+					  uint32_t policy_gen,
+					  struct provenance *tprov,
+					  struct provenance *cprov,
+					  struct provenance *iprov)
+{
+	flow->perms = perms;
+	flow->filter_gen = filter_gen;
+	flow->policy_gen = policy_gen;
+	prov_flow_node_get(&flow->task, tprov);
+	prov_flow_node_get(&flow->cred, cprov);
+	prov_flow_node_get(&flow->inode, iprov);
+	flow->nsproxy = READ_ONCE(current->nsproxy);
+#ifdef CONFIG_CGROUPS
+	flow->cgroups = rcu_access_pointer(current->cgroups);
+#else
+	flow->cgroups = NULL;
+#endif
+}
+
+static __always_inline bool prov_flow_equal(const struct prov_flow *a,
+					    const struct prov_flow *b)
+{
+	return a->perms == b->perms &&
+	       a->filter_gen == b->filter_gen &&
+	       a->policy_gen == b->policy_gen &&
+	       !memcmp(&a->task, &b->task, sizeof(struct prov_flow_node)) &&
+	       !memcmp(&a->cred, &b->cred, sizeof(struct prov_flow_node)) &&
+	       !memcmp(&a->inode, &b->inode, sizeof(struct prov_flow_node)) &&
+	       a->nsproxy == b->nsproxy &&
+	       a->cgroups == b->cgroups;
+}
+
+/*!
+ * @brief Whether the fast path of file_permission may be used.
+ *
+ * The fast path only skips flows the slow path would compress; it is not used
+ * while flows are aggregated, as every flow must then be counted, nor while
+ * relations are rate limited or handed to a BPF filter, as the slow path may
+ * then not record a flow it has handled.
+ * perms must be a plain read or a plain write.
+ */
+static __always_inline bool prov_flow_enabled(uint32_t perms)
+{
+	if (!prov_policy_compress_edge() || prov_aggregate_enabled() ||
+	    prov_rate_limited() || prov_bpf_filtered())
+		return false;
+	return perms == FILE__READ ||
+	       (perms && !(perms & ~(FILE__WRITE | FILE__APPEND)));
+}
+
+/*!
+ * @brief Whether a read or write of a regular file repeats the flow cached
+ * for the file.
+ *
+ * A repeated flow finds the task, cred and inode nodes in the state the
+ * previous one left them in, under the same filters and policy; all the
+ * relations it would generate have then already been recorded, and it can
+ * be ignored without taking any lock or refreshing any node.
+ * This check is lockless: the cached flow is copied and validated with the
+ * sequence counter of the file, and a concurrent update is treated as a
+ * miss.
+ * @param file The file being read or written.
+ * @param perms The permissions requested.
+ * @return true if the flow does not need to be recorded.
+ *
+ */
+static __always_inline bool prov_flow_cached(const struct file *file,
+					     uint32_t perms)
+{
+	struct prov_file_flows *ff;
+	struct prov_flow now, last;
+	unsigned int seq;
+
+	if (!prov_flow_enabled(perms))
+		return false;
+	ff = provenance_file_flows(file);
+	seq = raw_read_seqcount(&ff->seq);
+	if (seq & 1)
+		return false;
+	last = *prov_flow_slot(ff, perms);
+	if (read_seqcount_retry(&ff->seq, seq) || last.perms != perms)
+		return false;
+	prov_flow_get(&now, perms, smp_load_acquire(&prov_filter_gen),
+		      READ_ONCE(prov_policy_gen),
+		      provenance_task(current),
+		      provenance_cred(current_cred()),
+		      provenance_inode(file_inode(file)));
+	return prov_flow_equal(&now, &last);
+}
+
+/*!
+ * @brief Cache the flow handled by the slow path of file_permission.
+ *
+ * Called with the inode provenance lock held, once the flow has been
+ * recorded, with the generations read before it was.
+ *
+ */
+static __always_inline void prov_flow_save(const struct file *file,
+					   uint32_t perms,
+					   uint32_t filter_gen,
+					   uint32_t policy_gen,
+					   struct provenance *tprov,
+					   struct provenance *cprov,
+					   struct provenance *iprov)
+{
+	struct prov_file_flows *ff;
+	struct prov_flow flow;
+
+	if (!prov_flow_enabled(perms))
+		return;
+	ff = provenance_file_flows(file);
+	prov_flow_get(&flow, perms, filter_gen, policy_gen,
+		      tprov, cprov, iprov);
+	write_seqcount_begin(&ff->seq);
+	*prov_flow_slot(ff, perms) = flow;
+	write_seqcount_end(&ff->seq);
+}
+#endif
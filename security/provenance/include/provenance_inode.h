@@ -421,7 +421,8 @@ static inline void save_provenance(struct dentry *dentry)
  * 1. If any of the cred, task, and inode provenance are not tracked and if the
  * capture all is not set, or
  * 2. If the relation @type should not be recorded, or
- * 3. Failure occurred.
+ * 3. If the relation @type is suppressed by a rate limit, or
+ * 4. Failure occurred.
  * xattr name and value pair is recorded in the long provenance entry.
  * @param type The type of relation to be recorded.
  * @param iprov The inode provenance entry.
@@ -451,7 +452,7 @@ static __always_inline int record_write_xattr(uint64_t type,
 	if (!provenance_is_tracked(prov_elt(iprov))
 	    && !provenance_is_tracked(prov_elt(tprov))
 	    && !provenance_is_tracked(prov_elt(cprov))
-	    && !prov_policy.prov_all)
+	    && !prov_policy_all())
 		return 0;
 	if (!should_record_relation(type, prov_entry(cprov), prov_entry(iprov)))
 		return 0;
@@ -512,7 +513,8 @@ out:
  * 1. If any of the cred, task, and inode provenance are not tracked and if the
  * capture all is not set, or
  * 2. If the relation RL_GETXATTR should not be recorded, or
- * 3. Failure occurred.
+ * 3. If the relation RL_GETXATTR is suppressed by a rate limit, or
+ * 4. Failure occurred.
  * @param cprov The cred provenance entry.
  * @param tprov The task provenance entry.
  * @param name The name of the extended attribute.
@@ -532,7 +534,7 @@ static __always_inline int record_read_xattr(struct provenance *cprov,
 	if (!provenance_is_tracked(prov_elt(iprov))
 	    && !provenance_is_tracked(prov_elt(tprov))
 	    && !provenance_is_tracked(prov_elt(cprov))
-	    && !prov_policy.prov_all)
+	    && !prov_policy_all())
 		return 0;
 	if (!should_record_relation(RL_GETXATTR, prov_entry(iprov),
 				    prov_entry(cprov)))
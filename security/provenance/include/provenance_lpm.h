@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_LPM_H
+#define _PROVENANCE_LPM_H
+
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/types.h>
+#include <asm/byteorder.h>
+
+#define PROV_LPM_NONE           U32_MAX
+#define PROV_LPM_ANY_PORT       0x01
+
+/*!
+ * @brief A node of a path-compressed IPv4 prefix trie.
+ *
+ * prefix is in host order and only its first len bits are set.
+ * A node holding rules has either PROV_LPM_ANY_PORT set in flags, with the op
+ * of the rule matching any port in op, or nr_ports rules for specific ports
+ * starting at ports in the port table of the trie, sorted by port.
+ */
+struct prov_lpm_node {
+	uint32_t prefix;
+	uint8_t len;
+	uint8_t flags;
+	uint8_t op;
+	uint16_t nr_ports;
+	uint32_t ports;
+	uint32_t child[2];
+};
+
+struct prov_lpm_port {
+	uint16_t port;
+	uint8_t op;
+};
+
+/*!
+ * @brief An immutable IPv4 filter trie.
+ *
+ * Tries are rebuilt from the filter list whenever the list is modified and
+ * published with RCU; readers never see a partially built trie.
+ */
+struct prov_lpm_trie {
+	struct rcu_head rcu;
+	uint32_t root;
+	uint32_t nr_nodes;
+	struct prov_lpm_node *nodes;
+	struct prov_lpm_port *ports;
+};
+
+struct prov_ipv4_filter;
+
+uint8_t __prov_lpm_lookup(struct prov_lpm_trie __rcu **trie, uint32_t ip,
+			  uint16_t port);
+int prov_lpm_rebuild(struct list_head *filters,
+		     struct prov_lpm_trie __rcu **trie);
+int prov_lpm_filters(struct prov_ipv4_filter *rules, size_t nr,
+		     struct list_head *filters);
+
+/*!
+ * @brief Whether an IPv4 mask, in network order, is a CIDR prefix.
+ */
+static inline bool prov_lpm_mask_valid(uint32_t mask)
+{
+	uint32_t host = ~be32_to_cpu((__force __be32)mask);
+
+	return (host & (host + 1)) == 0;
+}
+
+/*!
+ * @brief Return the op value of the most specific filter matching an address.
+ *
+ * @param trie The trie of the filters.
+ * @param ip The IP to match, in network order.
+ * @param port The port to match, in network order.
+ * @return 0 if no filter matches, the op of the longest matching prefix
+ * otherwise; a rule for the port takes precedence over a rule for any port
+ * on the same prefix.
+ *
+ */
+static __always_inline uint8_t prov_lpm_lookup(struct prov_lpm_trie __rcu **trie,
+					       uint32_t ip,
+					       uint16_t port)
+{
+	if (!rcu_access_pointer(*trie))
+		return 0;
+	return __prov_lpm_lookup(trie, ip, port);
+}
+#endif
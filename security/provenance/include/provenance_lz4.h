@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_LZ4_H
+#define _PROVENANCE_LZ4_H
+
+#include <linux/relay.h>
+#include <linux/workqueue.h>
+
+struct prov_channel;
+
+/*!
+ * @brief Per-CPU compression state of a channel.
+ *
+ * Only work writes to the compressed relay buffer of cpu; sub-buffers are
+ * compressed into scratch before being copied to the relay buffer.
+ */
+struct prov_lz4_cpu {
+	struct work_struct work;
+	struct prov_channel *pc;
+	int cpu;
+	void *wrkmem;
+	void *scratch;
+};
+
+/*!
+ * @brief Compression state of a channel.
+ *
+ * chan is the "<channel>_lz4" relay receiving the compressed frames.
+ */
+struct prov_lz4 {
+	struct rchan *chan;
+	atomic64_t dropped;
+	struct prov_lz4_cpu __percpu *cpus;
+};
+
+#ifdef CONFIG_SECURITY_PROVENANCE_LZ4
+bool prov_lz4_enabled(void);
+int prov_lz4_open(struct prov_channel *pc);
+void prov_lz4_close(struct prov_channel *pc);
+void prov_lz4_queue(struct prov_channel *pc, struct rchan_buf *buf);
+#else
+static inline bool prov_lz4_enabled(void)
+{
+	return false;
+}
+
+static inline int prov_lz4_open(struct prov_channel *pc)
+{
+	return 0;
+}
+
+static inline void prov_lz4_close(struct prov_channel *pc)
+{
+}
+
+static inline void prov_lz4_queue(struct prov_channel *pc,
+				  struct rchan_buf *buf)
+{
+}
+#endif
+#endif
@@ -27,6 +27,7 @@
 #include "provenance.h"
 #include "provenance_policy.h"
 #include "provenance_inode.h"
+#include "provenance_lpm.h"
 #include "memcpy_ss.h"
 
 /*!
@@ -210,46 +211,14 @@ struct ipv4_filters {
 	struct prov_ipv4_filter filter;
 };
 
-extern struct list_head ingress_ipv4filters;
-extern struct list_head egress_ipv4filters;
-
-/*!
- * @brief Returns op value of the filter of a specific IP and/or port.
- *
- * This function goes through a filter list,
- * and attempts to match the given @ip and @port.
- * If matched, the op value of the matched element will be returned.
- * @param filters The list to go through.
- * @param ip The IP to match.
- * @param port The port to match.
- * @return 0 if not found or the op value of the matched element in the list.
- *
- */
-static inline uint8_t prov_ipv4_whichOP(struct list_head *filters,
-					uint32_t ip,
-					uint32_t port)
-{
-	struct list_head *listentry, *listtmp;
-	struct ipv4_filters *tmp;
-
-	list_for_each_safe(listentry, listtmp, filters) {
-		tmp = list_entry(listentry, struct ipv4_filters, list);
-		// Match IP
-		if ((tmp->filter.mask & ip)
-		    == (tmp->filter.mask & tmp->filter.ip))
-			// Any port or a specific match
-			if (tmp->filter.port == 0 || tmp->filter.port == port)
-				return tmp->filter.op;
-	}
-	return 0;
-}
-
 /*!
  * @brief Delete an element in the filter list that matches a specific filter.
  *
  * This function goes through a filter list,
  * and attempts to match the given filter.
  * If matched, the matched element will be removed from the list.
+ * Must be called with prov_filter_lock held; @f is consumed.
+ * The trie of the list must be rebuilt afterwards.
  * @param filters The list to go through.
  * @param f The filter to match its mask, ip and port.
  * @return Always return 0.
@@ -258,19 +227,18 @@ static inline uint8_t prov_ipv4_whichOP(struct list_head *filters,
 static inline uint8_t prov_ipv4_delete(struct list_head *filters,
 				       struct ipv4_filters *f)
 {
-	struct list_head *listentry, *listtmp;
 	struct ipv4_filters *tmp;
 
-	list_for_each_safe(listentry, listtmp, filters) {
-		tmp = list_entry(listentry, struct ipv4_filters, list);
+	list_for_each_entry(tmp, filters, list) {
 		if (tmp->filter.mask == f->filter.mask &&
 		    tmp->filter.ip == f->filter.ip &&
 		    tmp->filter.port == f->filter.port) {
-			list_del(listentry);
+			list_del(&tmp->list);
 			kfree(tmp);
-			return 0;       // Should only get one.
+			break;  // Should only get one.
 		}
 	}
+	kfree(f);
 	return 0;
 }
 
@@ -282,6 +250,8 @@ static inline uint8_t prov_ipv4_delete(struct list_head *filters,
  * and attempts to match the given filter.
  * If matched, the matched element's op value will be updated based on the given
  * filter @f or the element will be added if no matches.
+ * Must be called with prov_filter_lock held; @f is consumed.
+ * The trie of the list must be rebuilt afterwards.
  * @param filters The list to go through.
  * @param f The filter to match its mask, ip and port.
  * @return Always return 0.
@@ -290,15 +260,14 @@ static inline uint8_t prov_ipv4_delete(struct list_head *filters,
 static inline uint8_t prov_ipv4_add_or_update(struct list_head *filters,
 					      struct ipv4_filters *f)
 {
-	struct list_head *listentry, *listtmp;
 	struct ipv4_filters *tmp;
 
-	list_for_each_safe(listentry, listtmp, filters) {
-		tmp = list_entry(listentry, struct ipv4_filters, list);
+	list_for_each_entry(tmp, filters, list) {
 		if (tmp->filter.mask == f->filter.mask &&
 		    tmp->filter.ip == f->filter.ip &&
 		    tmp->filter.port == f->filter.port) {
 			tmp->filter.op |= f->filter.op;
+			kfree(f);
 			return 0; // you should only get one
 		}
 	}
@@ -381,7 +350,7 @@ static inline void record_packet_content(struct sk_buff *skb,
 
 static __always_inline int check_track_socket(const struct sockaddr *address,
 					      const int addrlen,
-					      struct list_head *ipv4_filters,
+					      int dir,
 					      struct provenance *cprov,
 					      struct provenance *iprov)
 {
@@ -391,10 +360,12 @@ static __always_inline int check_track_socket(const struct sockaddr *address,
 	if (address->sa_family == PF_INET) {
 		ipv4_addr = (struct sockaddr_in *)address;
 		// force parse endian casting
-		op = prov_ipv4_whichOP(
-			ipv4_filters,
+		rcu_read_lock();
+		op = prov_lpm_lookup(
+			&rcu_dereference(prov_filters)->ipv4trie[dir],
 			(__force uint32_t)ipv4_addr->sin_addr.s_addr,
-			(__force uint32_t)ipv4_addr->sin_port);
+			(__force uint16_t)ipv4_addr->sin_port);
+		rcu_read_unlock();
 		if ((op & PROV_SET_TRACKED) != 0) {
 			set_tracked(prov_elt(iprov));
 			set_tracked(prov_elt(cprov));
@@ -15,19 +15,70 @@
 #ifndef _PROVENANCE_NS_H
 #define _PROVENANCE_NS_H
 
+#include <linux/rcupdate.h>
+
 struct ns_filters {
 	struct list_head list;
 	struct nsinfo filter;
 };
 
-extern struct list_head ns_filters;
+#define PROV_NS_DIMS            6
 
 /*!
- * @brief Return the op value for a specific namespace filter in the ns_filters
- * list.
+ * @brief A namespace filter, in a tuple of the compiled matcher.
+ *
+ * ns holds the namespaces in the order of struct nsinfo, wildcards
+ * (IGNORE_NS) included. prio is the position of the filter in the filter
+ * list, the first matching filter of the list wins.
+ */
+struct prov_ns_rule {
+	uint32_t ns[PROV_NS_DIMS];
+	uint32_t prio;
+	uint8_t op;
+};
+
+/*!
+ * @brief The filters sharing a wildcard pattern.
+ *
+ * Bit i of mask is set if namespace i is matched (i.e., is not IGNORE_NS).
+ * The filters are in an open-addressing hash table of size slots, starting at
+ * first in the rule table of the matcher; empty slots have prio U32_MAX.
+ * prio is the lowest priority of the tuple.
+ */
+struct prov_ns_tuple {
+	uint8_t mask;
+	uint32_t prio;
+	uint32_t first;
+	uint32_t size;
+};
+
+/*!
+ * @brief An immutable namespace filter matcher (tuple space search).
+ *
+ * A lookup probes one hash table per wildcard pattern in use, tuples are
+ * sorted by priority so that the search stops at the first tuple that cannot
+ * hold a better match. The matcher is rebuilt from the filter list whenever
+ * the list is modified and published with RCU.
+ */
+struct prov_ns_matcher {
+	struct rcu_head rcu;
+	uint32_t nr_tuples;
+	struct prov_ns_tuple tuples[1 << PROV_NS_DIMS];
+	struct prov_ns_rule rules[];
+};
+
+uint8_t __prov_ns_whichOP(struct prov_ns_matcher __rcu **matcher,
+			  const uint32_t ns[PROV_NS_DIMS]);
+int prov_ns_rebuild(struct list_head *filters,
+		    struct prov_ns_matcher __rcu **matcher);
+
+/*!
+ * @brief Return the op value of the first namespace filter in the filter
+ * list matching a set of namespaces.
  *
  * The specific namespace filter must have the same values of the namespaces as
  * in the argument list or is IGNORE_NS.
+ * @param matcher The matcher of the filters.
  * @param utsns UTS namespace.
  * @param ipcns Interprocess communication namespace.
  * @param mntns Mount namespace.
@@ -37,53 +88,43 @@ extern struct list_head ns_filters;
  * @return op value or 0
  *
  */
-static inline uint8_t prov_ns_whichOP(uint32_t utsns,
+static inline uint8_t prov_ns_whichOP(struct prov_ns_matcher __rcu **matcher,
+				      uint32_t utsns,
 				      uint32_t ipcns,
 				      uint32_t mntns,
 				      uint32_t pidns,
 				      uint32_t netns,
 				      uint32_t cgroupns)
 {
-	struct list_head *listentry, *listtmp;
-	struct ns_filters *tmp;
+	const uint32_t ns[PROV_NS_DIMS] = {
+		utsns, ipcns, mntns, pidns, netns, cgroupns
+	};
 
-	list_for_each_safe(listentry, listtmp, &ns_filters) {
-		tmp = list_entry(listentry, struct ns_filters, list);
-		if ((tmp->filter.cgroupns == cgroupns
-		     || tmp->filter.cgroupns == IGNORE_NS)
-		    && (tmp->filter.utsns == utsns
-			|| tmp->filter.utsns == IGNORE_NS)
-		    && (tmp->filter.ipcns == ipcns
-			|| tmp->filter.ipcns == IGNORE_NS)
-		    && (tmp->filter.mntns == mntns
-			|| tmp->filter.mntns == IGNORE_NS)
-		    && (tmp->filter.pidns == pidns
-			|| tmp->filter.pidns == IGNORE_NS)
-		    && (tmp->filter.netns == netns
-			|| tmp->filter.netns == IGNORE_NS))
-			return tmp->filter.op;
-	}
-	return 0;
+	if (!rcu_access_pointer(*matcher))
+		return 0;
+	return __prov_ns_whichOP(matcher, ns);
 }
 
 /*!
- * @brief Remove a specific namespace filter in the ns_filters list.
+ * @brief Remove a specific namespace filter in a filter list.
  *
  * The specific namespace filter must have the same values as the ns_filter
  * in the argument list.
+ * Must be called with prov_filter_lock held; @f is consumed.
+ * The matcher must be rebuilt afterwards.
  * @postcondition At most one element should be removed in the list.
+ * @param filters The filter list.
  * @param f The ns_filter that is checked against to remove the filter in the
  * list.
  * @return 0 if no error occurred. Other error codes unknown.
  *
  */
-static inline uint8_t prov_ns_delete(struct ns_filters *f)
+static inline uint8_t prov_ns_delete(struct list_head *filters,
+				     struct ns_filters *f)
 {
-	struct list_head *listentry, *listtmp;
 	struct ns_filters *tmp;
 
-	list_for_each_safe(listentry, listtmp, &ns_filters) {
-		tmp = list_entry(listentry, struct ns_filters, list);
+	list_for_each_entry(tmp, filters, list) {
 		if (tmp->filter.cgroupns == f->filter.cgroupns
 		    && tmp->filter.utsns == f->filter.utsns
 		    && tmp->filter.ipcns == f->filter.ipcns
@@ -91,37 +132,39 @@ static inline uint8_t prov_ns_delete(struct ns_filters *f)
 		    && tmp->filter.pidns == f->filter.pidns
 		    && tmp->filter.netns == f->filter.netns
 		    ) {
-			list_del(listentry);
+			list_del(&tmp->list);
 			kfree(tmp);
-			return 0; // You should only get one
+			break; // You should only get one
 		}
 	}
+	kfree(f);
 	return 0;
 }
 
 
 /*!
- * @brief Update the op value of a specific namespace filter in the ns_filters
- * list.
+ * @brief Update the op value of a specific namespace filter in a filter list.
  *
  * The specific namespace filter must have the same values as the ns_filter in
  * the argument list.
  * The op value is updated to the same as the ns_filters in the argument list.
  * If we cannot find the matching filter in the list, we add the filter at the
  * tail end of the list.
+ * Must be called with prov_filter_lock held; @f is consumed.
+ * The matcher must be rebuilt afterwards.
  * @postcondition At most one element should be updated in the list.
+ * @param filters The filter list.
  * @param f The ns_filter that is checked against to update the filter in the
  * list.
  * @return 0 if no error occurred. Other error codes unknown.
  *
  */
-static inline uint8_t prov_ns_add_or_update(struct ns_filters *f)
+static inline uint8_t prov_ns_add_or_update(struct list_head *filters,
+					    struct ns_filters *f)
 {
-	struct list_head *listentry, *listtmp;
 	struct ns_filters *tmp;
 
-	list_for_each_safe(listentry, listtmp, &ns_filters) {
-		tmp = list_entry(listentry, struct ns_filters, list);
+	list_for_each_entry(tmp, filters, list) {
 		if (tmp->filter.cgroupns == f->filter.cgroupns
 		    && tmp->filter.utsns == f->filter.utsns
 		    && tmp->filter.ipcns == f->filter.ipcns
@@ -130,10 +173,11 @@ static inline uint8_t prov_ns_add_or_update(struct ns_filters *f)
 		    && tmp->filter.netns == f->filter.netns
 		    ) {
 			tmp->filter.op = f->filter.op;
+			kfree(f);
 			return 0; // You should only get one
 		}
 	}
-	list_add_tail(&(f->list), &ns_filters);
+	list_add_tail(&(f->list), filters);
 	return 0;
 }
 #endif
@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_NUMA_H
+#define _PROVENANCE_NUMA_H
+
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/mutex.h>
+#include <linux/topology.h>
+
+#define PROV_NUMA_EMPTY         0
+#define PROV_NUMA_COMMITTED     1
+#define PROV_NUMA_PADDING       2
+#define PROV_NUMA_STATE_MASK    0xff
+#define PROV_NUMA_FORMAT_SHIFT  8
+
+/*!
+ * @brief Header preceding each record of a NUMA ring.
+ *
+ * size is the total size of the record, header included.
+ * state is PROV_NUMA_EMPTY until the record is committed, the wire format of
+ * a committed record is stored above PROV_NUMA_FORMAT_SHIFT.
+ */
+struct prov_numa_rec {
+	uint32_t state;
+	uint32_t size;
+};
+
+/*!
+ * @brief A ring shared by all the CPUs of a NUMA node.
+ *
+ * Producers claim space by advancing head with cmpxchg and publish their
+ * record by setting its state.
+ * The single consumer (i.e., reader of the node file) copies committed
+ * records out, zeroes them and advances tail; format is the wire format of
+ * the last record copied out.
+ * head and tail are free-running, size is a power of two.
+ */
+struct prov_numa_ring {
+	unsigned long head ____cacheline_aligned_in_smp;
+	unsigned long tail ____cacheline_aligned_in_smp;
+	size_t size;
+	uint8_t *data;
+	uint8_t format;
+	struct mutex read_lock;
+	struct dentry *dentry;
+};
+
+extern size_t prov_numa_size;
+
+struct prov_numa_ring **prov_numa_alloc(const char *name);
+void prov_numa_free(struct prov_numa_ring **rings);
+bool prov_numa_full(struct prov_numa_ring **rings);
+
+/*!
+ * @brief Claim space for an element in the ring of the current NUMA node.
+ *
+ * Must be called with interrupts disabled.
+ * If the record does not fit before the end of the ring, a padding record is
+ * inserted and the element is placed at the start.
+ * @param rings The per-node rings of a channel.
+ * @param length Size of the element, a multiple of 8.
+ * @return Where the element should be written or NULL if the ring is full.
+ *
+ */
+static __always_inline void *prov_numa_reserve(struct prov_numa_ring **rings,
+					       size_t length)
+{
+	struct prov_numa_ring *ring = rings[numa_node_id()];
+	size_t size = sizeof(struct prov_numa_rec) + length;
+	unsigned long head, tail, off, pad;
+	struct prov_numa_rec *rec;
+
+	do {
+		head = READ_ONCE(ring->head);
+		tail = smp_load_acquire(&ring->tail);
+		off = head & (ring->size - 1);
+		pad = (off + size > ring->size) ? ring->size - off : 0;
+		if (head + pad + size - tail > ring->size)
+			return NULL;
+	} while (cmpxchg(&ring->head, head, head + pad + size) != head);
+
+	if (pad) {
+		rec = (struct prov_numa_rec *)(ring->data + off);
+		rec->size = pad;
+		smp_store_release(&rec->state, PROV_NUMA_PADDING);
+		head += pad;
+	}
+	rec = (struct prov_numa_rec *)(ring->data + (head & (ring->size - 1)));
+	rec->size = size;
+	return rec + 1;
+}
+
+/*!
+ * @brief Publish an element reserved with "prov_numa_reserve".
+ * @param dst The element.
+ * @param format The wire format of the element.
+ *
+ */
+static __always_inline void prov_numa_commit(void *dst, uint8_t format)
+{
+	struct prov_numa_rec *rec = (struct prov_numa_rec *)dst - 1;
+
+	smp_store_release(&rec->state, PROV_NUMA_COMMITTED |
+			  (uint32_t)format << PROV_NUMA_FORMAT_SHIFT);
+}
+#endif
@@ -15,6 +15,8 @@
 #ifndef _PROVENANCE_POLICY_H
 #define _PROVENANCE_POLICY_H
 
+#include <linux/jump_label.h>
+
 /*!
  * @brief provenance capture policy defined by the user.
  *
@@ -59,4 +61,33 @@ struct capture_policy {
 
 extern struct capture_policy prov_policy;
 
+/*
+ * The switches of the policy tested on the hot path are mirrored in static
+ * keys, updated by "prov_policy_update" whenever the policy changes.
+ * When capture is disabled, hooks return through a patched-out branch.
+ */
+DECLARE_STATIC_KEY_FALSE(prov_enabled_key);
+DECLARE_STATIC_KEY_FALSE(prov_all_key);
+DECLARE_STATIC_KEY_TRUE(prov_compress_node_key);
+DECLARE_STATIC_KEY_TRUE(prov_compress_edge_key);
+DECLARE_STATIC_KEY_FALSE(prov_duplicate_key);
+DECLARE_STATIC_KEY_FALSE(prov_filter_key);
+
+#define prov_policy_enabled()           static_branch_unlikely(&prov_enabled_key)
+#define prov_policy_all()               static_branch_unlikely(&prov_all_key)
+#define prov_policy_compress_node()     static_branch_likely(&prov_compress_node_key)
+#define prov_policy_compress_edge()     static_branch_likely(&prov_compress_edge_key)
+#define prov_policy_duplicate()         static_branch_unlikely(&prov_duplicate_key)
+/* whether any node or relation filter is set */
+#define prov_policy_filtered()          static_branch_unlikely(&prov_filter_key)
+
+/*
+ * incremented by "prov_policy_update" whenever the policy changes, and by
+ * "prov_policy_invalidate"
+ */
+extern uint32_t prov_policy_gen;
+
+void prov_policy_update(void);
+void prov_policy_invalidate(void);
+
 #endif
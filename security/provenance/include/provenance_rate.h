@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_RATE_H
+#define _PROVENANCE_RATE_H
+
+#include <linux/jump_label.h>
+#include <linux/types.h>
+
+/*!
+ * @brief A token bucket, with its sampling counter.
+ *
+ * Tokens are counted in nanoseconds of credit; last is the time of the last
+ * refill, 0 for a bucket that was never used (and starts full).
+ * suppressed counts the relations dropped since the last report.
+ */
+struct prov_rate_bucket {
+	uint64_t tokens;
+	uint64_t last;
+	uint32_t suppressed;
+	uint32_t sampled;
+};
+
+/*
+ * Enabled while a rate limit or sampling is configured, relations are then
+ * checked by "__prov_rate_allow".
+ */
+DECLARE_STATIC_KEY_FALSE(prov_rate_key);
+
+#define prov_rate_limited()     static_branch_unlikely(&prov_rate_key)
+
+struct prov_rate;
+
+bool __prov_rate_allow(uint64_t type);
+void prov_rate_task_free(struct task_struct *task);
+int prov_rate_set(const struct prov_rate *setting);
+size_t prov_rate_get(struct prov_rate *settings, size_t nr);
+
+/*!
+ * @brief Whether a relation may be recorded under the configured rate limits.
+ *
+ * Checked by "record_relation" once edge compression has been applied and
+ * before the version of the destination node is updated; a relation that is
+ * not allowed is counted as suppressed.
+ * @param type The type of the relation.
+ * @return false if the relation must not be recorded.
+ *
+ */
+static __always_inline bool prov_rate_allow(uint64_t type)
+{
+	if (!prov_rate_limited())
+		return true;
+	return __prov_rate_allow(type);
+}
+#endif
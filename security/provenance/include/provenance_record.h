@@ -18,6 +18,109 @@
 #include "provenance.h"
 #include "provenance_relay.h"
 #include "memcpy_ss.h"
+#include "provenance_rate.h"
+#include "provenance_aggregate.h"
+
+/*!
+ * @brief Based on "op" value of a provenance node, decide whether it should be
+ * tracked/propagated/opaque.
+ *
+ * The op value (see target_op) is cached in the node, along with the uid, gid
+ * and secid it was computed for and the filter generation; it is only
+ * recomputed when one of them changes. Changes of the namespaces or of the
+ * cgroup op value of a task reset the cached generation.
+ * Called with the node lock held.
+ * @param prov The provenance node in question.
+ *
+ */
+static __always_inline void apply_target(struct provenance *prov)
+{
+	union prov_elt *elt = prov_elt(prov);
+	uint32_t gen = smp_load_acquire(&prov_filter_gen);
+	uint32_t uid = 0, gid = 0, secid = 0;
+	uint8_t op;
+
+	if (prov_has_secid(node_type(elt)))
+		secid = node_secid(elt);
+	if (prov_has_uidgid(node_type(elt))) {
+		uid = node_uid(elt);
+		gid = node_gid(elt);
+	}
+	if (likely(prov->target_gen == gen && prov->target_uid == uid &&
+		   prov->target_gid == gid && prov->target_secid == secid)) {
+		op = prov->target_op;
+	} else {
+		op = target_op(elt);
+		if (prov_type(elt) == ACT_TASK)
+			op |= prov->cgroup_op;
+		prov->target_op = op;
+		prov->target_uid = uid;
+		prov->target_gid = gid;
+		prov->target_secid = secid;
+		prov->target_gen = gen;
+	}
+
+	if (unlikely(op != 0)) {
+		if ((op & PROV_SET_TRACKED) != 0)
+			set_tracked(elt);
+		if ((op & PROV_SET_PROPAGATE) != 0)
+			set_propagate(elt);
+		if ((op & PROV_SET_OPAQUE) != 0)
+			set_opaque(elt);
+	}
+}
+
+DECLARE_PER_CPU(struct prov_edge_cache_stats, prov_edge_stats);
+
+/*!
+ * @brief Whether an edge is the same as one of the recent incoming edges of its
+ * destination node, in which case it can be compressed.
+ *
+ * The most recent edge is held in the node itself (node_previous_id, etc.);
+ * regular nodes, which are embedded in a struct provenance, also remember the
+ * last PROV_EDGE_CACHE_SIZE edges. Edges that are not found are added.
+ * @param type The type of the edge.
+ * @param from The source node.
+ * @param to The destination node.
+ * @return true if the edge was found.
+ *
+ */
+static __always_inline bool edge_cached(const uint64_t type,
+					prov_entry_t *from,
+					prov_entry_t *to)
+{
+	uint64_t id = node_identifier(from).id;
+	uint32_t version = node_identifier(from).version;
+	struct prov_edge_cache *cache = NULL;
+	int i;
+
+	if (node_previous_id(to) == id
+	    && node_previous_version(to) == version
+	    && node_previous_type(to) == type)
+		goto hit;
+	if (!prov_type_is_long(node_type(to))) {
+		cache = &container_of((union prov_elt *)to, struct provenance,
+				      msg)->edges;
+		for (i = 0; i < PROV_EDGE_CACHE_SIZE; i++) {
+			if (cache->id[i] == id && cache->version[i] == version
+			    && cache->type[i] == type)
+				goto hit;
+		}
+		i = cache->next;
+		cache->id[i] = id;
+		cache->version[i] = version;
+		cache->type[i] = type;
+		cache->next = (i + 1) % PROV_EDGE_CACHE_SIZE;
+	}
+	node_previous_id(to) = id;
+	node_previous_version(to) = version;
+	node_previous_type(to) = type;
+	this_cpu_inc(prov_edge_stats.miss);
+	return false;
+hit:
+	this_cpu_inc(prov_edge_stats.hit);
+	return true;
+}
 
 /*!
  * @brief This function updates the version of a provenance node.
@@ -55,7 +158,7 @@ static __always_inline int __update_version(const uint64_t type,
 	union prov_elt old_prov;
 	int rc = 0;
 
-	if (!provenance_has_outgoing(prov) && prov_policy.should_compress_node)
+	if (!provenance_has_outgoing(prov) && prov_policy_compress_node())
 		return 0;
 
 	if (filter_update_node(type))
@@ -98,9 +201,11 @@ static __always_inline int __update_version(const uint64_t type,
  * The criteria to be met so as not to record the relation are:
  * 1. Compression of edges are set. (Multiple edges should be compressed to 1
  * edge.), and
- * 2. The type of the edges being recorded are the same as before (we only
- * compress same edges that occurs consecutively on the two nodes).
+ * 2. The same edge was recently recorded between the two nodes (see
+ * "edge_cached").
  * The relation is recorded by calling the "__write_relation" function.
+ * A recorded (or compressed) read or write of a file opens an aggregation
+ * window on that file (see "prov_aggregate").
  * @param type The type of the relation
  * @param from The pointer to the source provenance node
  * @param to The pointer to the destination provenance node
@@ -119,22 +224,21 @@ static __always_inline int record_relation(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_type_is_relation(type));
 
-	if (prov_policy.should_compress_edge) {
-		if (node_previous_id(to) == node_identifier(from).id
-		    && node_previous_version(to) == node_identifier(from).version
-		    && node_previous_type(to) == type)
-			return 0;
-
-		node_previous_id(to) = node_identifier(from).id;
-		node_previous_version(to) = node_identifier(from).version;
-		node_previous_type(to) = type;
+	if (prov_policy_compress_edge() && edge_cached(type, from, to)) {
+		prov_aggregate_start(type, from, to, file, flags);
+		return 0;
 	}
+	// compressed edges are not written and do not count against the limit
+	if (!prov_rate_allow(type))
+		return 0;
 
 	rc = __update_version(type, to);
 	if (rc < 0)
 		return rc;
 	set_has_outgoing(from); // The source node now has an outgoing edge.
 	rc = __write_relation(type, from, to, file, flags);
+	if (rc >= 0)
+		prov_aggregate_start(type, from, to, file, flags);
 	return rc;
 }
 
@@ -163,7 +267,7 @@ static __always_inline int record_terminate(uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_close(type));
 
-	if (!provenance_is_recorded(prov_elt(prov)) && !prov_policy.prov_all)
+	if (!provenance_is_recorded(prov_elt(prov)) && !prov_policy_all())
 		return 0;
 	if (filter_node(prov_entry(prov)))
 		return 0;
@@ -289,9 +393,9 @@ static __always_inline int uses(const uint64_t type,
 	BUILD_BUG_ON(!prov_is_used(type));
 
 	// Check if the nodes match some capture options.
-	apply_target(prov_elt(entity));
-	apply_target(prov_elt(activity));
-	apply_target(prov_elt(activity_mem));
+	apply_target(entity);
+	apply_target(activity);
+	apply_target(activity_mem);
 
 	if (provenance_is_opaque(prov_elt(entity))
 	    || provenance_is_opaque(prov_elt(activity))
@@ -301,7 +405,7 @@ static __always_inline int uses(const uint64_t type,
 	if (!provenance_is_tracked(prov_elt(entity))
 	    && !provenance_is_tracked(prov_elt(activity))
 	    && !provenance_is_tracked(prov_elt(activity_mem))
-	    && !prov_policy.prov_all)
+	    && !prov_policy_all())
 		return 0;
 	if (!should_record_relation(
 		    type, prov_entry(entity), prov_entry(activity)))
@@ -348,8 +452,8 @@ static __always_inline int uses_two(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_used(type));
 
-	apply_target(prov_elt(entity));
-	apply_target(prov_elt(activity));
+	apply_target(entity);
+	apply_target(activity);
 
 	if (provenance_is_opaque(prov_elt(entity))
 	    || provenance_is_opaque(prov_elt(activity)))
@@ -357,7 +461,7 @@ static __always_inline int uses_two(const uint64_t type,
 
 	if (!provenance_is_tracked(prov_elt(entity))
 	    && !provenance_is_tracked(prov_elt(activity))
-	    && !prov_policy.prov_all)
+	    && !prov_policy_all())
 		return 0;
 	if (!should_record_relation(
 		    type, prov_entry(entity), prov_entry(activity)))
@@ -406,9 +510,9 @@ static __always_inline int generates(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_generated(type));
 
-	apply_target(prov_elt(activity_mem));
-	apply_target(prov_elt(activity));
-	apply_target(prov_elt(entity));
+	apply_target(activity_mem);
+	apply_target(activity);
+	apply_target(entity);
 
 	if (provenance_is_tracked(prov_elt(activity_mem)))
 		set_tracked(prov_elt(activity));
@@ -424,7 +528,7 @@ static __always_inline int generates(const uint64_t type,
 	if (!provenance_is_tracked(prov_elt(activity_mem))
 	    && !provenance_is_tracked(prov_elt(activity))
 	    && !provenance_is_tracked(prov_elt(entity))
-	    && !prov_policy.prov_all)
+	    && !prov_policy_all())
 		return 0;
 
 	if (!should_record_relation(
@@ -475,8 +579,8 @@ static __always_inline int derives(const uint64_t type,
 {
 	BUILD_BUG_ON(!prov_is_derived(type));
 
-	apply_target(prov_elt(from));
-	apply_target(prov_elt(to));
+	apply_target(from);
+	apply_target(to);
 
 	if (provenance_is_opaque(prov_elt(from))
 	    || provenance_is_opaque(prov_elt(to)))
@@ -484,7 +588,7 @@ static __always_inline int derives(const uint64_t type,
 
 	if (!provenance_is_tracked(prov_elt(from))
 	    && !provenance_is_tracked(prov_elt(to))
-	    && !prov_policy.prov_all)
+	    && !prov_policy_all())
 		return 0;
 	if (!should_record_relation(type, prov_entry(from), prov_entry(to)))
 		return 0;
@@ -524,8 +628,8 @@ static __always_inline int informs(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_informed(type));
 
-	apply_target(prov_elt(from));
-	apply_target(prov_elt(to));
+	apply_target(from);
+	apply_target(to);
 
 	if (provenance_is_opaque(prov_elt(from))
 	    || provenance_is_opaque(prov_elt(to)))
@@ -533,7 +637,7 @@ static __always_inline int informs(const uint64_t type,
 
 	if (!provenance_is_tracked(prov_elt(from))
 	    && !provenance_is_tracked(prov_elt(to))
-	    && !prov_policy.prov_all)
+	    && !prov_policy_all())
 		return 0;
 	if (!should_record_relation(type, prov_entry(from), prov_entry(to)))
 		return 0;
@@ -556,15 +660,15 @@ static __always_inline int record_influences_kernel(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_influenced(type));
 
-	apply_target(prov_elt(entity));
-	apply_target(prov_elt(activity));
+	apply_target(entity);
+	apply_target(activity);
 
 	if (provenance_is_opaque(prov_elt(entity))
 	    || provenance_is_opaque(prov_elt(activity)))
 		return 0;
 	if (!provenance_is_tracked(prov_elt(entity))
 	    && !provenance_is_tracked(prov_elt(activity))
-	    && !prov_policy.prov_all)
+	    && !prov_policy_all())
 		return 0;
 	rc = record_relation(RL_LOAD_FILE, prov_entry(entity),
 			     prov_entry(activity), file, 0);
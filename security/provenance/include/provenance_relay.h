@@ -19,45 +19,187 @@
 #include <linux/spinlock.h>
 #include <linux/jiffies.h>
 #include <linux/list.h>
+#include <linux/workqueue.h>
 #include <uapi/linux/provenance.h>
+#include <uapi/linux/provenance_fs.h>
 
 #include "provenance_filter.h"
 #include "provenance_query.h"
 #include "memcpy_ss.h"
+#include "provenance_numa.h"
+#include "provenance_lz4.h"
+#include "provenance_delta.h"
+#include "provenance_bpf.h"
 
 #define PROV_RELAY_BUFF_EXP 20
 #define PROV_RELAY_BUFF_SIZE ((1 << PROV_RELAY_BUFF_EXP) * sizeof(uint8_t))
 #define PROV_NB_SUBBUF 64
-#define PROV_INITIAL_BUFF_SIZE (1024 * 16)
-#define PROV_INITIAL_LONG_BUFF_SIZE 512
+#define PROV_NB_SUBBUF_MIN 4
+#define PROV_NB_SUBBUF_MAX 1024
+#define PROV_BOOT_RING_SIZE 512
+#define PROV_LONG_BOOT_RING_SIZE 64
+#define PROV_BLOCK_DEFAULT_MS 100
+#define PROV_SPILL_DEFAULT_MAX (1 << 24)
 
-struct boot_buffer {
+#define PROV_STATS_SLOTS (PROV_STATS_CATEGORIES * PROV_STATS_BITS)
+
+/*!
+ * @brief Per-CPU statistics of a channel, indexed by "prov_stats_index".
+ */
+struct prov_channel_stats {
+	struct prov_type_stats types[PROV_STATS_SLOTS];
+};
+
+/*!
+ * @brief Map a node or relation type to its statistics slot.
+ *
+ * Each node and relation type is identified by a single subtype bit within
+ * its category (nodes, or one of the six relation categories).
+ */
+static __always_inline unsigned int prov_stats_index(uint64_t type)
+{
+	unsigned int category;
+	uint64_t subtype = SUBTYPE(type);
+
+	if (prov_type_is_node(type))
+		category = 0;
+	else if (prov_is_derived(type))
+		category = 1;
+	else if (prov_is_generated(type))
+		category = 2;
+	else if (prov_is_used(type))
+		category = 3;
+	else if (prov_is_informed(type))
+		category = 4;
+	else if (prov_is_influenced(type))
+		category = 5;
+	else
+		category = 6;
+	if (!subtype)
+		return category * PROV_STATS_BITS;
+	return category * PROV_STATS_BITS +
+	       min_t(unsigned int, __ffs64(subtype), PROV_STATS_BITS - 1);
+}
+
+/*!
+ * @brief Per-CPU wire format state of a channel.
+ *
+ * Records of different wire formats are never mixed in a sub-buffer. want is
+ * the format requested by the last writer and is applied by the sub-buffer
+ * switch callback; format is the format of the current sub-buffer (of the
+ * last record claimed for NUMA rings). A PROV_WIRE_COMPACT sub-buffer starts
+ * with a prov_compact_subbuf header, stream then holds the identity and deltas
+ * of the sub-buffer. mark is set when the format of the previous sub-buffer is
+ * unknown to readers (e.g., after a resize) and the next one must be marked.
+ */
+struct prov_subbuf_state {
+	uint8_t want;
+	uint8_t format;
+	bool mark;
+	struct prov_compact_stream stream;
+};
+
+/*!
+ * @brief The overflow pool of a channel for one CPU.
+ *
+ * Elements are held in the order they were written on the CPU and written
+ * back to the relay of that CPU, by work or by the next writer, before any
+ * newer element of the CPU; count is the number of elements held.
+ */
+struct prov_spill {
+	spinlock_t lock;
 	struct list_head list;
-	union prov_elt msg;
+	unsigned int count;
+	struct delayed_work work;
+	struct prov_channel *pc;
+	int cpu;
 };
 
-struct long_boot_buffer {
+/*!
+ * @brief A relay channel and its back-pressure policy.
+ *
+ * policy is one of PROV_RELAY_DROP, PROV_RELAY_OVERWRITE, PROV_RELAY_BLOCK or
+ * PROV_RELAY_SPILL.
+ * block_ms bounds the time a sleepable hook waits for the relay to drain.
+ * spill_max bounds the memory (in bytes) used to hold elements that did not
+ * fit in the relay; those are held per CPU in spill.
+ * chan is NULL while the channel is being re-opened with a new geometry
+ * (resizing is then set and readers may not attach), writers access it with
+ * interrupts disabled.
+ * In adaptive mode, adapt_target is the number of sub-buffers to apply once
+ * no reader is attached.
+ * numa is set when the channel uses one ring per NUMA node instead of
+ * per-CPU relay buffers, chan is then always NULL.
+ * Fan-out channels are linked through fanout and only receive the elements
+ * accepted by filter.
+ * lz4 is set when completed sub-buffers are compressed into a separate relay.
+ * subbuf holds the per-CPU wire format state.
+ */
+struct prov_channel {
 	struct list_head list;
-	union long_prov_elt msg;
+	struct rchan __rcu *chan;
+	struct prov_numa_ring **numa;
+	struct prov_lz4 *lz4;
+	char name[PROV_CHANNEL_NAME_LEN];
+	size_t subbuf_size;
+	size_t nb_subbuf;
+	bool adaptive;
+	bool resizing;
+	struct delayed_work adapt_work;
+	uint64_t adapt_dropped;
+	unsigned int adapt_low;
+	size_t adapt_target;
+	uint8_t policy;
+	uint32_t block_ms;
+	uint64_t spill_max;
+	atomic64_t spill_size;
+	struct prov_spill __percpu *spill;
+	struct prov_channel_stats __percpu *stats;
+	struct prov_subbuf_state __percpu *subbuf;
+	struct list_head fanout;
+	struct prov_channel_filter filter;
 };
 
+extern struct list_head prov_channels;
+extern struct list_head prov_fanout;
+extern struct mutex prov_channels_lock;
+struct prov_channel *prov_channel_find(const char *name);
+int prov_channel_create(const struct prov_channel_filter *filter);
+void prov_relay_throttle(void);
+int prov_channel_resize(struct prov_channel *pc,
+			size_t subbuf_size,
+			size_t nb_subbuf);
+void prov_channel_set_adaptive(struct prov_channel *pc, bool adaptive);
+void prov_channel_set_policy(struct prov_channel *pc, uint8_t policy);
+uint64_t prov_dropped(void);
+
+void init_boot_buffer(void);
 void write_boot_buffer(void);
-bool is_relay_full(struct rchan *chan);
 void prov_flush(void);
 
-extern struct kmem_cache *boot_buffer_cache;
-extern spinlock_t lock_buffer;
-extern struct list_head buffer_list;
-
-extern struct kmem_cache *long_boot_buffer_cache;
-extern spinlock_t lock_long_buffer;
-extern struct list_head long_buffer_list;
+extern atomic64_t prov_boot_overflow;
 
 extern bool relay_ready;
 extern bool relay_initialized;
+extern uint8_t prov_wire_format;
 
 void prov_write(union prov_elt *msg, size_t size);
 void long_prov_write(union long_prov_elt *msg, size_t size);
+void prov_write_fanout(union prov_elt *msg, size_t size);
+
+struct prov_relay_slot {
+	unsigned long flags;
+	union prov_elt *elt;
+	void *dst;
+	size_t length;
+	uint8_t format;
+	bool spilled;
+	bool hidden;
+	bool dropped;
+};
+
+union prov_elt *prov_reserve(struct prov_relay_slot *slot, uint64_t type);
+void prov_commit(struct prov_relay_slot *slot);
 
 static __always_inline void tighten_identifier(union prov_identifier *id)
 {
@@ -75,8 +217,9 @@ static __always_inline void tighten_identifier(union prov_identifier *id)
  * buffer which can be consumed by userspace client.
  * If those checks are passed and the provenance node should be written to the
  * relay buffer,
- * Call either "prov_write" or "long_prov_write" depending on whether the node
- * is a regular or a long provenance node.
+ * Call either "prov_write_node" or "long_prov_write" depending on whether the
+ * node is a regular or a long provenance node; regular nodes may be written as
+ * a delta against their previously written version.
  * Then mark the provenance node as recorded.
  * The checks include:
  * 1. If the node has already been recorded and the user policy is set to not
@@ -93,14 +236,14 @@ static __always_inline void __write_node(prov_entry_t *node)
 {
 	BUG_ON(prov_type_is_relation(node_type(node)));
 
-	if (provenance_is_recorded(node) && !prov_policy.should_duplicate)
+	if (provenance_is_recorded(node) && !prov_policy_duplicate())
 		return;
 	tighten_identifier(&get_prov_identifier(node));
 	set_recorded(node);
 	if (prov_type_is_long(node_type(node)))
 		long_prov_write(node, sizeof(union long_prov_elt));
 	else
-		prov_write((union prov_elt *)node, sizeof(union prov_elt));
+		prov_write_node((union prov_elt *)node);
 }
 
 
@@ -113,6 +256,9 @@ static __always_inline uint64_t current_provid(void)
 	return node_identifier(prov_elt(prov)).id;
 }
 
+/*!
+ * @brief Fill a relation, which is expected to have been zeroed.
+ */
 static __always_inline void __prepare_relation(const uint64_t type,
 					       union prov_elt *relation,
 					       prov_entry_t *f,
@@ -120,19 +266,12 @@ static __always_inline void __prepare_relation(const uint64_t type,
 					       const struct file *file,
 					       const uint64_t flags)
 {
-	memset(relation, 0, sizeof(union prov_elt));
 	prov_type(relation) = type;
 	relation_identifier(relation).id = prov_next_relation_id();
 	relation_identifier(relation).boot_id = prov_boot_id;
 	relation_identifier(relation).machine_id = prov_machine_id;
-	__memcpy_ss(&(relation->relation_info.snd),
-		    sizeof(union prov_identifier),
-		    &get_prov_identifier(f),
-		    sizeof(union prov_identifier));
-	__memcpy_ss(&(relation->relation_info.rcv),
-		    sizeof(union prov_identifier),
-		    &get_prov_identifier(t),
-		    sizeof(union prov_identifier));
+	relation->relation_info.snd = get_prov_identifier(f);
+	relation->relation_info.rcv = get_prov_identifier(t);
 	if (file) {
 		relation->relation_info.set = FILE_INFO_SET;
 		relation->relation_info.offset = file->f_pos;
@@ -150,6 +289,8 @@ static __always_inline void __prepare_relation(const uint64_t type,
  * The relation will only be recorded if no user-supplied filter is applicable
  * to the type of the relation or the end nodes.
  * This is checked by "should_record_relation" function.
+ * When the BPF record filter is enabled, the relation is then handed to it by
+ * "prov_bpf_write_relation".
  * Two end nodes are recorded by calling "__write_node" function before the
  * relation itself is recorded.
  * CamQuery is called for provenance runtime analysis of this provenance
@@ -168,22 +309,59 @@ static __always_inline int __write_relation(const uint64_t type,
 					    const struct file *file,
 					    const uint64_t flags)
 {
-	union prov_elt relation;
+	struct prov_relay_slot slot;
+	union prov_elt tmp;
+	union prov_elt *relation;
 	prov_entry_t *f = from;
 	prov_entry_t *t = to;
 	int rc = 0;
 
 	if (!should_record_relation(type, f, t))
 		return 0;
+	if (prov_bpf_filtered())
+		return prov_bpf_write_relation(type, f, t, file, flags);
 
 	// Record the two end nodes
 	__write_node(f);
 	__write_node(t);
-	__prepare_relation(type, &relation, f, t, file, flags);
+	// Build the relation directly in the relay buffer when possible,
+	// readers do not see it before it is committed.
+	relation = prov_reserve(&slot, type);
+	if (unlikely(!relation)) {
+		relation = &tmp;
+		memset(relation, 0, sizeof(union prov_elt));
+	}
+	__prepare_relation(type, relation, f, t, file, flags);
 	// Call query hooks for propagate tracking.
-	rc = call_query_hooks(f, t, (prov_entry_t *)&relation);
+	rc = call_query_hooks(f, t, (prov_entry_t *)relation);
 	// Finally record the relation (i.e., edge) to relay buffer.
-	prov_write(&relation, sizeof(union prov_elt));
+	if (likely(relation != &tmp))
+		prov_commit(&slot);
+	else if (!slot.dropped)
+		prov_write(relation, sizeof(union prov_elt));
+	else
+		prov_write_fanout(relation, sizeof(union prov_elt));
 	return rc;
 }
+
+/*!
+ * @brief Write a relation summarising aggregated flows to relay buffer.
+ *
+ * The aggregated flows are identical to the relation that opened the window,
+ * which went through "__write_relation" and had its end nodes recorded.
+ * The aggregate is still subject to the relation filters and the BPF record
+ * filter in place when it is written; its end nodes may no longer exist, they
+ * are passed to the BPF filter as NULL and CamQuery is not called.
+ * @param relation The aggregate relation.
+ *
+ */
+static __always_inline void __write_aggregate(union prov_elt *relation)
+{
+	if (filter_relation(prov_type(relation)))
+		return;
+	if (prov_bpf_filtered() &&
+	    prov_bpf_record(relation, NULL, NULL) == PROV_BPF_DROP)
+		return;
+	prov_write(relation, sizeof(union prov_elt));
+}
 #endif
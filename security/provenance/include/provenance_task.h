@@ -27,6 +27,7 @@
 #include <linux/mm.h> // used for get_page
 #include <net/net_namespace.h>
 #include <linux/pid_namespace.h>
+#include <linux/cgroup.h>
 #include <linux/sched/cputime.h>
 #include "../../../fs/mount.h" // nasty
 
@@ -135,17 +136,76 @@ static inline uint32_t get_pidns(struct task_struct *task)
 	return id;
 }
 
+/*!
+ * @brief Resolve the cgroup filter op value of a task.
+ *
+ * The cgroup (v2) of the task and its ancestors are only looked up when the
+ * task changed cgroup or the filters changed since the op was last resolved.
+ * Called with the task lock held.
+ * @param task The task.
+ * @param prov The provenance of the task.
+ * @return Whether the op value changed.
+ *
+ */
+static inline bool update_task_cgroup(struct task_struct *task,
+				      struct provenance *prov)
+{
+#ifdef CONFIG_CGROUPS
+	uint32_t gen = smp_load_acquire(&prov_filter_gen);
+	struct cgroup *cgrp;
+	uint8_t op;
+	uint64_t id;
+
+	rcu_read_lock();
+	cgrp = task_dfl_cgroup(task);
+	id = cgroup_id(cgrp);
+	if (likely(prov->cgroup_id == id && prov->cgroup_gen == gen)) {
+		rcu_read_unlock();
+		return false;
+	}
+	op = prov_cgroup_whichOP(rcu_dereference(prov_filters), cgrp);
+	rcu_read_unlock();
+	prov->cgroup_id = id;
+	prov->cgroup_gen = gen;
+	if (prov->cgroup_op == op)
+		return false;
+	prov->cgroup_op = op;
+	return true;
+#else
+	return false;
+#endif
+}
+
 static inline void update_task_namespaces(struct task_struct *task,
 					  struct provenance *prov)
 {
+	struct task_prov_struct *info = &prov_elt(prov)->task_info;
+	uint32_t utsns, ipcns, mntns, pidns, netns, cgroupns;
+	bool changed;
+
 	task_lock(task);
-	prov_elt(prov)->task_info.utsns = get_utsns(task);
-	prov_elt(prov)->task_info.ipcns = get_ipcns(task);
-	prov_elt(prov)->task_info.mntns = get_mntns(task);
-	prov_elt(prov)->task_info.pidns = get_pidns(task);
-	prov_elt(prov)->task_info.netns = get_netns(task);
-	prov_elt(prov)->task_info.cgroupns = get_cgroupns(task);
+	utsns = get_utsns(task);
+	ipcns = get_ipcns(task);
+	mntns = get_mntns(task);
+	pidns = get_pidns(task);
+	netns = get_netns(task);
+	cgroupns = get_cgroupns(task);
+	changed = update_task_cgroup(task, prov);
 	task_unlock(task);
+	if (info->utsns != utsns || info->ipcns != ipcns ||
+	    info->mntns != mntns || info->pidns != pidns ||
+	    info->netns != netns || info->cgroupns != cgroupns) {
+		info->utsns = utsns;
+		info->ipcns = ipcns;
+		info->mntns = mntns;
+		info->pidns = pidns;
+		info->netns = netns;
+		info->cgroupns = cgroupns;
+		changed = true;
+	}
+	// the cached op value of the task is stale
+	if (changed)
+		prov->target_gen = 0;
 }
 
 #define vm_write(flags) ((flags & VM_WRITE) == VM_WRITE)
@@ -554,7 +614,7 @@ static inline int record_args(struct provenance *prov,
 	int argc;
 	int envc;
 
-	if (!provenance_is_tracked(prov_elt(prov)) && !prov_policy.prov_all)
+	if (!provenance_is_tracked(prov_elt(prov)) && !prov_policy_all())
 		return 0;
 	len = bprm->exec - bprm->p;
 	argv = kzalloc(len, GFP_KERNEL);
@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <linux/bitops.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "provenance.h"
+#include "provenance_net.h"
+#include "provenance_lpm.h"
+
+static inline uint32_t lpm_mask(uint8_t len)
+{
+	return len ? ~0U << (32 - len) : 0;
+}
+
+static inline uint32_t lpm_bit(uint32_t key, uint8_t i)
+{
+	return (key >> (31 - i)) & 1;
+}
+
+/* length of the common prefix of a and b, at most max */
+static inline uint8_t lpm_common(uint32_t a, uint32_t b, uint8_t max)
+{
+	uint32_t x = a ^ b;
+	uint8_t len = x ? 32 - fls(x) : 32;
+
+	return min(len, max);
+}
+
+static uint32_t lpm_new(struct prov_lpm_trie *t, uint32_t prefix, uint8_t len)
+{
+	struct prov_lpm_node *node = &t->nodes[t->nr_nodes];
+
+	node->prefix = prefix;
+	node->len = len;
+	node->child[0] = PROV_LPM_NONE;
+	node->child[1] = PROV_LPM_NONE;
+	return t->nr_nodes++;
+}
+
+/*!
+ * @brief Return the node of a prefix, inserting it if needed.
+ *
+ * Each insertion adds at most two nodes (the prefix and a branching node),
+ * nodes must therefore be sized for twice the number of prefixes.
+ *
+ */
+static uint32_t lpm_insert(struct prov_lpm_trie *t, uint32_t prefix,
+			   uint8_t len)
+{
+	uint32_t *slot = &t->root;
+	struct prov_lpm_node *node;
+	uint32_t idx, split;
+	uint8_t common;
+
+	while (*slot != PROV_LPM_NONE) {
+		node = &t->nodes[*slot];
+		common = lpm_common(node->prefix, prefix, min(node->len, len));
+		if (common == node->len) {
+			if (common == len)
+				return *slot;
+			slot = &node->child[lpm_bit(prefix, node->len)];
+			continue;
+		}
+		// the prefix is a prefix of node
+		if (common == len) {
+			idx = lpm_new(t, prefix, len);
+			t->nodes[idx].child[lpm_bit(node->prefix, len)] = *slot;
+			*slot = idx;
+			return idx;
+		}
+		// the prefix and node diverge after common bits
+		split = lpm_new(t, prefix & lpm_mask(common), common);
+		idx = lpm_new(t, prefix, len);
+		t->nodes[split].child[lpm_bit(node->prefix, common)] = *slot;
+		t->nodes[split].child[lpm_bit(prefix, common)] = idx;
+		*slot = split;
+		return idx;
+	}
+	idx = lpm_new(t, prefix, len);
+	*slot = idx;
+	return idx;
+}
+
+static int lpm_port_cmp(const void *a, const void *b)
+{
+	const struct prov_lpm_port *pa = a, *pb = b;
+
+	return (int)pa->port - (int)pb->port;
+}
+
+static bool lpm_port(struct prov_lpm_trie *t, struct prov_lpm_node *node,
+		     uint16_t port, uint8_t *op)
+{
+	struct prov_lpm_port *ports = &t->ports[node->ports];
+	uint16_t lo = 0, hi = node->nr_ports, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ports[mid].port == port) {
+			*op = ports[mid].op;
+			return true;
+		}
+		if (ports[mid].port < port)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+uint8_t __prov_lpm_lookup(struct prov_lpm_trie __rcu **trie, uint32_t ip,
+			  uint16_t port)
+{
+	uint32_t key = be32_to_cpu((__force __be32)ip);
+	struct prov_lpm_node *node;
+	struct prov_lpm_trie *t;
+	uint32_t idx;
+	uint8_t op = 0;
+
+	rcu_read_lock();
+	t = rcu_dereference(*trie);
+	if (!t)
+		goto out;
+	idx = t->root;
+	while (idx != PROV_LPM_NONE) {
+		node = &t->nodes[idx];
+		if ((key & lpm_mask(node->len)) != node->prefix)
+			break;
+		// a more specific match overrides the previous ones
+		if (!(node->nr_ports && lpm_port(t, node, port, &op)) &&
+		    (node->flags & PROV_LPM_ANY_PORT))
+			op = node->op;
+		if (node->len == 32)
+			break;
+		idx = node->child[lpm_bit(key, node->len)];
+	}
+out:
+	rcu_read_unlock();
+	return op;
+}
+
+/*!
+ * @brief Build the trie of a filter list and publish it.
+ *
+ * Masks are expected to be CIDR prefixes and filters to be unique, as
+ * guaranteed by the securityfs interface.
+ * Must be called with prov_filter_lock held. The previous trie is freed after
+ * a grace period.
+ * @param filters The filter list.
+ * @param trie The trie to replace.
+ * @return 0 on success, -ENOMEM if the trie could not be allocated, in which
+ * case the previous trie is kept.
+ *
+ */
+int prov_lpm_rebuild(struct list_head *filters,
+		     struct prov_lpm_trie __rcu **trie)
+{
+	struct prov_lpm_trie *t = NULL, *old;
+	struct prov_lpm_node *node;
+	struct ipv4_filters *f;
+	size_t n = 0, nr_ports = 0, i;
+	uint32_t *where;
+	uint8_t len;
+
+	list_for_each_entry(f, filters, list) {
+		n++;
+		if (f->filter.port)
+			nr_ports++;
+	}
+	if (!n)
+		goto publish;
+
+	t = kvzalloc(sizeof(struct prov_lpm_trie) +
+		     2 * n * sizeof(struct prov_lpm_node) +
+		     nr_ports * sizeof(struct prov_lpm_port), GFP_KERNEL);
+	where = kvmalloc_array(n, sizeof(uint32_t), GFP_KERNEL);
+	if (!t || !where) {
+		kvfree(t);
+		kvfree(where);
+		return -ENOMEM;
+	}
+	t->nodes = (struct prov_lpm_node *)(t + 1);
+	t->ports = (struct prov_lpm_port *)(t->nodes + 2 * n);
+	t->root = PROV_LPM_NONE;
+
+	i = 0;
+	list_for_each_entry(f, filters, list) {
+		len = hweight32(f->filter.mask);
+		where[i] = lpm_insert(t,
+				      be32_to_cpu((__force __be32)f->filter.ip) &
+				      lpm_mask(len), len);
+		node = &t->nodes[where[i++]];
+		if (f->filter.port) {
+			node->nr_ports++;
+		} else {
+			node->flags |= PROV_LPM_ANY_PORT;
+			node->op = f->filter.op;
+		}
+	}
+	// lay out the port tables
+	nr_ports = 0;
+	for (i = 0; i < t->nr_nodes; i++) {
+		t->nodes[i].ports = nr_ports;
+		nr_ports += t->nodes[i].nr_ports;
+		t->nodes[i].nr_ports = 0;
+	}
+	i = 0;
+	list_for_each_entry(f, filters, list) {
+		node = &t->nodes[where[i++]];
+		if (!f->filter.port)
+			continue;
+		t->ports[node->ports + node->nr_ports].port = f->filter.port;
+		t->ports[node->ports + node->nr_ports].op = f->filter.op;
+		node->nr_ports++;
+	}
+	for (i = 0; i < t->nr_nodes; i++) {
+		node = &t->nodes[i];
+		if (node->nr_ports > 1)
+			sort(&t->ports[node->ports], node->nr_ports,
+			     sizeof(struct prov_lpm_port), lpm_port_cmp, NULL);
+	}
+	kvfree(where);
+publish:
+	old = rcu_replace_pointer(*trie, t, lockdep_is_held(&prov_filter_lock));
+	if (old)
+		kvfree_rcu(old, rcu);
+	return 0;
+}
+
+static int lpm_filter_cmp(const void *a, const void *b)
+{
+	const struct prov_ipv4_filter *fa = a, *fb = b;
+
+	if (fa->mask != fb->mask)
+		return fa->mask < fb->mask ? -1 : 1;
+	if (fa->ip != fb->ip)
+		return fa->ip < fb->ip ? -1 : 1;
+	return (int)fa->port - (int)fb->port;
+}
+
+/*!
+ * @brief Build a filter list from a set of filters.
+ *
+ * Duplicate filters are merged, filters with PROV_SET_DELETE set are ignored.
+ * @param rules The filters, with valid masks and their ip masked; sorted in
+ * place.
+ * @param nr The number of filters.
+ * @param filters An empty list receiving the filters.
+ * @return 0 on success, -ENOMEM on failure, in which case the list is left
+ * empty.
+ *
+ */
+int prov_lpm_filters(struct prov_ipv4_filter *rules, size_t nr,
+		     struct list_head *filters)
+{
+	struct ipv4_filters *f, *tmp, *last = NULL;
+	size_t i;
+
+	sort(rules, nr, sizeof(struct prov_ipv4_filter), lpm_filter_cmp, NULL);
+	for (i = 0; i < nr; i++) {
+		if ((rules[i].op & PROV_SET_DELETE) == PROV_SET_DELETE)
+			continue;
+		if (last && !lpm_filter_cmp(&last->filter, &rules[i])) {
+			last->filter.op |= rules[i].op;
+			continue;
+		}
+		f = kzalloc(sizeof(struct ipv4_filters), GFP_KERNEL);
+		if (!f)
+			goto out;
+		f->filter = rules[i];
+		list_add_tail(&f->list, filters);
+		last = f;
+	}
+	return 0;
+out:
+	list_for_each_entry_safe(f, tmp, filters, list) {
+		list_del(&f->list);
+		kfree(f);
+	}
+	return -ENOMEM;
+}
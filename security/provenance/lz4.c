@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <linux/init.h>
+#include <linux/debugfs.h>
+#include <linux/lz4.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+
+#include "provenance.h"
+#include "provenance_relay.h"
+#include "provenance_lz4.h"
+
+#define PROV_LZ4_SUFFIX         "_lz4"
+#define PROV_LZ4_RATIO          4
+
+static bool prov_lz4;
+static unsigned int prov_lz4_ratio = PROV_LZ4_RATIO;
+
+/* provenance_lz4[=<expected compression ratio>] */
+static int __init set_lz4(char *str)
+{
+	unsigned int ratio;
+
+	prov_lz4 = true;
+	if (*str == '=' && !kstrtouint(str + 1, 0, &ratio) && ratio)
+		prov_lz4_ratio = ratio;
+	return 1;
+}
+__setup("provenance_lz4", set_lz4);
+
+/*!
+ * @brief Whether channels are compressed.
+ *
+ * Their uncompressed relay files cannot be opened and the overwrite policy
+ * cannot be selected: sub-buffers awaiting compression are never
+ * overwritten.
+ * @return true if the "provenance_lz4" boot parameter was given.
+ *
+ */
+bool prov_lz4_enabled(void)
+{
+	return prov_lz4;
+}
+
+static struct dentry *create_buf_file_handler(const char *filename,
+					      struct dentry *parent,
+					      umode_t mode,
+					      struct rchan_buf *buf,
+					      int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
+
+static int remove_buf_file_handler(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static struct rchan_callbacks prov_lz4_callbacks = {
+	.create_buf_file = create_buf_file_handler,
+	.remove_buf_file = remove_buf_file_handler,
+};
+
+/*!
+ * @brief Compress a sub-buffer into a frame of the compressed relay buffer.
+ *
+ * The block is compressed into the scratch buffer of the CPU and only its
+ * actual size is reserved in the relay buffer, which therefore holds as many
+ * frames as fit in a sub-buffer. The buffer offset is only moved past the
+ * frame once it is complete, so that readers never see a partial frame.
+ * @param lz4 The compression state of the channel.
+ * @param lc The compression state of the CPU.
+ * @param out The compressed relay buffer.
+ * @param src The sub-buffer content.
+ * @param len Its length.
+ *
+ */
+static void prov_lz4_frame(struct prov_lz4 *lz4,
+			   struct prov_lz4_cpu *lc,
+			   struct rchan_buf *out,
+			   const char *src,
+			   size_t len)
+{
+	struct prov_lz4_frame *frame;
+	size_t length;
+	int size;
+
+	size = LZ4_compress_default(src, lc->scratch, len,
+				    LZ4_COMPRESSBOUND(len), lc->wrkmem);
+	if (size <= 0)
+		goto drop;
+	length = sizeof(struct prov_lz4_frame) + size;
+	if (out->offset + length > out->chan->subbuf_size) {
+		if (!relay_switch_subbuf(out, length))
+			goto drop;
+	}
+	frame = (struct prov_lz4_frame *)(out->data + out->offset);
+	frame->magic = PROV_LZ4_MAGIC;
+	frame->compressed_size = size;
+	frame->original_size = len;
+	frame->reserved = 0;
+	memcpy(frame + 1, lc->scratch, size);
+	smp_wmb();
+	out->offset += length;
+	return;
+drop:
+	atomic64_inc(&lz4->dropped);
+}
+
+/*!
+ * @brief Compress the completed sub-buffers of a CPU buffer.
+ *
+ * Compressed sub-buffers are marked as consumed, the uncompressed buffer is
+ * therefore never read from userspace.
+ * Channels using compression are never re-opened, so chan is stable.
+ *
+ */
+static void prov_lz4_work(struct work_struct *work)
+{
+	struct prov_lz4_cpu *lc = container_of(work, struct prov_lz4_cpu, work);
+	struct prov_channel *pc = lc->pc;
+	struct rchan *chan = rcu_dereference_protected(pc->chan, true);
+	struct rchan_buf *buf = *per_cpu_ptr(chan->buf, lc->cpu);
+	struct rchan_buf *out = *per_cpu_ptr(pc->lz4->chan->buf, lc->cpu);
+	size_t n = chan->n_subbufs;
+	size_t size = chan->subbuf_size;
+	size_t i;
+
+	if (!buf || !out)
+		return;
+	while (buf->subbufs_consumed != READ_ONCE(buf->subbufs_produced)) {
+		// pairs with the writers on the CPU owning buf
+		smp_rmb();
+		i = buf->subbufs_consumed % n;
+		prov_lz4_frame(pc->lz4, lc, out, buf->start + i * size,
+			       size - buf->padding[i]);
+		relay_subbufs_consumed(chan, lc->cpu, 1);
+	}
+}
+
+/*!
+ * @brief Schedule the compression of the sub-buffers completed in a CPU
+ * buffer.
+ *
+ * Called from the sub-buffer switch callback, with interrupts disabled.
+ *
+ */
+void prov_lz4_queue(struct prov_channel *pc, struct rchan_buf *buf)
+{
+	queue_work_on(buf->cpu, system_wq,
+		      &per_cpu_ptr(pc->lz4->cpus, buf->cpu)->work);
+}
+
+static void prov_lz4_free(struct prov_lz4 *lz4)
+{
+	int cpu;
+
+	if (lz4->cpus) {
+		for_each_possible_cpu(cpu) {
+			kvfree(per_cpu_ptr(lz4->cpus, cpu)->wrkmem);
+			kvfree(per_cpu_ptr(lz4->cpus, cpu)->scratch);
+		}
+		free_percpu(lz4->cpus);
+	}
+	kfree(lz4);
+}
+
+/*!
+ * @brief Open the compressed relay of a channel, if compression is enabled.
+ *
+ * Compressed sub-buffers can hold the worst case compression of a full
+ * uncompressed sub-buffer; there are prov_lz4_ratio times fewer of them than
+ * uncompressed sub-buffers (set with the "provenance_lz4=" boot parameter).
+ * Frames that do not fit are dropped and counted.
+ * @param pc The channel, whose relay must already be open.
+ * @return 0 on success or if compression is not enabled; -ENOMEM if the
+ * compressed relay could not be allocated.
+ *
+ */
+int prov_lz4_open(struct prov_channel *pc)
+{
+	char name[PROV_CHANNEL_NAME_LEN + sizeof(PROV_LZ4_SUFFIX)];
+	struct prov_lz4_cpu *lc;
+	struct prov_lz4 *lz4;
+	int cpu;
+
+	if (!prov_lz4 || pc->numa)
+		return 0;
+
+	lz4 = kzalloc(sizeof(struct prov_lz4), GFP_KERNEL);
+	if (!lz4)
+		return -ENOMEM;
+	atomic64_set(&lz4->dropped, 0);
+	lz4->cpus = alloc_percpu(struct prov_lz4_cpu);
+	if (!lz4->cpus)
+		goto out;
+	for_each_possible_cpu(cpu) {
+		lc = per_cpu_ptr(lz4->cpus, cpu);
+		INIT_WORK(&lc->work, prov_lz4_work);
+		lc->pc = pc;
+		lc->cpu = cpu;
+		lc->wrkmem = kvmalloc_node(LZ4_MEM_COMPRESS, GFP_KERNEL,
+					   cpu_to_node(cpu));
+		lc->scratch = kvmalloc_node(LZ4_COMPRESSBOUND(pc->subbuf_size),
+					    GFP_KERNEL, cpu_to_node(cpu));
+		if (!lc->wrkmem || !lc->scratch)
+			goto out;
+	}
+	snprintf(name, sizeof(name), "%s%s", pc->name, PROV_LZ4_SUFFIX);
+	lz4->chan = relay_open(name, NULL,
+			       sizeof(struct prov_lz4_frame) +
+			       LZ4_COMPRESSBOUND(pc->subbuf_size),
+			       max_t(size_t, pc->nb_subbuf / prov_lz4_ratio, 2),
+			       &prov_lz4_callbacks, pc);
+	if (!lz4->chan)
+		goto out;
+	pc->lz4 = lz4;
+	return 0;
+out:
+	prov_lz4_free(lz4);
+	return -ENOMEM;
+}
+
+/*!
+ * @brief Close the compressed relay of a channel that was never published.
+ */
+void prov_lz4_close(struct prov_channel *pc)
+{
+	struct prov_lz4 *lz4 = pc->lz4;
+	int cpu;
+
+	if (!lz4)
+		return;
+	for_each_possible_cpu(cpu)
+		cancel_work_sync(&per_cpu_ptr(lz4->cpus, cpu)->work);
+	relay_close(lz4->chan);
+	pc->lz4 = NULL;
+	prov_lz4_free(lz4);
+}
@@ -44,6 +44,7 @@ void init_prov_machine(void)
 		    CAMFLOW_COMMIT,
 		    strnlen(CAMFLOW_COMMIT,
 			    PROV_COMMIT_MAX_LENGTH));
+	prov_machine->machine_info.id_block = prov_id_block;
 	prov_type(prov_machine) = AGT_MACHINE;
 	node_identifier(prov_machine).version = 1;
 	refresh_prov_machine();
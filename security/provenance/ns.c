@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "provenance.h"
+#include "provenance_ns.h"
+
+#define PROV_NS_EMPTY           U32_MAX
+
+static inline void ns_key(const struct nsinfo *info,
+			  uint32_t ns[PROV_NS_DIMS])
+{
+	ns[0] = info->utsns;
+	ns[1] = info->ipcns;
+	ns[2] = info->mntns;
+	ns[3] = info->pidns;
+	ns[4] = info->netns;
+	ns[5] = info->cgroupns;
+}
+
+static inline uint8_t ns_mask(const uint32_t ns[PROV_NS_DIMS])
+{
+	uint8_t mask = 0;
+	int i;
+
+	for (i = 0; i < PROV_NS_DIMS; i++)
+		if (ns[i] != IGNORE_NS)
+			mask |= BIT(i);
+	return mask;
+}
+
+static inline uint32_t ns_hash(const uint32_t ns[PROV_NS_DIMS])
+{
+	return jhash2(ns, PROV_NS_DIMS, 0);
+}
+
+uint8_t __prov_ns_whichOP(struct prov_ns_matcher __rcu **matcher,
+			  const uint32_t ns[PROV_NS_DIMS])
+{
+	struct prov_ns_matcher *m;
+	struct prov_ns_tuple *t;
+	struct prov_ns_rule *r;
+	uint32_t key[PROV_NS_DIMS];
+	uint32_t best = PROV_NS_EMPTY, i, j;
+	uint8_t op = 0;
+	int d;
+
+	rcu_read_lock();
+	m = rcu_dereference(*matcher);
+	if (!m)
+		goto out;
+	for (i = 0; i < m->nr_tuples; i++) {
+		t = &m->tuples[i];
+		// tuples are sorted by priority, no better match left
+		if (t->prio >= best)
+			break;
+		for (d = 0; d < PROV_NS_DIMS; d++)
+			key[d] = (t->mask & BIT(d)) ? ns[d] : IGNORE_NS;
+		for (j = ns_hash(key) & (t->size - 1);; j = (j + 1) & (t->size - 1)) {
+			r = &m->rules[t->first + j];
+			if (r->prio == PROV_NS_EMPTY)
+				break;
+			if (!memcmp(r->ns, key, sizeof(key))) {
+				if (r->prio < best) {
+					best = r->prio;
+					op = r->op;
+				}
+				break;
+			}
+		}
+	}
+out:
+	rcu_read_unlock();
+	return op;
+}
+
+/*!
+ * @brief Compile a namespace filter list into a matcher and publish it.
+ *
+ * Filters are expected to be unique, as guaranteed by the securityfs
+ * interface.
+ * Must be called with prov_filter_lock held. The previous matcher is freed
+ * after a grace period.
+ * @param filters The filter list.
+ * @param matcher The matcher to replace.
+ * @return 0 on success, -ENOMEM if the matcher could not be allocated, in which
+ * case the previous matcher is kept.
+ *
+ */
+int prov_ns_rebuild(struct list_head *filters,
+		    struct prov_ns_matcher __rcu **matcher)
+{
+	struct prov_ns_matcher *m = NULL, *old;
+	uint32_t count[1 << PROV_NS_DIMS] = { 0 };
+	int8_t tuple[1 << PROV_NS_DIMS];
+	uint32_t ns[PROV_NS_DIMS];
+	uint32_t slots = 0, prio = 0, i, j;
+	struct prov_ns_tuple *t;
+	struct ns_filters *f;
+	uint8_t mask;
+
+	list_for_each_entry(f, filters, list) {
+		ns_key(&f->filter, ns);
+		count[ns_mask(ns)]++;
+	}
+	for (i = 0; i < ARRAY_SIZE(count); i++)
+		if (count[i])
+			slots += roundup_pow_of_two(2 * count[i]);
+	if (!slots)
+		goto publish;
+
+	m = kvzalloc(struct_size(m, rules, slots), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+	for (i = 0; i < slots; i++)
+		m->rules[i].prio = PROV_NS_EMPTY;
+	// tuples are created in the order of their first filter
+	memset(tuple, -1, sizeof(tuple));
+	slots = 0;
+	list_for_each_entry(f, filters, list) {
+		ns_key(&f->filter, ns);
+		mask = ns_mask(ns);
+		if (tuple[mask] < 0) {
+			tuple[mask] = m->nr_tuples;
+			t = &m->tuples[m->nr_tuples++];
+			t->mask = mask;
+			t->prio = prio;
+			t->first = slots;
+			t->size = roundup_pow_of_two(2 * count[mask]);
+			slots += t->size;
+		}
+		t = &m->tuples[tuple[mask]];
+		j = ns_hash(ns) & (t->size - 1);
+		while (m->rules[t->first + j].prio != PROV_NS_EMPTY)
+			j = (j + 1) & (t->size - 1);
+		memcpy(m->rules[t->first + j].ns, ns, sizeof(ns));
+		m->rules[t->first + j].prio = prio++;
+		m->rules[t->first + j].op = f->filter.op;
+	}
+publish:
+	old = rcu_replace_pointer(*matcher, m,
+				  lockdep_is_held(&prov_filter_lock));
+	if (old)
+		kvfree_rcu(old, rcu);
+	return 0;
+}
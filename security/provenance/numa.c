@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <linux/init.h>
+#include <linux/debugfs.h>
+#include <linux/nodemask.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <uapi/linux/provenance_fs.h>
+
+#include "provenance.h"
+#include "provenance_numa.h"
+
+/* 0 means per-CPU relay buffers are used */
+size_t prov_numa_size;
+
+/* provenance_numa=<ring size per NUMA node> */
+static int __init set_numa_size(char *str)
+{
+	size_t size = memparse(str, NULL);
+
+	if (size)
+		prov_numa_size = roundup_pow_of_two(max_t(size_t, size,
+							  PAGE_SIZE));
+	return 1;
+}
+__setup("provenance_numa=", set_numa_size);
+
+/*!
+ * @brief Copy committed records of a NUMA ring to userspace.
+ *
+ * Records are copied in the order they were reserved, the record headers are
+ * stripped so that the stream has the same layout as a per-CPU relay file.
+ * A prov_wire_marker is copied before a record whose wire format differs
+ * from the one of the previous record.
+ * Copying stops at the first record not yet committed.
+ * Consumed records are zeroed before being handed back to the producers.
+ *
+ */
+static ssize_t prov_numa_read(struct file *filp, char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct prov_numa_ring *ring = filp->private_data;
+	struct prov_wire_marker marker = { .magic = PROV_WIRE_MARKER_MAGIC };
+	struct prov_numa_rec *rec;
+	unsigned long tail;
+	size_t copied = 0, len, mark;
+	ssize_t rc = 0;
+	uint32_t state;
+
+	mutex_lock(&ring->read_lock);
+	tail = ring->tail;
+	while (true) {
+		rec = (struct prov_numa_rec *)(ring->data +
+					       (tail & (ring->size - 1)));
+		state = smp_load_acquire(&rec->state);
+		if (state == PROV_NUMA_EMPTY)
+			break;
+		len = rec->size - sizeof(struct prov_numa_rec);
+		if ((state & PROV_NUMA_STATE_MASK) == PROV_NUMA_COMMITTED) {
+			marker.format = state >> PROV_NUMA_FORMAT_SHIFT;
+			mark = marker.format != ring->format ?
+			       sizeof(struct prov_wire_marker) : 0;
+			if (copied + mark + len > count)
+				break;
+			if (copy_to_user(buf + copied, &marker, mark) ||
+			    copy_to_user(buf + copied + mark, rec + 1, len)) {
+				rc = -EFAULT;
+				break;
+			}
+			ring->format = marker.format;
+			copied += mark + len;
+		}
+		tail += rec->size;
+		memset(rec, 0, rec->size);
+	}
+	smp_store_release(&ring->tail, tail);
+	mutex_unlock(&ring->read_lock);
+	if (copied)
+		return copied;
+	return rc;
+}
+
+static const struct file_operations prov_numa_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = prov_numa_read,
+	.llseek = no_llseek,
+};
+
+/*!
+ * @brief Remove and free the per-node rings of a channel.
+ */
+void prov_numa_free(struct prov_numa_ring **rings)
+{
+	int node;
+
+	for_each_node(node) {
+		if (!rings[node])
+			continue;
+		debugfs_remove(rings[node]->dentry);
+		vfree(rings[node]->data);
+		kfree(rings[node]);
+	}
+	kfree(rings);
+}
+
+/*!
+ * @brief Allocate the per-node rings of a channel.
+ *
+ * Each ring is allocated on its node and exposed in debugfs as
+ * "<name>_node<N>".
+ * @param name The name of the channel.
+ * @return An array of rings indexed by node id or NULL if the rings could not
+ * be allocated.
+ *
+ */
+struct prov_numa_ring **prov_numa_alloc(const char *name)
+{
+	struct prov_numa_ring **rings;
+	struct prov_numa_ring *ring;
+	char filename[PROV_CHANNEL_NAME_LEN + 16];
+	int node;
+
+	rings = kcalloc(nr_node_ids, sizeof(struct prov_numa_ring *),
+			GFP_KERNEL);
+	if (!rings)
+		return NULL;
+	for_each_node(node) {
+		ring = kzalloc_node(sizeof(struct prov_numa_ring), GFP_KERNEL,
+				    node);
+		if (!ring)
+			goto out;
+		rings[node] = ring;
+		ring->size = prov_numa_size;
+		ring->data = vzalloc_node(prov_numa_size, node);
+		if (!ring->data)
+			goto out;
+		mutex_init(&ring->read_lock);
+		snprintf(filename, sizeof(filename), "%s_node%d", name, node);
+		ring->dentry = debugfs_create_file(filename, 0400, NULL, ring,
+						   &prov_numa_fops);
+	}
+	pr_info("Provenance: %s uses %zu bytes ring per NUMA node.", name,
+		prov_numa_size);
+	return rings;
+out:
+	prov_numa_free(rings);
+	return NULL;
+}
+
+/*!
+ * @brief Whether the ring of the current NUMA node is more than three
+ * quarters full.
+ */
+bool prov_numa_full(struct prov_numa_ring **rings)
+{
+	struct prov_numa_ring *ring;
+	bool full;
+
+	ring = rings[cpu_to_node(get_cpu())];
+	full = (READ_ONCE(ring->head) - READ_ONCE(ring->tail)) * 4 >=
+	       ring->size * 3;
+	put_cpu();
+	return full;
+}
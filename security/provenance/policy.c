@@ -0,0 +1,435 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <linux/mm.h>
+#include <linux/security.h>
+#include <linux/slab.h>
+#include <crypto/hash.h>
+
+#include "provenance.h"
+#include "provenance_net.h"
+
+/* digest of the policy, valid if computed for the current filters and flags */
+static struct crypto_shash *policy_tfm;
+static uint8_t policy_digest[HASH_MAX_DIGESTSIZE];
+static uint32_t policy_digest_gen;
+static struct capture_policy policy_digest_flags;
+
+/*!
+ * @brief Allocate an empty filter set.
+ *
+ * @return The set or NULL if it could not be allocated.
+ *
+ */
+struct prov_filter_set *prov_filter_set_alloc(void)
+{
+	struct prov_filter_set *s;
+
+	s = kzalloc(sizeof(struct prov_filter_set), GFP_KERNEL);
+	if (!s)
+		return NULL;
+	INIT_LIST_HEAD(&s->ipv4[PROV_IPV4_INGRESS]);
+	INIT_LIST_HEAD(&s->ipv4[PROV_IPV4_EGRESS]);
+	INIT_LIST_HEAD(&s->ns_filters);
+	INIT_LIST_HEAD(&s->secctx_filters);
+	INIT_LIST_HEAD(&s->user_filters);
+	INIT_LIST_HEAD(&s->group_filters);
+	INIT_LIST_HEAD(&s->cgroup_filters);
+	if (rhashtable_init(&s->secctx_filters_table, &secctx_filters_params))
+		goto out;
+	if (rhashtable_init(&s->user_filters_table, &user_filters_params))
+		goto out_secctx;
+	if (rhashtable_init(&s->group_filters_table, &group_filters_params))
+		goto out_user;
+	if (rhashtable_init(&s->cgroup_filters_table, &cgroup_filters_params))
+		goto out_group;
+	return s;
+out_group:
+	rhashtable_destroy(&s->group_filters_table);
+out_user:
+	rhashtable_destroy(&s->user_filters_table);
+out_secctx:
+	rhashtable_destroy(&s->secctx_filters_table);
+out:
+	kfree(s);
+	return NULL;
+}
+
+#define free_filters(head, type)					\
+	do {								\
+		struct type *f, *tmp;					\
+		list_for_each_entry_safe(f, tmp, head, list) {		\
+			list_del(&f->list);				\
+			kfree(f);					\
+		}							\
+	} while (0)
+
+/*!
+ * @brief Free a filter set.
+ *
+ * The set must not be reachable by readers anymore (i.e., a grace period
+ * elapsed since it was unpublished, or it never was published).
+ *
+ */
+void prov_filter_set_free(struct prov_filter_set *s)
+{
+	int dir;
+
+	rhashtable_destroy(&s->secctx_filters_table);
+	rhashtable_destroy(&s->user_filters_table);
+	rhashtable_destroy(&s->group_filters_table);
+	rhashtable_destroy(&s->cgroup_filters_table);
+	for (dir = PROV_IPV4_INGRESS; dir <= PROV_IPV4_EGRESS; dir++) {
+		free_filters(&s->ipv4[dir], ipv4_filters);
+		kvfree(rcu_dereference_protected(s->ipv4trie[dir], true));
+	}
+	free_filters(&s->ns_filters, ns_filters);
+	kvfree(rcu_dereference_protected(s->ns_matcher, true));
+	free_filters(&s->secctx_filters, secctx_filters);
+	free_filters(&s->user_filters, user_filters);
+	free_filters(&s->group_filters, group_filters);
+	free_filters(&s->cgroup_filters, cgroup_filters);
+	kfree(s);
+}
+
+#define hash_filters(desc, head, type, info)				     \
+	do {								     \
+		struct type *f;						     \
+		list_for_each_entry(f, head, list) {			     \
+			rc = crypto_shash_update(desc, (u8 *)&f->filter,     \
+						 sizeof(struct info));	     \
+			if (rc)						     \
+				return rc;				     \
+		}							     \
+	} while (0)
+
+/*!
+ * @brief Update the digest of the policy if the filters or the flags changed
+ * since it was computed.
+ *
+ * The digest covers the LSM version and commit, the capture flags and the
+ * filters, in list order. Must be called with prov_filter_lock held.
+ * @return 0 on success, an error code if the hash could not be computed.
+ *
+ */
+static int policy_hash(void)
+{
+	struct prov_filter_set *s = prov_filters_locked();
+	struct capture_policy flags;
+	struct crypto_shash *tfm;
+	int rc;
+
+	if (!policy_tfm) {
+		tfm = crypto_alloc_shash(PROVENANCE_HASH, 0, 0);
+		if (IS_ERR(tfm))
+			return PTR_ERR(tfm);
+		policy_tfm = tfm;
+	}
+	memcpy(&flags, &prov_policy, sizeof(struct capture_policy));
+	if (policy_digest_gen == prov_filter_gen &&
+	    !memcmp(&flags, &policy_digest_flags, sizeof(struct capture_policy)))
+		return 0;
+	{
+		SHASH_DESC_ON_STACK(desc, policy_tfm);
+
+		desc->tfm = policy_tfm;
+		rc = crypto_shash_init(desc);
+		if (rc)
+			return rc;
+		/* LSM version */
+		rc = crypto_shash_update(desc, (u8 *)CAMFLOW_VERSION_STR,
+					 strnlen(CAMFLOW_VERSION_STR, 32));
+		if (rc)
+			return rc;
+		/* commit */
+		rc = crypto_shash_update(desc, (u8 *)CAMFLOW_COMMIT,
+					 strnlen(CAMFLOW_COMMIT,
+						 PROV_COMMIT_MAX_LENGTH));
+		if (rc)
+			return rc;
+		/* general policy */
+		rc = crypto_shash_update(desc, (u8 *)&flags,
+					 sizeof(struct capture_policy));
+		if (rc)
+			return rc;
+		/* ingress network policy */
+		hash_filters(desc, &s->ipv4[PROV_IPV4_INGRESS], ipv4_filters,
+			     prov_ipv4_filter);
+		/* egress network policy */
+		hash_filters(desc, &s->ipv4[PROV_IPV4_EGRESS], ipv4_filters,
+			     prov_ipv4_filter);
+		/* namespace policy */
+		hash_filters(desc, &s->ns_filters, ns_filters, nsinfo);
+		/* secctx policy */
+		hash_filters(desc, &s->secctx_filters, secctx_filters, secinfo);
+		/* userid policy */
+		hash_filters(desc, &s->user_filters, user_filters, userinfo);
+		/* groupid policy */
+		hash_filters(desc, &s->group_filters, group_filters, groupinfo);
+		/* cgroup policy */
+		hash_filters(desc, &s->cgroup_filters, cgroup_filters,
+			     cgroupinfo);
+		rc = crypto_shash_final(desc, policy_digest);
+		shash_desc_zero(desc);
+		if (rc)
+			return rc;
+	}
+	policy_digest_gen = prov_filter_gen;
+	memcpy(&policy_digest_flags, &flags, sizeof(struct capture_policy));
+	return 0;
+}
+
+/*!
+ * @brief Copy the digest of the current policy.
+ *
+ * The digest is only recomputed when the policy changed since the last call.
+ * @param buf The buffer receiving the digest.
+ * @param size Its size.
+ * @return The size of the digest; -ENOMEM if buf is too small; -EAGAIN if the
+ * digest could not be computed.
+ *
+ */
+ssize_t prov_policy_digest(uint8_t *buf, size_t size)
+{
+	ssize_t len;
+
+	mutex_lock(&prov_filter_lock);
+	if (policy_hash()) {
+		pr_err("Provenance: error computing policy hash.");
+		len = -EAGAIN;
+		goto out;
+	}
+	len = crypto_shash_digestsize(policy_tfm);
+	if (size < len)
+		len = -ENOMEM;
+	else
+		memcpy(buf, policy_digest, len);
+out:
+	mutex_unlock(&prov_filter_lock);
+	return len;
+}
+
+/* return the next nr elements of the blob, NULL if it is too short */
+static void *policy_array(uint8_t **cursor, size_t *left, uint32_t nr,
+			  size_t size)
+{
+	void *array = *cursor;
+
+	if (nr > *left / size)
+		return NULL;
+	*cursor += nr * size;
+	*left -= nr * size;
+	return array;
+}
+
+#define load_filters(s, type, info, rules, nr, add_function)		\
+	do {								\
+		struct type *f;						\
+		for (i = 0; i < nr; i++) {				\
+			f = kzalloc(sizeof(struct type), GFP_KERNEL);	\
+			if (!f)						\
+				return -ENOMEM;				\
+			memcpy(&f->filter, &rules[i], sizeof(struct info)); \
+			rc = add_function(s, f);			\
+			if (rc)						\
+				return rc;				\
+		}							\
+	} while (0)
+
+/*!
+ * @brief Fill an empty filter set from the filters of a policy blob.
+ *
+ * Must be called with prov_filter_lock held.
+ *
+ */
+static int policy_fill(struct prov_filter_set *s,
+		       const struct prov_policy_header *hdr,
+		       struct prov_ipv4_filter *ipv4[2],
+		       struct nsinfo *ns,
+		       struct secinfo *secctx,
+		       struct userinfo *uid,
+		       struct groupinfo *gid,
+		       struct cgroupinfo *cgroup)
+{
+	uint32_t nr_ipv4[2] = { hdr->nr_ipv4_ingress, hdr->nr_ipv4_egress };
+	struct ns_filters *nsf;
+	uint32_t i;
+	int dir, rc;
+
+	for (dir = PROV_IPV4_INGRESS; dir <= PROV_IPV4_EGRESS; dir++) {
+		rc = prov_lpm_filters(ipv4[dir], nr_ipv4[dir], &s->ipv4[dir]);
+		if (rc)
+			return rc;
+		rc = prov_lpm_rebuild(&s->ipv4[dir], &s->ipv4trie[dir]);
+		if (rc)
+			return rc;
+	}
+	for (i = 0; i < hdr->nr_ns; i++) {
+		nsf = kzalloc(sizeof(struct ns_filters), GFP_KERNEL);
+		if (!nsf)
+			return -ENOMEM;
+		nsf->filter = ns[i];
+		prov_ns_add_or_update(&s->ns_filters, nsf);
+	}
+	rc = prov_ns_rebuild(&s->ns_filters, &s->ns_matcher);
+	if (rc)
+		return rc;
+	load_filters(s, secctx_filters, secinfo, secctx, hdr->nr_secctx,
+		     prov_secctx_add_or_update);
+	load_filters(s, user_filters, userinfo, uid, hdr->nr_uid,
+		     prov_uid_add_or_update);
+	load_filters(s, group_filters, groupinfo, gid, hdr->nr_gid,
+		     prov_gid_add_or_update);
+	load_filters(s, cgroup_filters, cgroupinfo, cgroup, hdr->nr_cgroup,
+		     prov_cgroup_add_or_update);
+	return 0;
+}
+
+#define policy_filter_op_valid(rules, nr)				     \
+	({								     \
+		bool __valid = true;					     \
+		for (i = 0; i < nr; i++)				     \
+			if (rules[i].op & (PROV_SET_DELETE | PROV_SET_REPLACE)) \
+				__valid = false;			     \
+		__valid;						     \
+	})
+
+/*!
+ * @brief Load a policy blob, replacing the whole policy at once.
+ *
+ * The blob (see struct prov_policy_header) is validated and a new filter set
+ * is built from it before anything is modified; the set is then published in
+ * place of the current one and the capture flags are updated, the digest of
+ * the new policy is computed. Readers either see the old or the new filters.
+ * Filters are in the same format as the one expected by the individual filter
+ * files; PROV_SET_DELETE and PROV_SET_REPLACE are not allowed. Reserved header
+ * fields must be 0 and every security context must be known to the LSMs.
+ * @param blob The blob, modified in place.
+ * @param size Its size.
+ * @return 0 on success; -EINVAL if the blob is malformed; -ENOMEM if the new
+ * filters could not be allocated. The policy is left unchanged on failure.
+ *
+ */
+int prov_policy_load(void *blob, size_t size)
+{
+	struct prov_policy_header *hdr = blob;
+	struct prov_ipv4_filter *ipv4[2];
+	struct prov_filter_set *s, *old;
+	struct cgroupinfo *cgroup;
+	struct secinfo *secctx;
+	struct groupinfo *gid;
+	struct userinfo *uid;
+	struct nsinfo *ns;
+	uint8_t *cursor = blob;
+	uint32_t nr_ipv4[2];
+	size_t left = size;
+	uint32_t i;
+	int dir, rc;
+
+	if (size < sizeof(struct prov_policy_header) ||
+	    hdr->magic != PROV_POLICY_MAGIC ||
+	    hdr->version != PROV_POLICY_VERSION ||
+	    hdr->size != size ||
+	    memchr_inv(hdr->reserved, 0, sizeof(hdr->reserved)) ||
+	    hdr->reserved2)
+		return -EINVAL;
+	cursor += sizeof(struct prov_policy_header);
+	left -= sizeof(struct prov_policy_header);
+	ipv4[PROV_IPV4_INGRESS] = policy_array(&cursor, &left,
+					       hdr->nr_ipv4_ingress,
+					       sizeof(struct prov_ipv4_filter));
+	ipv4[PROV_IPV4_EGRESS] = policy_array(&cursor, &left,
+					      hdr->nr_ipv4_egress,
+					      sizeof(struct prov_ipv4_filter));
+	ns = policy_array(&cursor, &left, hdr->nr_ns, sizeof(struct nsinfo));
+	secctx = policy_array(&cursor, &left, hdr->nr_secctx,
+			      sizeof(struct secinfo));
+	uid = policy_array(&cursor, &left, hdr->nr_uid,
+			   sizeof(struct userinfo));
+	gid = policy_array(&cursor, &left, hdr->nr_gid,
+			   sizeof(struct groupinfo));
+	cgroup = policy_array(&cursor, &left, hdr->nr_cgroup,
+			      sizeof(struct cgroupinfo));
+	if (!ipv4[PROV_IPV4_INGRESS] || !ipv4[PROV_IPV4_EGRESS] || !ns ||
+	    !secctx || !uid || !gid || !cgroup || left)
+		return -EINVAL;
+	nr_ipv4[PROV_IPV4_INGRESS] = hdr->nr_ipv4_ingress;
+	nr_ipv4[PROV_IPV4_EGRESS] = hdr->nr_ipv4_egress;
+	if (!policy_filter_op_valid(ipv4[PROV_IPV4_INGRESS],
+				    nr_ipv4[PROV_IPV4_INGRESS]) ||
+	    !policy_filter_op_valid(ipv4[PROV_IPV4_EGRESS],
+				    nr_ipv4[PROV_IPV4_EGRESS]) ||
+	    !policy_filter_op_valid(ns, hdr->nr_ns) ||
+	    !policy_filter_op_valid(secctx, hdr->nr_secctx) ||
+	    !policy_filter_op_valid(uid, hdr->nr_uid) ||
+	    !policy_filter_op_valid(gid, hdr->nr_gid) ||
+	    !policy_filter_op_valid(cgroup, hdr->nr_cgroup))
+		return -EINVAL;
+	for (dir = PROV_IPV4_INGRESS; dir <= PROV_IPV4_EGRESS; dir++) {
+		for (i = 0; i < nr_ipv4[dir]; i++) {
+			if (!prov_lpm_mask_valid(ipv4[dir][i].mask))
+				return -EINVAL;
+			ipv4[dir][i].ip &= ipv4[dir][i].mask;
+		}
+	}
+	for (i = 0; i < hdr->nr_secctx; i++) {
+		if (secctx[i].len >= PATH_MAX)
+			return -EINVAL;
+		if (security_secctx_to_secid(secctx[i].secctx, secctx[i].len,
+					     &secctx[i].secid))
+			return -EINVAL;
+	}
+
+	s = prov_filter_set_alloc();
+	if (!s)
+		return -ENOMEM;
+	mutex_lock(&prov_filter_lock);
+	rc = policy_fill(s, hdr, ipv4, ns, secctx, uid, gid, cgroup);
+	if (rc) {
+		mutex_unlock(&prov_filter_lock);
+		prov_filter_set_free(s);
+		return rc;
+	}
+	old = rcu_replace_pointer(prov_filters, s,
+				  lockdep_is_held(&prov_filter_lock));
+	WRITE_ONCE(prov_policy.prov_enabled, hdr->enabled != 0);
+	WRITE_ONCE(prov_policy.prov_all, hdr->all != 0);
+	WRITE_ONCE(prov_policy.should_compress_node, hdr->compress_node != 0);
+	WRITE_ONCE(prov_policy.should_compress_edge, hdr->compress_edge != 0);
+	WRITE_ONCE(prov_policy.should_duplicate, hdr->duplicate != 0);
+	WRITE_ONCE(prov_policy.prov_node_filter, hdr->node_filter);
+	WRITE_ONCE(prov_policy.prov_derived_filter, hdr->derived_filter);
+	WRITE_ONCE(prov_policy.prov_generated_filter, hdr->generated_filter);
+	WRITE_ONCE(prov_policy.prov_used_filter, hdr->used_filter);
+	WRITE_ONCE(prov_policy.prov_informed_filter, hdr->informed_filter);
+	WRITE_ONCE(prov_policy.prov_propagate_node_filter,
+		   hdr->propagate_node_filter);
+	WRITE_ONCE(prov_policy.prov_propagate_derived_filter,
+		   hdr->propagate_derived_filter);
+	WRITE_ONCE(prov_policy.prov_propagate_generated_filter,
+		   hdr->propagate_generated_filter);
+	WRITE_ONCE(prov_policy.prov_propagate_used_filter,
+		   hdr->propagate_used_filter);
+	WRITE_ONCE(prov_policy.prov_propagate_informed_filter,
+		   hdr->propagate_informed_filter);
+	prov_policy_update();
+	prov_filter_changed();
+	if (policy_hash())
+		pr_err("Provenance: error computing policy hash.");
+	mutex_unlock(&prov_filter_lock);
+
+	synchronize_rcu();
+	prov_filter_set_free(old);
+	return 0;
+}
@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/timekeeping.h>
+
+#include "provenance.h"
+#include "provenance_relay.h"
+#include "provenance_rate.h"
+
+#define PROV_RATE_TASK PROV_STATS_SLOTS
+
+/*!
+ * @brief A configured limit.
+ *
+ * cost is the credit (in nanoseconds) consumed by a relation, 0 if there is
+ * no rate limit; capacity is the credit of a full bucket.
+ */
+struct prov_rate_limit {
+	uint64_t cost;
+	uint64_t capacity;
+	uint32_t sample;
+};
+
+DEFINE_STATIC_KEY_FALSE(prov_rate_key);
+static DEFINE_MUTEX(prov_rate_lock);
+/* limits per relation type slot (see prov_stats_index), then of tasks */
+static struct prov_rate_limit prov_rate_limits[PROV_STATS_SLOTS + 1];
+static struct prov_rate prov_rate_settings[PROV_STATS_SLOTS + 1];
+/* buckets per relation type slot, allocated with the first limit */
+static struct prov_rate_bucket __percpu *prov_rate_buckets;
+
+static inline struct prov_rate_bucket *prov_rate_task(struct task_struct *task)
+{
+	return (struct prov_rate_bucket *)(provenance_task(task) + 1);
+}
+
+static inline bool rate_limited(const struct prov_rate_limit *limit)
+{
+	return limit->cost || limit->sample > 1;
+}
+
+/* refill a bucket, return whether it holds a token */
+static inline bool rate_refill(struct prov_rate_bucket *b, uint64_t cost,
+			       uint64_t capacity, uint64_t now)
+{
+	if (unlikely(!b->last))
+		b->tokens = capacity;
+	else
+		b->tokens = min(b->tokens + (now - b->last), capacity);
+	b->last = now;
+	return b->tokens >= cost;
+}
+
+/* refill a bucket and check whether a relation may be counted against it */
+static inline bool rate_check(struct prov_rate_bucket *b,
+			      const struct prov_rate_limit *limit,
+			      uint64_t now)
+{
+	uint32_t sample = READ_ONCE(limit->sample);
+	uint64_t cost = READ_ONCE(limit->cost);
+
+	if (sample > 1 && ++b->sampled % sample)
+		return false;
+	return !cost || rate_refill(b, cost, READ_ONCE(limit->capacity), now);
+}
+
+/*
+ * count an allowed relation against a bucket checked with rate_check, return
+ * the number of relations suppressed since the last one allowed
+ */
+static inline uint32_t rate_take(struct prov_rate_bucket *b,
+				 const struct prov_rate_limit *limit)
+{
+	uint32_t report = b->suppressed;
+
+	// the limit may have changed since the bucket was checked
+	b->tokens -= min_t(uint64_t, b->tokens, READ_ONCE(limit->cost));
+	b->suppressed = 0;
+	return report;
+}
+
+/*!
+ * @brief Write an ENT_SUPPRESSED node reporting suppressed relations.
+ */
+static void rate_report(uint64_t type, uint32_t count, uint64_t task_id)
+{
+	union prov_elt node;
+
+	memset(&node, 0, sizeof(union prov_elt));
+	prov_type(&node) = ENT_SUPPRESSED;
+	node_identifier(&node).id = prov_next_node_id();
+	node_identifier(&node).boot_id = prov_boot_id;
+	node_identifier(&node).machine_id = prov_machine_id;
+	node.suppressed_info.relation_type = type;
+	node.suppressed_info.count = count;
+	node.suppressed_info.task_id = task_id;
+	node.suppressed_info.cpu = raw_smp_processor_id();
+	prov_write(&node, sizeof(union prov_elt));
+}
+
+/*!
+ * @brief Check a relation against the limit of its type and of the current
+ * task.
+ *
+ * The buckets of relation types are per-CPU and updated with interrupts
+ * disabled; the bucket of a task is only updated by the task itself, relations
+ * recorded from interrupt context are not counted against it.
+ * A token is only taken once both buckets allow the relation, the relation is
+ * counted as suppressed in the first bucket denying it.
+ * When a relation is allowed after some were suppressed, an ENT_SUPPRESSED
+ * node reporting them is written first.
+ * @param type The type of the relation.
+ * @return false if the relation must not be recorded.
+ *
+ */
+bool __prov_rate_allow(uint64_t type)
+{
+	const struct prov_rate_limit *limit, *task_limit;
+	struct prov_rate_bucket *b = NULL, *task_b = NULL;
+	uint64_t now = ktime_get_mono_fast_ns();
+	uint32_t report = 0, task_report = 0;
+	unsigned long irqflags;
+
+	limit = &prov_rate_limits[prov_stats_index(type)];
+	task_limit = &prov_rate_limits[PROV_RATE_TASK];
+	local_irq_save(irqflags);
+	if (rate_limited(limit)) {
+		b = this_cpu_ptr(prov_rate_buckets) + prov_stats_index(type);
+		if (!rate_check(b, limit, now))
+			goto suppress;
+	}
+	if (READ_ONCE(task_limit->cost) && in_task()) {
+		task_b = prov_rate_task(current);
+		if (!rate_check(task_b, task_limit, now)) {
+			b = task_b;
+			goto suppress;
+		}
+	}
+	if (b)
+		report = rate_take(b, limit);
+	if (task_b)
+		task_report = rate_take(task_b, task_limit);
+	local_irq_restore(irqflags);
+	if (unlikely(report))
+		rate_report(type, report, 0);
+	if (unlikely(task_report))
+		rate_report(0, task_report, current_provid());
+	return true;
+suppress:
+	b->suppressed++;
+	local_irq_restore(irqflags);
+	return false;
+}
+
+/*!
+ * @brief Report the relations suppressed by the limit of a task that exits.
+ * @param task The task.
+ *
+ */
+void prov_rate_task_free(struct task_struct *task)
+{
+	struct prov_rate_bucket *b = prov_rate_task(task);
+	struct provenance *tprov = provenance_task(task);
+
+	if (likely(!b->suppressed))
+		return;
+	rate_report(0, b->suppressed, node_identifier(prov_elt(tprov)).id);
+	b->suppressed = 0;
+}
+
+/*
+ * report the relations suppressed by the limits of relation types on the
+ * current CPU, the limits are those in place when suppressing them
+ */
+static void rate_flush_cpu(void *info)
+{
+	struct prov_rate_bucket *b = this_cpu_ptr(prov_rate_buckets);
+	unsigned int slot;
+
+	for (slot = 0; slot < PROV_STATS_SLOTS; slot++) {
+		if (!b[slot].suppressed)
+			continue;
+		rate_report(prov_rate_settings[slot].type, b[slot].suppressed,
+			    0);
+		b[slot].suppressed = 0;
+	}
+}
+
+/*!
+ * @brief Set or remove a rate limit.
+ *
+ * @param setting The limit, see struct prov_rate.
+ * @return 0 on success; -EINVAL if the type is not a relation type; -ENOMEM if
+ * the buckets could not be allocated.
+ *
+ */
+int prov_rate_set(const struct prov_rate *setting)
+{
+	struct prov_rate_limit *limit;
+	struct prov_rate_bucket __percpu *buckets;
+	uint64_t cost = 0;
+	bool enable = false;
+	unsigned int slot;
+	int rc = 0;
+
+	if (setting->type && !prov_type_is_relation(setting->type))
+		return -EINVAL;
+	if (setting->rate > NSEC_PER_SEC)
+		return -EINVAL;
+	slot = setting->type ? prov_stats_index(setting->type) : PROV_RATE_TASK;
+	if (setting->rate)
+		cost = NSEC_PER_SEC / setting->rate;
+
+	mutex_lock(&prov_rate_lock);
+	// relations suppressed under the previous limits are reported before
+	// the new ones apply, on each CPU as buckets are only updated locally
+	if (prov_rate_buckets)
+		on_each_cpu(rate_flush_cpu, NULL, 1);
+	if (!prov_rate_buckets) {
+		buckets = __alloc_percpu(PROV_STATS_SLOTS *
+					 sizeof(struct prov_rate_bucket),
+					 __alignof__(struct prov_rate_bucket));
+		if (!buckets) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		prov_rate_buckets = buckets;
+	}
+	limit = &prov_rate_limits[slot];
+	WRITE_ONCE(limit->capacity, cost * max(setting->burst, 1U));
+	WRITE_ONCE(limit->cost, cost);
+	WRITE_ONCE(limit->sample, setting->type ? setting->sample : 0);
+	prov_rate_settings[slot] = *setting;
+	for (slot = 0; slot <= PROV_RATE_TASK; slot++)
+		enable |= rate_limited(&prov_rate_limits[slot]);
+	if (enable)
+		static_branch_enable(&prov_rate_key);
+	else
+		static_branch_disable(&prov_rate_key);
+	// flows handled under the previous limits may not have been recorded
+	prov_policy_invalidate();
+out:
+	mutex_unlock(&prov_rate_lock);
+	return rc;
+}
+
+/*!
+ * @brief Copy the configured rate limits.
+ *
+ * @param settings The array receiving the limits.
+ * @param nr Its size.
+ * @return The number of limits copied.
+ *
+ */
+size_t prov_rate_get(struct prov_rate *settings, size_t nr)
+{
+	size_t n = 0;
+	unsigned int slot;
+
+	mutex_lock(&prov_rate_lock);
+	for (slot = 0; slot <= PROV_RATE_TASK && n < nr; slot++)
+		if (rate_limited(&prov_rate_limits[slot]))
+			settings[n++] = prov_rate_settings[slot];
+	mutex_unlock(&prov_rate_lock);
+	return n;
+}
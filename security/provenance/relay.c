@@ -15,59 +15,177 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/debugfs.h>
-#include <linux/async.h>
 #include <linux/delay.h>
+#include <linux/workqueue.h>
+#include <linux/cpu.h>
+#include <linux/mutex.h>
+#include <linux/ctype.h>
+#include <linux/timekeeping.h>
 
 #include "provenance.h"
 #include "provenance_relay.h"
 #include "provenance_machine.h"
-#include "memcpy_ss.h"
 
 #define PROV_BASE_NAME          "provenance"
 #define LONG_PROV_BASE_NAME     "long_provenance"
 
-static struct rchan *prov_chan;
-static struct rchan *long_prov_chan;
+#define PROV_SPILL_DELAY        (HZ / 10)
+#define PROV_SPILL_BATCH        64
+#define PROV_BLOCK_STEP_MS      1
+#define PROV_ADAPT_DELAY        (10 * HZ)
+#define PROV_ADAPT_SHRINK       6
+/*
+ * Upper bound of the growth of an element in PROV_WIRE_COMPACT format over
+ * its PROV_WIRE_VARLEN size, used to reserve space before encoding.
+ * Varints of the basic elements and identifiers can take more space than the
+ * fixed fields they encode; this is compensated by the fields of
+ * struct msg_struct never being copied as is.
+ */
+#define PROV_COMPACT_SLACK      64
+
+static struct prov_channel prov_chan;
+static struct prov_channel long_prov_chan;
+/*
+ * channels are added with list_add_tail_rcu under prov_channels_lock and
+ * never removed, the lists are walked under RCU or prov_channels_lock
+ */
+LIST_HEAD(prov_channels);
+/* fan-out channels receiving regular and long elements respectively */
+LIST_HEAD(prov_fanout);
+static LIST_HEAD(long_prov_fanout);
+/* serialises channel (re)opening, closing, flushing and listing */
+DEFINE_MUTEX(prov_channels_lock);
+
+static size_t prov_subbuf_size __initdata = PROV_RELAY_BUFF_SIZE;
+static size_t prov_nb_subbuf __initdata = PROV_NB_SUBBUF;
+static size_t long_prov_subbuf_size __initdata = PROV_RELAY_BUFF_SIZE;
+static size_t long_prov_nb_subbuf __initdata = PROV_NB_SUBBUF;
+
+/*!
+ * @brief Whether a relay geometry can hold any record in any wire format.
+ *
+ * A sub-buffer must hold the largest record, a wire format marker and the
+ * header of a compact sub-buffer, and a relay needs at least two sub-buffers.
+ *
+ */
+static bool prov_relay_geometry_valid(size_t subbuf_size, size_t nb_subbuf)
+{
+	if (subbuf_size < sizeof(union long_prov_elt) +
+	    sizeof(struct prov_wire_header) + PROV_COMPACT_SLACK +
+	    sizeof(struct prov_compact_subbuf) + sizeof(struct prov_wire_marker))
+		return false;
+	return nb_subbuf >= 2 && nb_subbuf <= UINT_MAX / subbuf_size;
+}
+
+static int __init parse_relay_size(char *str, size_t *subbuf_size,
+				   size_t *nb_subbuf)
+{
+	unsigned int n;
+	size_t size;
+	char *next;
+
+	size = memparse(str, &next);
+	if (*next != ',' || kstrtouint(next + 1, 0, &n))
+		return 0;
+	if (!prov_relay_geometry_valid(size, n)) {
+		pr_warn("Provenance: invalid relay geometry %u x %zu, using %zu x %zu.",
+			n, size, *nb_subbuf, *subbuf_size);
+		return 1;
+	}
+	*subbuf_size = size;
+	*nb_subbuf = n;
+	return 1;
+}
+
+/* provenance_relay=<sub-buffer size>,<number of sub-buffers> */
+static int __init set_relay_size(char *str)
+{
+	return parse_relay_size(str, &prov_subbuf_size, &prov_nb_subbuf);
+}
+__setup("provenance_relay=", set_relay_size);
+
+/* provenance_long_relay=<sub-buffer size>,<number of sub-buffers> */
+static int __init set_long_relay_size(char *str)
+{
+	return parse_relay_size(str, &long_prov_subbuf_size,
+				&long_prov_nb_subbuf);
+}
+__setup("provenance_long_relay=", set_long_relay_size);
 
 /* Global variables: variable declarations in provenance.h */
 atomic64_t prov_relation_id = ATOMIC64_INIT(0);
 atomic64_t prov_node_id = ATOMIC64_INIT(0);
-atomic64_t prov_drop = ATOMIC64_INIT(0);
+DEFINE_PER_CPU(struct prov_id_range, prov_node_ids);
+DEFINE_PER_CPU(struct prov_id_range, prov_relation_ids);
+unsigned int prov_id_block __ro_after_init = PROV_ID_BLOCK;
+
+/* provenance_id_block=<ids reserved at once by a CPU>, 1 for ordered ids */
+static int __init set_id_block(char *str)
+{
+	unsigned int block;
+
+	if (kstrtouint(str, 0, &block) || !block)
+		return 0;
+	prov_id_block = block;
+	return 1;
+}
+__setup("provenance_id_block=", set_id_block);
+uint8_t prov_wire_format = PROV_WIRE_FIXED;
 
 /*!
  * @brief Flush every relay buffer element in the relay list.
  */
 void prov_flush(void)
 {
+	struct prov_channel *pc;
+
 	if (unlikely(!relay_ready))
 		return;
 
-	relay_flush(prov_chan);
-	relay_flush(long_prov_chan);
+	mutex_lock(&prov_channels_lock);
+	list_for_each_entry(pc, &prov_channels, list)
+		relay_flush(rcu_dereference_protected(pc->chan,
+						      lockdep_is_held(&prov_channels_lock)));
+	mutex_unlock(&prov_channels_lock);
 }
 
-bool is_relay_full(struct rchan *chan)
+/*!
+ * @brief Callback function of function "create_buf_file". This callback
+ * function creates relay file in "debugfs".
+ */
+static struct file_operations prov_relay_fops __ro_after_init;
+
+/*!
+ * @brief Open a relay file of a channel.
+ *
+ * A reader may not attach while the channel is being re-opened: either the
+ * reader sees pc->resizing and backs off, or "prov_channel_resize" sees the
+ * reader and gives up.
+ *
+ */
+static int prov_relay_file_open(struct inode *inode, struct file *filp)
 {
-	int ret;
-	int rc = 0;
-	struct rchan_buf *buf = *this_cpu_ptr(chan->buf);
+	struct rchan_buf *buf = inode->i_private;
+	struct prov_channel *pc = buf->chan->private_data;
+	int rc;
 
-	if (buf) {
-		ret = relay_buf_full(buf);
-		if (ret)
-			pr_warn("Provenance: relay (%s) is full.",
-				chan->base_filename);
-		rc += ret;
-	}
+	// records are only delivered through the "<channel>_lz4" relay
+	if (prov_lz4_enabled())
+		return -EBUSY;
+	if (READ_ONCE(pc->resizing))
+		return -EAGAIN;
+	rc = relay_file_operations.open(inode, filp);
 	if (rc)
-		return true;
-	return false;
+		return rc;
+	// pairs with prov_channel_resize
+	smp_mb();
+	if (READ_ONCE(pc->resizing)) {
+		relay_file_operations.release(inode, filp);
+		return -EAGAIN;
+	}
+	return 0;
 }
 
-/*!
- * @brief Callback function of function "create_buf_file". This callback
- * function creates relay file in "debugfs".
- */
 static struct dentry *create_buf_file_handler(const char *filename,
 					      struct dentry *parent,
 					      umode_t mode,
@@ -75,7 +193,7 @@ static struct dentry *create_buf_file_handler(const char *filename,
 					      int *is_global)
 {
 	return debugfs_create_file(filename, mode, parent, buf,
-				   &relay_file_operations);
+				   &prov_relay_fops);
 }
 
 /*!
@@ -88,6 +206,50 @@ static int remove_buf_file_handler(struct dentry *dentry)
 	return 0;
 }
 
+/*!
+ * @brief Start a sub-buffer in the format requested by the writers.
+ *
+ * A marker is written first unless the sub-buffer and the previous one are
+ * both in PROV_WIRE_FIXED format, so that readers find the format of any
+ * sequence of sub-buffers (e.g., after older ones were overwritten); compact
+ * sub-buffers then start with the identity of the machine.
+ * @param state The wire format state of the CPU.
+ * @param buf The buffer of the CPU.
+ * @param subbuf The start of the new sub-buffer.
+ *
+ */
+static void prov_subbuf_begin(struct prov_subbuf_state *state,
+			      struct rchan_buf *buf,
+			      void *subbuf)
+{
+	struct prov_wire_marker *marker;
+	struct prov_compact_subbuf *hdr;
+	size_t offset = 0;
+
+	if (state->mark || state->format != state->want ||
+	    state->want != PROV_WIRE_FIXED) {
+		state->mark = false;
+		state->format = state->want;
+		marker = subbuf;
+		marker->magic = PROV_WIRE_MARKER_MAGIC;
+		marker->format = state->format;
+		offset += sizeof(struct prov_wire_marker);
+	}
+	if (state->format == PROV_WIRE_COMPACT) {
+		memset(&state->stream, 0, sizeof(struct prov_compact_stream));
+		state->stream.machine_id = prov_machine_id;
+		state->stream.boot_id = prov_boot_id;
+		hdr = subbuf + offset;
+		hdr->magic = PROV_COMPACT_MAGIC;
+		hdr->machine_id = prov_machine_id;
+		hdr->boot_id = prov_boot_id;
+		hdr->cpu = buf->cpu;
+		offset += sizeof(struct prov_compact_subbuf);
+	}
+	if (offset)
+		subbuf_start_reserve(buf, offset);
+}
+
 /*
  * subbuf_start - called on buffer-switch to a new sub-buffer
  * @buf: the channel buffer containing the new sub-buffer
@@ -95,7 +257,7 @@ static int remove_buf_file_handler(struct dentry *dentry)
  * @prev_subbuf: the start of the previous sub-buffer
  * @prev_padding: unused space at the end of previous sub-buffer
  *
- * return 1 do not log
+ * return 1 log
  * return 0 do not log
  */
 static int subbuf_start_handler(struct rchan_buf *buf,
@@ -103,152 +265,1212 @@ static int subbuf_start_handler(struct rchan_buf *buf,
 				void *prev_subbuf,
 				size_t prev_padding)
 {
-	// the relay is full let's not log
-	// this avoid overwritting
+	struct prov_channel *pc = buf->chan->private_data;
+	struct prov_subbuf_state *state = per_cpu_ptr(pc->subbuf, buf->cpu);
+
+	if (pc->lz4 && prev_subbuf)
+		prov_lz4_queue(pc, buf);
+	// the relay is full let's not log unless we act as a flight recorder
+	// dropped elements are accounted for by the writers
+	// sub-buffers awaiting compression must not be overwritten
 	if (relay_buf_full(buf)) {
-		// count the number of element dropped
-		atomic64_inc(&prov_drop);
-		return 0;
+		if (pc->lz4 || READ_ONCE(pc->policy) != PROV_RELAY_OVERWRITE)
+			return 0;
+		// the oldest sub-buffer may hold versions deltas are based on
+		prov_delta_invalidate_all();
 	}
+	// the relay is being set up or re-opened, the state belongs to the
+	// relay writers currently use
+	if (buf->chan != rcu_access_pointer(pc->chan))
+		return 1;
+	prov_subbuf_begin(state, buf, subbuf);
 	return 1;
 }
 
+/*!
+ * @brief Claim space in the buffer of the current CPU, or in the ring of the
+ * current NUMA node, of a channel.
+ *
+ * Must be called with interrupts disabled.
+ * Records of different wire formats are never mixed in a sub-buffer; a new
+ * sub-buffer is started when switching between them. NUMA ring records are
+ * tagged with their format when committed.
+ * @param pc The channel.
+ * @param length Size of the element.
+ * @param format The wire format of the element.
+ * @return Where the element should be written or NULL if there is no space.
+ *
+ */
+static __always_inline void *prov_channel_claim(struct prov_channel *pc,
+						size_t length,
+						uint8_t format)
+{
+	struct prov_subbuf_state *state;
+	struct rchan_buf *buf;
+	struct rchan *chan;
+	void *dst;
 
-/* Relay interface callback functions */
-static struct rchan_callbacks relay_callbacks = {
-	.subbuf_start = subbuf_start_handler,
-	.create_buf_file = create_buf_file_handler,
-	.remove_buf_file = remove_buf_file_handler,
+	if (pc->numa)
+		return prov_numa_reserve(pc->numa, length);
+	chan = rcu_dereference_sched(pc->chan);
+	// the channel is being re-opened
+	if (unlikely(!chan))
+		return NULL;
+	buf = *this_cpu_ptr(chan->buf);
+	state = this_cpu_ptr(pc->subbuf);
+	if (unlikely(buf->offset + length > buf->chan->subbuf_size ||
+		     state->format != format)) {
+		state->want = format;
+		if (!relay_switch_subbuf(buf, length))
+			return NULL;
+	}
+	dst = buf->data + buf->offset;
+	buf->offset += length;
+	return dst;
+}
+
+struct prov_spill_entry {
+	struct list_head list;
+	size_t length;
+	uint8_t format;
+	uint8_t data[];
 };
 
-static void __async_handle_boot_buffer(void *_buf, async_cookie_t cookie)
+/*!
+ * @brief Allocate an element from the overflow pool of a channel.
+ *
+ * The pool is bounded by the spill_max value of the channel.
+ * @param pc The channel.
+ * @param length Size of the element.
+ * @param format The wire format of the element.
+ * @return Where the element should be written or NULL if the pool is
+ * exhausted.
+ *
+ */
+static void *prov_spill_alloc(struct prov_channel *pc,
+			      size_t length,
+			      uint8_t format)
+{
+	struct prov_spill_entry *entry;
+
+	if (atomic64_add_return(length, &pc->spill_size) >
+	    READ_ONCE(pc->spill_max))
+		goto fail;
+	entry = kmalloc(struct_size(entry, data, length),
+			GFP_ATOMIC | __GFP_NOWARN);
+	if (!entry)
+		goto fail;
+	entry->length = length;
+	entry->format = format;
+	return entry->data;
+fail:
+	atomic64_sub(length, &pc->spill_size);
+	return NULL;
+}
+
+static __always_inline struct prov_spill_entry *prov_spill_entry(void *data)
+{
+	return (struct prov_spill_entry *)((uint8_t *)data -
+					   offsetof(struct prov_spill_entry,
+						    data));
+}
+
+static void prov_spill_queue(struct prov_channel *pc, void *data)
 {
-	struct list_head *ele, *next;
-	struct boot_buffer *entry;
+	struct prov_spill_entry *entry = prov_spill_entry(data);
+	struct prov_spill *spill = this_cpu_ptr(pc->spill);
+
+	spin_lock(&spill->lock);
+	list_add_tail(&entry->list, &spill->list);
+	WRITE_ONCE(spill->count, spill->count + 1);
+	spin_unlock(&spill->lock);
+	schedule_delayed_work_on(spill->cpu, &spill->work, PROV_SPILL_DELAY);
+}
+
+/*!
+ * @brief Move elements from the overflow pool of a CPU back to the relay.
+ *
+ * Must be called with interrupts disabled, on the CPU of the pool.
+ * Elements are written in the order they were spilled, to the relay buffer of
+ * the CPU; if the CPU went offline, its pool is written to the buffer of the
+ * CPU the work was moved to.
+ * @param pc The channel.
+ * @param spill The pool.
+ * @param budget The maximum number of elements to write.
+ * @return true if the pool is empty.
+ *
+ */
+static bool prov_spill_flush(struct prov_channel *pc,
+			     struct prov_spill *spill,
+			     unsigned int budget)
+{
+	struct prov_spill_entry *entry;
+	bool empty;
+	void *dst;
+
+	spin_lock(&spill->lock);
+	while (budget-- && !list_empty(&spill->list)) {
+		entry = list_first_entry(&spill->list, struct prov_spill_entry,
+					 list);
+		dst = prov_channel_claim(pc, entry->length, entry->format);
+		if (!dst)
+			break;
+		memcpy(dst, entry->data, entry->length);
+		if (pc->numa)
+			prov_numa_commit(dst, entry->format);
+		list_del(&entry->list);
+		WRITE_ONCE(spill->count, spill->count - 1);
+		atomic64_sub(entry->length, &pc->spill_size);
+		kfree(entry);
+	}
+	empty = list_empty(&spill->list);
+	spin_unlock(&spill->lock);
+	return empty;
+}
+
+/*!
+ * @brief Write back the overflow pool of a CPU, in batches.
+ *
+ * If the relay fills up again, the work is rescheduled.
+ *
+ */
+static void prov_spill_drain(struct work_struct *work)
+{
+	struct prov_spill *spill = container_of(to_delayed_work(work),
+						struct prov_spill,
+						work);
 	unsigned long irqflags;
+	unsigned int count;
+	bool empty;
 
-	msleep(1000);
-	pr_info("Provenance: async boot buffer task %llu running...", cookie);
+	do {
+		count = READ_ONCE(spill->count);
+		local_irq_save(irqflags);
+		empty = prov_spill_flush(spill->pc, spill, PROV_SPILL_BATCH);
+		local_irq_restore(irqflags);
+		cond_resched();
+	} while (!empty && READ_ONCE(spill->count) < count);
+
+	if (!empty)
+		schedule_delayed_work_on(spill->cpu, &spill->work,
+					 PROV_SPILL_DELAY);
+}
 
-	spin_lock_irqsave(&lock_buffer, irqflags);
-	list_for_each_safe(ele, next, &buffer_list) {
-		entry = list_entry(ele, struct boot_buffer, list);
+static int prov_spill_init(struct prov_channel *pc)
+{
+	struct prov_spill *spill;
+	int cpu;
+
+	pc->spill = alloc_percpu(struct prov_spill);
+	if (!pc->spill)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		spill = per_cpu_ptr(pc->spill, cpu);
+		spin_lock_init(&spill->lock);
+		INIT_LIST_HEAD(&spill->list);
+		INIT_DELAYED_WORK(&spill->work, prov_spill_drain);
+		spill->pc = pc;
+		spill->cpu = cpu;
+	}
+	return 0;
+}
 
-		// check if relay is full
-		if (is_relay_full(prov_chan)) {
-			cookie = async_schedule(__async_handle_boot_buffer,
-						NULL);
-			pr_info("Provenance: schedlued async task %llu.",
-				cookie);
+/*!
+ * @brief Claim space for an element in the current CPU sub-buffer of a
+ * channel.
+ *
+ * Must be called with interrupts disabled.
+ * When the relay is full the element is either dropped or, if the channel
+ * policy is PROV_RELAY_SPILL, allocated from the channel overflow pool.
+ * Elements of a CPU are never written ahead of the elements the CPU spilled
+ * before them: those are written back first, and if they do not all fit the
+ * element is handled as if the relay was full.
+ * The element is accounted for in the per-CPU statistics of the channel,
+ * emitted or dropped; every wire format and every writer (copy, in-place
+ * build, fan-out) reserves through this function so that drops are counted
+ * the same way whatever the format.
+ * @param pc The channel.
+ * @param type The type of the element.
+ * @param length Size of the element.
+ * @param format The wire format of the element.
+ * @param spilled Set to true if the element was allocated from the overflow
+ * pool.
+ * @return Where the element should be written or NULL if it is dropped.
+ *
+ */
+static void *prov_channel_reserve(struct prov_channel *pc,
+				  uint64_t type,
+				  size_t length,
+				  uint8_t format,
+				  bool *spilled)
+{
+	struct prov_type_stats *stats;
+	struct prov_spill *spill;
+	void *dst;
+
+	stats = &this_cpu_ptr(pc->stats)->types[prov_stats_index(type)];
+	stats->type = type;
+	*spilled = false;
+	spill = this_cpu_ptr(pc->spill);
+	if (unlikely(READ_ONCE(spill->count)) &&
+	    !prov_spill_flush(pc, spill, PROV_SPILL_BATCH))
+		goto full;
+	dst = prov_channel_claim(pc, length, format);
+	if (likely(dst))
+		goto out;
+full:
+	// the element will not be seen in order, if at all
+	prov_delta_invalidate();
+	if (READ_ONCE(pc->policy) == PROV_RELAY_SPILL) {
+		dst = prov_spill_alloc(pc, length, format);
+		if (dst) {
+			*spilled = true;
 			goto out;
 		}
+	}
+	// count the number of element dropped
+	stats->dropped++;
+	return NULL;
+out:
+	stats->emitted++;
+	stats->bytes += length;
+	return dst;
+}
+
+/*!
+ * @brief The relay buffer of the current CPU, while writing to a channel.
+ */
+static __always_inline struct rchan_buf *
+prov_channel_buf(struct prov_channel *pc)
+{
+	return *this_cpu_ptr(rcu_dereference_sched(pc->chan)->buf);
+}
+
+/*!
+ * @brief Give back the unused end of an element reserved with
+ * "prov_channel_reserve".
+ *
+ * Must be called with interrupts disabled, right after the element has been
+ * written and before anything else is reserved on the channel.
+ * Not supported for NUMA rings, whose elements must be reserved with their
+ * exact size.
+ * @param pc The channel.
+ * @param type The type of the element.
+ * @param dst Where the element was written.
+ * @param excess Number of bytes to give back.
+ * @param spilled Whether the element was allocated from the overflow pool.
+ *
+ */
+static void prov_channel_trim(struct prov_channel *pc,
+			      uint64_t type,
+			      void *dst,
+			      size_t excess,
+			      bool spilled)
+{
+	struct prov_spill_entry *entry;
+
+	this_cpu_ptr(pc->stats)->types[prov_stats_index(type)].bytes -= excess;
+	if (spilled) {
+		entry = prov_spill_entry(dst);
+		entry->length -= excess;
+		atomic64_sub(excess, &pc->spill_size);
+	} else
+		prov_channel_buf(pc)->offset -= excess;
+}
+
+static uint64_t prov_channel_dropped(struct prov_channel *pc)
+{
+	uint64_t dropped = 0;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < PROV_STATS_SLOTS; i++)
+			dropped += per_cpu_ptr(pc->stats, cpu)->types[i].dropped;
+	return dropped;
+}
+
+/*!
+ * @brief Number of elements dropped on all channels and all CPUs.
+ */
+uint64_t prov_dropped(void)
+{
+	struct prov_channel *pc;
+	uint64_t dropped = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(pc, &prov_channels, list)
+		dropped += prov_channel_dropped(pc);
+	rcu_read_unlock();
+	return dropped;
+}
+
+static __always_inline void prov_channel_commit(struct prov_channel *pc,
+						void *dst,
+						uint8_t format,
+						bool spilled)
+{
+	if (unlikely(spilled))
+		prov_spill_queue(pc, dst);
+	else if (pc->numa)
+		prov_numa_commit(dst, format);
+}
+
+static bool prov_channel_full(struct prov_channel *pc)
+{
+	struct rchan_buf *buf;
+	struct rchan *chan;
+	bool full = false;
+	int cpu;
+
+	if (pc->numa)
+		return prov_numa_full(pc->numa);
+	cpu = get_cpu();
+	chan = rcu_dereference_sched(pc->chan);
+	buf = chan ? *per_cpu_ptr(chan->buf, cpu) : NULL;
+	if (buf)
+		full = relay_buf_full(buf);
+	put_cpu();
+	return full;
+}
 
-		// tighten provenance entry
-		tighten_identifier(&get_prov_identifier(&(entry->msg)));
-		if (prov_is_relation(&(entry->msg))) {
-			tighten_identifier(&(entry->msg.relation_info.snd));
-			tighten_identifier(&(entry->msg.relation_info.rcv));
+/*!
+ * @brief Wait for the relay to be drained when a channel uses the
+ * PROV_RELAY_BLOCK policy.
+ *
+ * This must only be called from hooks that may sleep, before any lock is
+ * taken.
+ * The wait is bounded by the block_ms value of the channel, after which the
+ * element is dropped as with PROV_RELAY_DROP.
+ *
+ */
+void prov_relay_throttle(void)
+{
+	struct prov_channel *pc;
+	unsigned long deadline;
+
+	if (unlikely(!relay_ready))
+		return;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(pc, &prov_channels, list) {
+		if (READ_ONCE(pc->policy) != PROV_RELAY_BLOCK)
+			continue;
+		// channels are never removed, pc remains valid while sleeping
+		rcu_read_unlock();
+		deadline = jiffies + msecs_to_jiffies(READ_ONCE(pc->block_ms));
+		while (prov_channel_full(pc) && time_before(jiffies, deadline))
+			if (msleep_interruptible(PROV_BLOCK_STEP_MS))
+				break;
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+}
+
+/*!
+ * @brief Find a channel by name.
+ *
+ * Channels are never removed, the channel returned remains valid.
+ * @param name The name of the channel.
+ * @return The channel or NULL if there is no channel of that name.
+ *
+ */
+struct prov_channel *prov_channel_find(const char *name)
+{
+	struct prov_channel *pc, *found = NULL;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(pc, &prov_channels, list) {
+		if (!strncmp(pc->name, name, PROV_CHANNEL_NAME_LEN)) {
+			found = pc;
+			break;
 		}
+	}
+	rcu_read_unlock();
+	return found;
+}
 
-		relay_write(prov_chan, &(entry->msg), sizeof(union prov_elt));
 
-		list_del(&(entry->list));
-		kmem_cache_free(boot_buffer_cache, entry);
+/*!
+ * @brief Size of the structure actually used by a regular provenance element
+ * of a given type.
+ */
+static size_t prov_elt_size(uint64_t type)
+{
+	if (prov_type_is_aggregate(type))
+		return sizeof(struct aggregate_struct);
+	if (prov_type_is_relation(type))
+		return sizeof(struct relation_struct);
+	if (prov_is_inode(type))
+		return sizeof(struct inode_prov_struct);
+	switch (type) {
+	case ACT_TASK:
+		return sizeof(struct task_prov_struct);
+	case ENT_PROC:
+		return sizeof(struct proc_prov_struct);
+	case ENT_MSG:
+		return sizeof(struct msg_msg_struct);
+	case ENT_SHM:
+		return sizeof(struct shm_struct);
+	case ENT_SBLCK:
+		return sizeof(struct sb_struct);
+	case ENT_PACKET:
+		return sizeof(struct pck_struct);
+	case ENT_IATTR:
+		return sizeof(struct iattr_prov_struct);
+	case ENT_SUPPRESSED:
+		return sizeof(struct suppressed_struct);
+	default:
+		return sizeof(union prov_elt);
 	}
-	pr_info("Provenance: finished task %llu.", cookie);
-out:
-	spin_unlock_irqrestore(&lock_buffer, irqflags);
 }
 
-static void __async_handle_long_boot_buffer(void *_buf, async_cookie_t cookie)
+#define wire_fixed(hdr, size)			   \
+	do {					   \
+		(hdr)->var_offset = (size);	   \
+		(hdr)->var_length = 0;		   \
+		(hdr)->tail_offset = (size);	   \
+		(hdr)->tail_length = 0;		   \
+	} while (0)
+
+#define wire_var(hdr, st, field, len, tail)					  \
+	do {									  \
+		(hdr)->var_offset = offsetof(struct st, field);			  \
+		(hdr)->var_length = min_t(size_t, (len),			  \
+					  sizeof_field(struct st, field));	  \
+		(hdr)->tail_offset = offsetof(struct st, tail);			  \
+		(hdr)->tail_length = sizeof(struct st) - offsetof(struct st, tail); \
+	} while (0)
+
+/*!
+ * @brief Describe which bytes of a provenance element need to be transmitted
+ * when the PROV_WIRE_VARLEN format is in use.
+ *
+ * Only the used part of the variable-length field of long elements (i.e.,
+ * path, argument, packet content, etc.) is transmitted.
+ * Regular elements are truncated to the size of the structure matching their
+ * type.
+ * @param msg The provenance element to be encoded.
+ * @param hdr The wire header to fill.
+ *
+ */
+static void prov_wire_layout(const prov_entry_t *msg,
+			     struct prov_wire_header *hdr)
 {
-	struct list_head *ele, *next;
-	struct long_boot_buffer *entry;
-	unsigned long irqflags;
+	switch (prov_type(msg)) {
+	case ENT_STR:
+		wire_var(hdr, str_struct, str, msg->str_info.length, length);
+		break;
+	case ENT_PATH:
+		wire_var(hdr, file_name_struct, name,
+			 msg->file_name_info.length, length);
+		break;
+	case ENT_ARG:
+	case ENT_ENV:
+		wire_var(hdr, arg_struct, value, msg->arg_info.length, length);
+		break;
+	case ENT_PCKCNT:
+		wire_var(hdr, pckcnt_struct, content,
+			 msg->pckcnt_info.length, length);
+		break;
+	case ENT_DISC:
+	case ACT_DISC:
+	case AGT_DISC:
+		wire_var(hdr, disc_node_struct, content,
+			 msg->disc_node_info.length, parent);
+		break;
+	case ENT_XATTR:
+		wire_var(hdr, xattr_prov_struct, value,
+			 msg->xattr_info.size, size);
+		break;
+	case ENT_ADDR:
+		hdr->var_offset = offsetof(struct address_struct, addr);
+		hdr->var_length = min_t(size_t, msg->address_info.length,
+					sizeof(struct sockaddr_storage));
+		hdr->tail_offset = sizeof(struct address_struct);
+		hdr->tail_length = 0;
+		break;
+	case AGT_MACHINE:
+		wire_fixed(hdr, sizeof(struct machine_struct));
+		break;
+	default:
+		if (prov_type_is_delta(prov_type(msg)))
+			wire_fixed(hdr, offsetof(struct node_delta_struct, words) +
+				   hweight32(msg->delta_info.mask) *
+				   sizeof(uint64_t));
+		else if (prov_type_is_long(prov_type(msg)))
+			wire_fixed(hdr, sizeof(union long_prov_elt));
+		else
+			wire_fixed(hdr, prov_elt_size(prov_type(msg)));
+	}
+	hdr->version = PROV_WIRE_VERSION;
+	hdr->reserved = 0;
+	hdr->size = ALIGN(sizeof(struct prov_wire_header) + hdr->var_offset +
+			  hdr->var_length + hdr->tail_length, PROV_WIRE_ALIGN);
+}
 
-	msleep(1000);
-	pr_info("Provenance: async long boot buffer task %llu running...",
-		cookie);
+static void prov_wire_encode(uint8_t *dst,
+			     const prov_entry_t *msg,
+			     const struct prov_wire_header *hdr)
+{
+	const uint8_t *src = (const uint8_t *)msg;
+	uint8_t *end = dst + hdr->size;
 
-	spin_lock_irqsave(&lock_long_buffer, irqflags);
-	list_for_each_safe(ele, next, &long_buffer_list) {
-		entry = list_entry(ele, struct long_boot_buffer, list);
+	memcpy(dst, hdr, sizeof(struct prov_wire_header));
+	dst += sizeof(struct prov_wire_header);
+	memcpy(dst, src, hdr->var_offset);
+	dst += hdr->var_offset;
+	memcpy(dst, src + hdr->var_offset, hdr->var_length);
+	dst += hdr->var_length;
+	memcpy(dst, src + hdr->tail_offset, hdr->tail_length);
+	dst += hdr->tail_length;
+	memset(dst, 0, end - dst);
+}
 
-		// check if relay is full
-		if (is_relay_full(prov_chan)) {
-			cookie = async_schedule(__async_handle_long_boot_buffer,
-						NULL);
-			pr_info("Provenance: schedlued long async task %llu.",
-				cookie);
-			goto out;
+/* p is NULL when the encoded size is only measured */
+struct prov_compact_writer {
+	uint8_t *p;
+	size_t length;
+};
+
+static __always_inline void compact_raw(struct prov_compact_writer *w,
+					const void *src,
+					size_t len)
+{
+	if (w->p) {
+		memcpy(w->p, src, len);
+		w->p += len;
+	}
+	w->length += len;
+}
+
+static __always_inline void compact_varint(struct prov_compact_writer *w,
+					   uint64_t v)
+{
+	uint8_t byte;
+
+	do {
+		byte = v & 0x7f;
+		v >>= 7;
+		if (v)
+			byte |= 0x80;
+		compact_raw(w, &byte, 1);
+	} while (v);
+}
+
+static __always_inline void compact_zigzag(struct prov_compact_writer *w,
+					   int64_t v)
+{
+	compact_varint(w, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+/*!
+ * @brief Encode an identifier in PROV_WIRE_COMPACT format.
+ *
+ * Packet identifiers do not follow the node identifier layout and are copied
+ * whole.
+ * Identifiers issued by another boot or machine than the one of the stream
+ * carry their own boot_id and machine_id.
+ * @param w The writer.
+ * @param id The identifier.
+ * @param s The stream state.
+ * @param prev The previous id of the same kind, updated.
+ *
+ */
+static void compact_id(struct prov_compact_writer *w,
+		       const union prov_identifier *id,
+		       const struct prov_compact_stream *s,
+		       uint64_t *prev)
+{
+	uint8_t tag = 0;
+
+	if (id->node_id.type == ENT_PACKET) {
+		tag = PROV_COMPACT_ID_RAW;
+		compact_raw(w, &tag, 1);
+		compact_raw(w, id, sizeof(union prov_identifier));
+		return;
+	}
+	if (id->node_id.boot_id != s->boot_id ||
+	    id->node_id.machine_id != s->machine_id)
+		tag = PROV_COMPACT_ID_FOREIGN;
+	compact_raw(w, &tag, 1);
+	compact_raw(w, &id->node_id.type, sizeof(uint64_t));
+	compact_zigzag(w, (int64_t)(id->node_id.id - *prev));
+	*prev = id->node_id.id;
+	compact_varint(w, id->node_id.version);
+	if (tag & PROV_COMPACT_ID_FOREIGN) {
+		compact_varint(w, id->node_id.boot_id);
+		compact_varint(w, id->node_id.machine_id);
+	}
+}
+
+/*!
+ * @brief Encode a provenance element in PROV_WIRE_COMPACT format.
+ *
+ * The layout of node elements is the one computed for the PROV_WIRE_VARLEN
+ * format.
+ * @param dst Where to write the record or NULL to only measure its size.
+ * @param msg The provenance element.
+ * @param hdr Its wire header.
+ * @param stream The state of the sub-buffer the record is written to, or
+ * NULL for a self-contained (i.e., PROV_COMPACT_ABSOLUTE) record.
+ * @param ts The monotonic time of the element.
+ * @param seq The sequence number of the element.
+ * @return The size of the record.
+ *
+ */
+static size_t prov_compact_encode(uint8_t *dst,
+				  const prov_entry_t *msg,
+				  const struct prov_wire_header *hdr,
+				  struct prov_compact_stream *stream,
+				  uint64_t ts,
+				  uint64_t seq)
+{
+	struct prov_compact_writer w = {
+		.p = dst ? dst + sizeof(struct prov_compact_header) : NULL,
+		.length = sizeof(struct prov_compact_header),
+	};
+	const uint8_t *src = (const uint8_t *)msg;
+	size_t start = sizeof(struct msg_struct);
+	struct prov_compact_stream zero, *s = stream;
+	struct prov_compact_header h;
+	bool relation = prov_type_is_relation(prov_type(msg));
+
+	if (!s) {
+		memset(&zero, 0, sizeof(struct prov_compact_stream));
+		s = &zero;
+	}
+	compact_id(&w, &msg->msg_info.identifier, s,
+		   relation ? &s->relation_id : &s->node_id);
+	compact_varint(&w, msg->msg_info.epoch);
+	compact_varint(&w, msg->msg_info.nepoch);
+	compact_varint(&w, msg->msg_info.internal_flag);
+	compact_varint(&w, msg->msg_info.jiffies);
+	compact_varint(&w, msg->msg_info.taint);
+	compact_zigzag(&w, (int64_t)(ts - s->ts));
+	s->ts = ts;
+	compact_zigzag(&w, (int64_t)(seq - s->seq));
+	s->seq = seq;
+	if (relation) {
+		compact_id(&w, &msg->relation_info.snd, s, &s->node_id);
+		compact_id(&w, &msg->relation_info.rcv, s, &s->node_id);
+		compact_raw(&w, &msg->relation_info.allowed, 1);
+		compact_raw(&w, &msg->relation_info.set, 1);
+		compact_zigzag(&w, msg->relation_info.offset);
+		compact_varint(&w, msg->relation_info.flags);
+		compact_varint(&w, msg->relation_info.task_id);
+		if (prov_type_is_aggregate(prov_type(msg))) {
+			compact_varint(&w, msg->aggregate_info.count);
+			compact_varint(&w, msg->aggregate_info.bytes);
+			compact_varint(&w, msg->aggregate_info.first);
+			compact_varint(&w, msg->aggregate_info.last);
 		}
+	} else {
+		compact_varint(&w, hdr->var_offset);
+		compact_varint(&w, hdr->var_length);
+		compact_varint(&w, hdr->tail_offset);
+		compact_varint(&w, hdr->tail_length);
+		compact_raw(&w, src + start, hdr->var_offset - start);
+		compact_raw(&w, src + hdr->var_offset, hdr->var_length);
+		compact_raw(&w, src + hdr->tail_offset, hdr->tail_length);
+	}
+	if (dst) {
+		h.size = w.length;
+		h.kind = relation ? PROV_COMPACT_RELATION : PROV_COMPACT_NODE;
+		h.flags = stream ? 0 : PROV_COMPACT_ABSOLUTE;
+		memcpy(dst, &h, sizeof(struct prov_compact_header));
+	}
+	return w.length;
+}
+
+static DEFINE_PER_CPU(uint64_t, prov_seq);
+
+/*!
+ * @brief Get the ordering keys of an element as it is written.
+ *
+ * Must be called with interrupts disabled, between the reservation of the
+ * element and its publication, so that elements of a per-CPU buffer are
+ * stamped in the order they are written.
+ * @param ts Set to the monotonic time.
+ * @param seq Set to the next per-CPU sequence number.
+ *
+ */
+static __always_inline void prov_clock(uint64_t *ts, uint64_t *seq)
+{
+	*ts = ktime_get_mono_fast_ns();
+	*seq = __this_cpu_inc_return(prov_seq);
+}
+
+/*!
+ * @brief Stamp an element with its ordering keys as it is written.
+ * @param elt The element in the relay buffer.
+ *
+ */
+static __always_inline void prov_stamp(void *elt)
+{
+	prov_entry_t *msg = elt;
+
+	prov_clock(&prov_ts(msg), &prov_seq(msg));
+}
 
-		// tighten provenance entry
-		tighten_identifier(&get_prov_identifier(&(entry->msg)));
+/*!
+ * @brief Whether a fan-out channel accepts elements of a given type.
+ */
+static __always_inline bool prov_channel_accept(struct prov_channel *pc,
+						uint64_t type)
+{
+	struct prov_channel_filter *filter = &pc->filter;
 
-		relay_write(long_prov_chan, &(entry->msg),
-			    sizeof(union long_prov_elt));
+	if (prov_type_is_node(type))
+		return !HIT_FILTER(READ_ONCE(filter->node_filter), type);
+	if (prov_is_derived(type))
+		return !HIT_FILTER(READ_ONCE(filter->derived_filter), type);
+	if (prov_is_generated(type))
+		return !HIT_FILTER(READ_ONCE(filter->generated_filter), type);
+	if (prov_is_used(type))
+		return !HIT_FILTER(READ_ONCE(filter->used_filter), type);
+	if (prov_is_informed(type))
+		return !HIT_FILTER(READ_ONCE(filter->informed_filter), type);
+	return true;
+}
 
-		list_del(&(entry->list));
-		kmem_cache_free(long_boot_buffer_cache, entry);
+/*!
+ * @brief Write a provenance element to every fan-out channel accepting it.
+ *
+ * Must be called with interrupts disabled.
+ * If the element has not been serialised yet, it is serialised and stamped in
+ * the first channel with space for it and copied from there to the others, so
+ * that every copy carries the same ordering keys; that first copy is only
+ * published once all the others have been made.
+ * @param fanout The list of fan-out channels.
+ * @param msg The provenance element.
+ * @param hdr Its wire header, used if src is NULL in PROV_WIRE_VARLEN format.
+ * @param src The serialised and stamped element or NULL.
+ * @param length Its serialised size.
+ * @param format The wire format it is serialised in.
+ *
+ */
+static void prov_fanout_write(struct list_head *fanout,
+			      const prov_entry_t *msg,
+			      const struct prov_wire_header *hdr,
+			      const void *src,
+			      size_t length,
+			      uint8_t format)
+{
+	struct prov_channel *pc, *first = NULL;
+	bool spilled, first_spilled = false;
+	uint64_t type = prov_type(msg);
+	void *dst;
+
+	list_for_each_entry_rcu(pc, fanout, fanout) {
+		if (!prov_channel_accept(pc, type))
+			continue;
+		dst = prov_channel_reserve(pc, type, length, format, &spilled);
+		if (!dst)
+			continue;
+		if (src) {
+			memcpy(dst, src, length);
+			prov_channel_commit(pc, dst, format, spilled);
+			continue;
+		}
+		if (format == PROV_WIRE_FIXED) {
+			memcpy(dst, msg, length);
+			prov_stamp(dst);
+		} else {
+			prov_wire_encode(dst, msg, hdr);
+			prov_stamp(dst + sizeof(struct prov_wire_header));
+		}
+		src = dst;
+		first = pc;
+		first_spilled = spilled;
 	}
-	pr_info("Provenance: finished task %llu.", cookie);
-out:
-	spin_unlock_irqrestore(&lock_long_buffer, irqflags);
+	if (first)
+		prov_channel_commit(first, (void *)src, format, first_spilled);
 }
 
-bool relay_ready;
-bool relay_initialized;
 /*!
- * @brief Write whatever in boot buffer to relay buffer when relay buffer is
- * ready.
+ * @brief Write a provenance element to a channel in PROV_WIRE_COMPACT format.
  *
- * This function writes what's in boot_buffer to relay buffer for regular
- * provenance entries,
- * and what's in long_boot_buffer to relay buffer for long provenance entries.
- * It also frees memory after it is done writing.
- * Once done, set boolean value relay_ready to true to signal that relay buffer
- * is ready to be used.
+ * Must be called with interrupts disabled.
+ * Records are delta-encoded against the state of the current sub-buffer of
+ * the CPU; records of NUMA rings and of the overflow pool may be read in
+ * another order and are self-contained.
+ * Relay space is reserved for the worst case and trimmed once the record is
+ * encoded, NUMA ring space is reserved for the exact size of the record.
+ * @param pc The channel.
+ * @param msg The provenance element.
+ * @param hdr Its wire header.
+ * @param ts The monotonic time of the element.
+ * @param seq The sequence number of the element.
  *
  */
-void write_boot_buffer(void)
+static void prov_compact_write(struct prov_channel *pc,
+			       const prov_entry_t *msg,
+			       const struct prov_wire_header *hdr,
+			       uint64_t ts,
+			       uint64_t seq)
 {
-	async_cookie_t cookie;
+	struct prov_compact_stream *stream = NULL;
+	uint64_t type = prov_type(msg);
+	size_t length, size;
+	bool spilled;
+	void *dst;
 
-	if (prov_machine_id == 0 || prov_boot_id == 0 || !relay_initialized)
+	if (pc->numa)
+		length = prov_compact_encode(NULL, msg, hdr, NULL, ts, seq);
+	else
+		length = hdr->size + PROV_COMPACT_SLACK;
+	dst = prov_channel_reserve(pc, type, length, PROV_WIRE_COMPACT,
+				   &spilled);
+	if (!dst)
 		return;
+	if (!pc->numa && !spilled)
+		stream = &this_cpu_ptr(pc->subbuf)->stream;
+	size = prov_compact_encode(dst, msg, hdr, stream, ts, seq);
+	if (size < length)
+		prov_channel_trim(pc, type, dst, length - size, spilled);
+	prov_channel_commit(pc, dst, PROV_WIRE_COMPACT, spilled);
+}
 
-	relay_ready = true;
+/*!
+ * @brief Write a provenance element to a relay channel, and to the fan-out
+ * channels accepting it, using the currently selected wire format.
+ *
+ * The element is serialised once and copied to the fan-out channels, except
+ * in PROV_WIRE_COMPACT format where records depend on the state of each
+ * channel and are encoded for each of them.
+ * @param pc The main channel or NULL if the element should only be written to
+ * the fan-out channels.
+ * @param fanout The list of fan-out channels.
+ * @param msg The provenance element (regular or long).
+ * @param size The size of the element in PROV_WIRE_FIXED format.
+ *
+ */
+static void prov_relay_write(struct prov_channel *pc,
+			     struct list_head *fanout,
+			     const prov_entry_t *msg,
+			     size_t size)
+{
+	struct prov_wire_header hdr;
+	uint8_t format = READ_ONCE(prov_wire_format);
+	struct prov_channel *fc;
+	size_t length = size;
+	unsigned long flags;
+	uint64_t ts, seq;
+	bool spilled;
+	void *dst;
 
-	refresh_prov_machine();
-	relay_write(long_prov_chan, prov_machine, sizeof(union long_prov_elt));
+	if (unlikely(format != PROV_WIRE_FIXED)) {
+		prov_wire_layout(msg, &hdr);
+		length = hdr.size;
+	}
 
-	// asynchronously empty the buffer
-	if (!list_empty(&buffer_list)) {
-		cookie = async_schedule(__async_handle_boot_buffer, NULL);
-		pr_info("Provenance: schedlued async task %llu.",
-			cookie);
+	local_irq_save(flags);
+	if (unlikely(format == PROV_WIRE_COMPACT)) {
+		prov_clock(&ts, &seq);
+		if (pc)
+			prov_compact_write(pc, msg, &hdr, ts, seq);
+		list_for_each_entry_rcu(fc, fanout, fanout)
+			if (prov_channel_accept(fc, prov_type(msg)))
+				prov_compact_write(fc, msg, &hdr, ts, seq);
+		local_irq_restore(flags);
+		return;
 	}
+	dst = pc ? prov_channel_reserve(pc, prov_type(msg), length, format,
+					&spilled) : NULL;
+	if (dst) {
+		if (likely(format == PROV_WIRE_FIXED)) {
+			memcpy(dst, msg, length);
+			prov_stamp(dst);
+		} else {
+			prov_wire_encode(dst, msg, &hdr);
+			prov_stamp(dst + sizeof(struct prov_wire_header));
+		}
+		prov_fanout_write(fanout, msg, &hdr, dst, length, format);
+		prov_channel_commit(pc, dst, format, spilled);
+	} else
+		prov_fanout_write(fanout, msg, &hdr, NULL, length, format);
+	local_irq_restore(flags);
+}
+
+/*!
+ * @brief Reserve space for a regular provenance element directly in the
+ * current relay sub-buffer.
+ *
+ * This allows the element to be built in place, avoiding an intermediate copy.
+ * The returned element is zeroed.
+ * Interrupts are disabled until "prov_commit" is called, which must happen
+ * without sleeping and without anything else being written to the channel.
+ * The element is kept out of the sub-buffer seen by readers (and NUMA ring
+ * records are not committed) until then, so that readers never see a
+ * partially built element.
+ * @param slot The reservation to be passed to "prov_commit".
+ * @param type The type of the provenance element to be written.
+ * @return A pointer to the element to fill, or NULL if the relay is not ready,
+ * if the element cannot be built in place (i.e., in PROV_WIRE_COMPACT format)
+ * or if the relay is full (slot->dropped is then set).
+ *
+ */
+union prov_elt *prov_reserve(struct prov_relay_slot *slot, uint64_t type)
+{
+	struct prov_wire_header *hdr;
+	uint8_t format = READ_ONCE(prov_wire_format);
+	size_t size, length;
+	uint8_t *dst;
+
+	slot->elt = NULL;
+	slot->dropped = false;
+	if (unlikely(!relay_ready || format == PROV_WIRE_COMPACT))
+		return NULL;
+
+	if (likely(format == PROV_WIRE_FIXED)) {
+		size = sizeof(union prov_elt);
+		length = size;
+	} else {
+		size = prov_elt_size(type);
+		length = ALIGN(sizeof(struct prov_wire_header) + size,
+			       PROV_WIRE_ALIGN);
+	}
+
+	local_irq_save(slot->flags);
+	dst = prov_channel_reserve(&prov_chan, type, length, format,
+				   &slot->spilled);
+	if (unlikely(!dst)) {
+		local_irq_restore(slot->flags);
+		slot->dropped = true;
+		return NULL;
+	}
+	slot->dst = dst;
+	slot->length = length;
+	slot->format = format;
+	// published by prov_commit
+	slot->hidden = !prov_chan.numa && !slot->spilled;
+	if (slot->hidden)
+		prov_channel_buf(&prov_chan)->offset -= length;
+
+	if (length != size) {
+		hdr = (struct prov_wire_header *)dst;
+		dst += sizeof(struct prov_wire_header);
+		hdr->version = PROV_WIRE_VERSION;
+		hdr->size = length;
+		hdr->var_offset = size;
+		hdr->var_length = 0;
+		hdr->tail_offset = size;
+		hdr->tail_length = 0;
+		hdr->reserved = 0;
+		memset(dst, 0, length - sizeof(struct prov_wire_header));
+	} else
+		memset(dst, 0, size);
+	slot->elt = (union prov_elt *)dst;
+	prov_written = true;
+	return slot->elt;
+}
+
+/*!
+ * @brief Complete the writing of an element reserved with "prov_reserve".
+ *
+ * The element is copied to the fan-out channels accepting it before being
+ * published.
+ * @param slot The reservation.
+ *
+ */
+void prov_commit(struct prov_relay_slot *slot)
+{
+	struct rchan_buf *buf;
+
+	prov_jiffies(slot->elt) = get_jiffies_64();
+	prov_stamp(slot->elt);
+	prov_fanout_write(&prov_fanout, (prov_entry_t *)slot->elt, NULL,
+			  slot->dst, slot->length, slot->format);
+	if (slot->hidden) {
+		buf = prov_channel_buf(&prov_chan);
+		// the element must be complete before readers see it
+		smp_wmb();
+		WRITE_ONCE(buf->offset, buf->offset + slot->length);
+	} else
+		prov_channel_commit(&prov_chan, slot->dst, slot->format,
+				    slot->spilled);
+	local_irq_restore(slot->flags);
+}
+
+/* Relay interface callback functions */
+static struct rchan_callbacks relay_callbacks = {
+	.subbuf_start = subbuf_start_handler,
+	.create_buf_file = create_buf_file_handler,
+	.remove_buf_file = remove_buf_file_handler,
+};
 
-	// asynchronously empty the buffer
-	if (!list_empty(&long_buffer_list)) {
-		cookie = async_schedule(__async_handle_long_boot_buffer, NULL);
-		pr_info("Provenance: schedlued long async task %llu.", cookie);
+/*!
+ * @brief Per-CPU buffers holding provenance elements recorded before the relay
+ * is ready.
+ *
+ * Elements are appended in the order they are recorded and written to the
+ * relay in the same order by "write_boot_buffer".
+ * Once drained, a ring is closed and its memory released; writers finding a
+ * closed ring write directly to the relay.
+ * Elements that do not fit are counted in prov_boot_overflow.
+ */
+struct prov_boot_ring {
+	spinlock_t lock;
+	bool closed;
+	unsigned int count;
+	unsigned int size;
+	uint8_t *msgs;
+};
+
+static DEFINE_PER_CPU(struct prov_boot_ring, boot_ring);
+static DEFINE_PER_CPU(struct prov_boot_ring, long_boot_ring);
+static unsigned int boot_ring_size __initdata = PROV_BOOT_RING_SIZE;
+static unsigned int long_boot_ring_size __initdata = PROV_LONG_BOOT_RING_SIZE;
+atomic64_t prov_boot_overflow = ATOMIC64_INIT(0);
+
+static int __init set_boot_ring_size(char *str)
+{
+	return !kstrtouint(str, 0, &boot_ring_size);
+}
+__setup("provenance_boot_ring=", set_boot_ring_size);
+
+static int __init set_long_boot_ring_size(char *str)
+{
+	return !kstrtouint(str, 0, &long_boot_ring_size);
+}
+__setup("provenance_long_boot_ring=", set_long_boot_ring_size);
+
+static void __init init_boot_ring(struct prov_boot_ring __percpu *rings,
+				  unsigned int size,
+				  size_t elt_size)
+{
+	struct prov_boot_ring *ring;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(rings, cpu);
+		spin_lock_init(&ring->lock);
+		ring->closed = false;
+		ring->count = 0;
+		ring->msgs = kvmalloc_node(array_size(size, elt_size),
+					   GFP_KERNEL, cpu_to_node(cpu));
+		if (!ring->msgs)
+			pr_err("Provenance: could not allocate boot buffer for cpu %d.",
+			       cpu);
+		ring->size = ring->msgs ? size : 0;
 	}
 }
 
-static void insert_boot_buffer(union prov_elt *msg)
+/*!
+ * @brief Allocate the per-CPU boot buffers.
+ *
+ * The number of elements per CPU can be set with the "provenance_boot_ring="
+ * and "provenance_long_boot_ring=" boot parameters.
+ *
+ */
+void __init init_boot_buffer(void)
+{
+	pr_info("Provenance: boot buffer initialization started...");
+	init_boot_ring(&boot_ring, boot_ring_size, sizeof(union prov_elt));
+	init_boot_ring(&long_boot_ring, long_boot_ring_size,
+		       sizeof(union long_prov_elt));
+	pr_info("Provenance: boot buffer %u/%u elements per cpu.",
+		boot_ring_size, long_boot_ring_size);
+}
+
+/*!
+ * @brief Append an element to the boot buffer of the current CPU.
+ * @return false if the boot buffer has already been drained, in which case
+ * the element should be written to the relay.
+ *
+ */
+static bool boot_ring_insert(struct prov_boot_ring __percpu *rings,
+			     const void *msg,
+			     size_t elt_size)
 {
-	struct boot_buffer *tmp = kmem_cache_zalloc(boot_buffer_cache,
-						    GFP_ATOMIC);
+	struct prov_boot_ring *ring;
 	unsigned long irqflags;
+	bool inserted = true;
 
-	__memcpy_ss(&(tmp->msg), sizeof(union prov_elt),
-		    msg, sizeof(union prov_elt));
-	INIT_LIST_HEAD(&(tmp->list));
-	spin_lock_irqsave(&lock_buffer, irqflags);
-	list_add(&(tmp->list), &buffer_list);
-	spin_unlock_irqrestore(&lock_buffer, irqflags);
+	local_irq_save(irqflags);
+	ring = this_cpu_ptr(rings);
+	spin_lock(&ring->lock);
+	if (unlikely(ring->closed))
+		inserted = false;
+	else if (ring->count < ring->size)
+		memcpy(ring->msgs + elt_size * ring->count++, msg, elt_size);
+	else
+		atomic64_inc(&prov_boot_overflow);
+	spin_unlock(&ring->lock);
+	local_irq_restore(irqflags);
+	return inserted;
+}
+
+static void boot_ring_drain(struct prov_boot_ring __percpu *rings,
+			    struct prov_channel *pc,
+			    struct list_head *fanout,
+			    size_t elt_size)
+{
+	struct prov_boot_ring *ring;
+	prov_entry_t *msg;
+	unsigned long irqflags;
+	uint8_t *msgs;
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(rings, cpu);
+		spin_lock_irqsave(&ring->lock, irqflags);
+		for (i = 0; i < ring->count; i++) {
+			msg = (prov_entry_t *)(ring->msgs + elt_size * i);
+			// tighten provenance entry
+			tighten_identifier(&get_prov_identifier(msg));
+			if (prov_is_relation(msg)) {
+				tighten_identifier(&(msg->relation_info.snd));
+				tighten_identifier(&(msg->relation_info.rcv));
+			}
+			prov_relay_write(pc, fanout, msg, elt_size);
+		}
+		msgs = ring->msgs;
+		ring->msgs = NULL;
+		ring->count = 0;
+		ring->size = 0;
+		ring->closed = true;
+		spin_unlock_irqrestore(&ring->lock, irqflags);
+		kvfree(msgs);
+	}
+}
+
+bool relay_ready;
+bool relay_initialized;
+/*!
+ * @brief Write whatever in boot buffer to relay buffer when relay buffer is
+ * ready.
+ *
+ * The machine element is written first, followed by the content of the
+ * per-CPU boot buffers, in the order it was recorded.
+ * The boot buffers are then released.
+ * Once done, set boolean value relay_ready to true to signal that relay buffer
+ * is ready to be used.
+ * Later calls (e.g., when the machine or boot id is set again) only refresh
+ * and write the machine element.
+ *
+ */
+void write_boot_buffer(void)
+{
+	if (prov_machine_id == 0 || prov_boot_id == 0 || !relay_initialized)
+		return;
+
+	refresh_prov_machine();
+	prov_relay_write(&long_prov_chan, &long_prov_fanout, prov_machine,
+			 sizeof(union long_prov_elt));
+	// the boot buffers have already been drained
+	if (relay_ready)
+		return;
+
+	boot_ring_drain(&boot_ring, &prov_chan, &prov_fanout,
+			sizeof(union prov_elt));
+	boot_ring_drain(&long_boot_ring, &long_prov_chan, &long_prov_fanout,
+			sizeof(union long_prov_elt));
+	if (atomic64_read(&prov_boot_overflow))
+		pr_warn("Provenance: %lld elements did not fit in boot buffer.",
+			atomic64_read(&prov_boot_overflow));
+	relay_ready = true;
 }
 
 /*!
@@ -256,11 +1478,9 @@ static void insert_boot_buffer(union prov_elt *msg)
  * relay buffer is not ready yet during boot.
  *
  * If in an unlikely event that relay is not ready, provenance information
- * should be written to the boot buffer.
- * However, in an unlikely event that the boot buffer is full, an error is
- * thrown.
- * Otherwise (i.e., boot buffer is not full) provenance information is written
- * to the next empty slot in the boot buffer.
+ * should be written to the boot buffer of the current CPU.
+ * If the boot buffer is full, the element is dropped and counted in
+ * prov_boot_overflow.
  * If relay buffer is ready, write to relay buffer.
  * This is because once provenance is read from a relay buffer, it will be
  * consumed from the buffer.
@@ -276,26 +1496,23 @@ void prov_write(union prov_elt *msg, size_t size)
 	BUG_ON(prov_type_is_long(prov_type(msg)));
 
 	prov_jiffies(msg) = get_jiffies_64();
-	if (unlikely(!relay_ready))
-		insert_boot_buffer(msg);
-	else {
-		prov_written = true;
-		relay_write(prov_chan, msg, size);
-	}
+	if (unlikely(!relay_ready) &&
+	    boot_ring_insert(&boot_ring, msg, sizeof(union prov_elt)))
+		return;
+	prov_written = true;
+	prov_relay_write(&prov_chan, &prov_fanout, (prov_entry_t *)msg, size);
 }
 
-static void insert_long_boot_buffer(union long_prov_elt *msg)
+/*!
+ * @brief Write a regular provenance element that could not be written to the
+ * main relay channel to the fan-out channels only.
+ */
+void prov_write_fanout(union prov_elt *msg, size_t size)
 {
-	struct long_boot_buffer *tmp = kmem_cache_zalloc(long_boot_buffer_cache,
-							 GFP_ATOMIC);
-	unsigned long irqflags;
-
-	__memcpy_ss(&(tmp->msg), sizeof(union long_prov_elt),
-		    msg, sizeof(union long_prov_elt));
-	INIT_LIST_HEAD(&(tmp->list));
-	spin_lock_irqsave(&lock_long_buffer, irqflags);
-	list_add(&(tmp->list), &long_buffer_list);
-	spin_unlock_irqrestore(&lock_long_buffer, irqflags);
+	if (list_empty(&prov_fanout))
+		return;
+	prov_jiffies(msg) = get_jiffies_64();
+	prov_relay_write(NULL, &prov_fanout, (prov_entry_t *)msg, size);
 }
 
 /*!
@@ -314,12 +1531,474 @@ void long_prov_write(union long_prov_elt *msg, size_t size)
 	BUG_ON(!prov_type_is_long(prov_type(msg)));
 
 	prov_jiffies(msg) = get_jiffies_64();
-	if (unlikely(!relay_ready))
-		insert_long_boot_buffer(msg);
-	else {
-		prov_written = true;
-		relay_write(long_prov_chan, msg, size);
+	if (unlikely(!relay_ready) &&
+	    boot_ring_insert(&long_boot_ring, msg, sizeof(union long_prov_elt)))
+		return;
+	prov_written = true;
+	prov_relay_write(&long_prov_chan, &long_prov_fanout, msg, size);
+}
+
+/*!
+ * @brief Copy the unread content of a relay buffer into another.
+ *
+ * Each unread sub-buffer is copied to a sub-buffer of its own so that
+ * elements are never split.
+ * The unread end of a partially read sub-buffer is copied after a marker of
+ * the format of the sub-buffer, except in PROV_WIRE_COMPACT format where
+ * records cannot be decoded without the ones before them; it is then lost.
+ * Sub-buffers larger than the destination sub-buffer size are lost.
+ * Neither buffer may be written to concurrently.
+ * @return false if unread content was lost.
+ *
+ */
+static bool prov_relay_carry(struct rchan_buf *from, struct rchan_buf *to)
+{
+	size_t n = from->chan->n_subbufs;
+	size_t size = from->chan->subbuf_size;
+	size_t produced = from->subbufs_produced;
+	size_t consumed = from->subbufs_consumed;
+	size_t skip = from->bytes_consumed;
+	bool active = from->offset <= size;
+	struct prov_wire_marker marker;
+	bool lost = false;
+	size_t i, len, mark;
+	uint8_t *subbuf;
+
+	// in overwrite mode the oldest sub-buffers have been reused
+	if (produced - consumed > (active ? n - 1 : n)) {
+		consumed = produced - (active ? n - 1 : n);
+		skip = 0;
+	}
+	for (i = consumed; i < produced || (i == produced && active); i++) {
+		if (i == produced)
+			len = from->offset;
+		else
+			len = size - from->padding[i % n];
+		subbuf = from->start + (i % n) * size;
+		// the format of the unread end of the sub-buffer is given by
+		// the marker at its start, if any
+		mark = 0;
+		if (skip && len > skip) {
+			memcpy(&marker, subbuf, sizeof(struct prov_wire_marker));
+			if (marker.magic == PROV_WIRE_MARKER_MAGIC &&
+			    marker.format == PROV_WIRE_COMPACT) {
+				lost = true;
+				skip = len;
+			} else if (marker.magic == PROV_WIRE_MARKER_MAGIC) {
+				mark = sizeof(struct prov_wire_marker);
+				skip = max(skip, mark);
+			}
+		}
+		if (len > skip) {
+			if (to->offset != 0 &&
+			    !relay_switch_subbuf(to, mark + len - skip))
+				return false;
+			if (mark + len - skip > to->chan->subbuf_size)
+				return false;
+			memcpy(to->data, &marker, mark);
+			memcpy(to->data + mark, subbuf + skip, len - skip);
+			to->offset = mark + len - skip;
+		}
+		skip = 0;
+	}
+	return !lost;
+}
+
+static bool prov_channel_has_reader(struct rchan *chan)
+{
+	struct rchan_buf *buf;
+	int cpu;
+
+	if (!chan)
+		return false;
+	for_each_possible_cpu(cpu) {
+		buf = *per_cpu_ptr(chan->buf, cpu);
+		if (buf && kref_read(&buf->kref) > 1)
+			return true;
 	}
+	return false;
+}
+
+/*!
+ * @brief Re-open a channel with a new geometry.
+ *
+ * This is only possible while no reader is attached to the channel, as
+ * relay buffers cannot be resized underneath a reader.
+ * The new channel is allocated before the old one is released, unread data is
+ * carried over; readers cannot attach until the new channel is published.
+ * Elements written while the channel is swapped are dropped.
+ * Node deltas are invalidated if unread data is lost.
+ * If the files of the new channel cannot be created, a new channel with the
+ * previous geometry is opened instead and unread data is lost; if that also
+ * fails, the channel is left closed and every element is dropped until it is
+ * successfully resized.
+ * @param pc The channel.
+ * @param subbuf_size The new sub-buffer size.
+ * @param nb_subbuf The new number of sub-buffers.
+ * @return 0 on success; -EBUSY if a reader is attached; -ENOMEM if the new
+ * channel could not be allocated; -EINVAL if the geometry is invalid;
+ * -EOPNOTSUPP if the channel uses NUMA rings or compression.
+ *
+ */
+int prov_channel_resize(struct prov_channel *pc,
+			size_t subbuf_size,
+			size_t nb_subbuf)
+{
+	struct rchan *old, *new;
+	struct prov_subbuf_state *state;
+	struct rchan_buf *from, *to;
+	int cpu, rc = 0;
+
+	if (pc->numa || pc->lz4)
+		return -EOPNOTSUPP;
+	if (!prov_relay_geometry_valid(subbuf_size, nb_subbuf))
+		return -EINVAL;
+
+	mutex_lock(&prov_channels_lock);
+	old = rcu_dereference_protected(pc->chan,
+					lockdep_is_held(&prov_channels_lock));
+	WRITE_ONCE(pc->resizing, true);
+	// pairs with prov_relay_file_open
+	smp_mb();
+	if (prov_channel_has_reader(old)) {
+		rc = -EBUSY;
+		goto out;
+	}
+	new = relay_open(NULL, NULL, subbuf_size, nb_subbuf,
+			 &relay_callbacks, pc);
+	if (!new) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	rcu_assign_pointer(pc->chan, NULL);
+	// wait for writers, which run with interrupts disabled
+	synchronize_rcu();
+	cpus_read_lock();
+	for_each_possible_cpu(cpu) {
+		from = old ? *per_cpu_ptr(old->buf, cpu) : NULL;
+		to = *per_cpu_ptr(new->buf, cpu);
+		// consumers will not see the versions deltas are based on
+		if (from && to && !prov_relay_carry(from, to))
+			prov_delta_invalidate_all();
+		if (!to)
+			continue;
+		// new records start in a sub-buffer of their own, so that
+		// they are not delta-encoded against carried records, and
+		// marked as the format of the last carried one is unknown
+		state = per_cpu_ptr(pc->subbuf, cpu);
+		state->mark = to->offset;
+		if (!state->mark)
+			state->format = PROV_WIRE_FIXED;
+		else {
+			relay_switch_subbuf(to, 0);
+			// the relay is full, the next writer will switch
+			if (to->offset)
+				continue;
+		}
+		prov_subbuf_begin(state, to, to->data);
+	}
+	cpus_read_unlock();
+	if (old)
+		relay_close(old);
+	rc = relay_late_setup_files(new, pc->name, NULL);
+	if (rc) {
+		pr_err("Provenance: could not create relay files for %s.",
+		       pc->name);
+		relay_close(new);
+		prov_delta_invalidate_all();
+		new = relay_open(pc->name, NULL, pc->subbuf_size, pc->nb_subbuf,
+				 &relay_callbacks, pc);
+		if (!new) {
+			pr_err("Provenance: relay %s closed.", pc->name);
+			goto out;
+		}
+		goto publish;
+	}
+	pc->subbuf_size = subbuf_size;
+	pc->nb_subbuf = nb_subbuf;
+	pr_info("Provenance: relay %s resized to %zu x %zu.", pc->name,
+		nb_subbuf, subbuf_size);
+publish:
+	rcu_assign_pointer(pc->chan, new);
+out:
+	WRITE_ONCE(pc->resizing, false);
+	mutex_unlock(&prov_channels_lock);
+	return rc;
+}
+
+/*!
+ * @brief Adapt the number of sub-buffers of a channel to its fill rate.
+ *
+ * Only the pressure seen while a reader is attached is considered: without a
+ * reader nothing is consumed and the relay fills up whatever its size.
+ * The number of sub-buffers should be doubled when elements have been dropped
+ * or when a CPU buffer is more than three quarters full, and halved when all
+ * CPU buffers have stayed below one eighth for PROV_ADAPT_SHRINK periods.
+ * As relay buffers cannot be resized underneath a reader (see
+ * "prov_channel_resize"), the new size is applied once the reader detaches,
+ * e.g. when the daemon is restarted; it is at most twice the size the reader
+ * saw, and bounded by PROV_NB_SUBBUF_MAX.
+ *
+ */
+static void prov_channel_adapt(struct work_struct *work)
+{
+	struct prov_channel *pc = container_of(to_delayed_work(work),
+					       struct prov_channel,
+					       adapt_work);
+	size_t nb_subbuf = READ_ONCE(pc->nb_subbuf);
+	struct rchan_buf *buf;
+	struct rchan *chan;
+	bool reader = false;
+	uint64_t dropped;
+	size_t fill = 0;
+	int cpu;
+
+	if (!READ_ONCE(pc->adaptive))
+		return;
+
+	dropped = prov_channel_dropped(pc);
+	rcu_read_lock();
+	chan = rcu_dereference(pc->chan);
+	if (chan) {
+		reader = prov_channel_has_reader(chan);
+		for_each_possible_cpu(cpu) {
+			buf = *per_cpu_ptr(chan->buf, cpu);
+			if (buf)
+				fill = max_t(size_t, fill,
+					     buf->subbufs_produced -
+					     buf->subbufs_consumed);
+		}
+	}
+	rcu_read_unlock();
+
+	if (!reader) {
+		if (pc->adapt_target && pc->adapt_target != nb_subbuf)
+			prov_channel_resize(pc, READ_ONCE(pc->subbuf_size),
+					    pc->adapt_target);
+		pc->adapt_target = 0;
+		pc->adapt_low = 0;
+	} else if (dropped != pc->adapt_dropped || fill * 4 >= nb_subbuf * 3) {
+		pc->adapt_target = max_t(size_t, pc->adapt_target,
+					 min_t(size_t, nb_subbuf * 2,
+					       PROV_NB_SUBBUF_MAX));
+		pc->adapt_low = 0;
+	} else if (fill * 8 <= nb_subbuf) {
+		if (++pc->adapt_low >= PROV_ADAPT_SHRINK && !pc->adapt_target)
+			pc->adapt_target = max_t(size_t, nb_subbuf / 2,
+						 PROV_NB_SUBBUF_MIN);
+	} else
+		pc->adapt_low = 0;
+	pc->adapt_dropped = dropped;
+	schedule_delayed_work(&pc->adapt_work, PROV_ADAPT_DELAY);
+}
+
+void prov_channel_set_adaptive(struct prov_channel *pc, bool adaptive)
+{
+	WRITE_ONCE(pc->adaptive, adaptive);
+	if (adaptive)
+		schedule_delayed_work(&pc->adapt_work, PROV_ADAPT_DELAY);
+}
+
+/*!
+ * @brief Set the policy applied when the relay of a channel is full.
+ *
+ * Overwritten sub-buffers may hold the versions deltas already written are
+ * based on, node deltas are suspended while any channel uses
+ * PROV_RELAY_OVERWRITE.
+ * @param pc The channel.
+ * @param policy The new policy.
+ *
+ */
+void prov_channel_set_policy(struct prov_channel *pc, uint8_t policy)
+{
+	uint8_t old;
+
+	mutex_lock(&prov_channels_lock);
+	old = pc->policy;
+	if (policy == PROV_RELAY_OVERWRITE && old != PROV_RELAY_OVERWRITE)
+		prov_delta_suspend();
+	WRITE_ONCE(pc->policy, policy);
+	if (policy != PROV_RELAY_OVERWRITE && old == PROV_RELAY_OVERWRITE)
+		prov_delta_resume();
+	mutex_unlock(&prov_channels_lock);
+}
+
+static int prov_channel_open(struct prov_channel *pc,
+			     const char *name,
+			     size_t subbuf_size,
+			     size_t nb_subbuf)
+{
+	struct rchan *chan = NULL;
+
+	strscpy(pc->name, name, PROV_CHANNEL_NAME_LEN);
+	pc->policy = PROV_RELAY_DROP;
+	pc->block_ms = PROV_BLOCK_DEFAULT_MS;
+	pc->spill_max = PROV_SPILL_DEFAULT_MAX;
+	atomic64_set(&pc->spill_size, 0);
+	INIT_DELAYED_WORK(&pc->adapt_work, prov_channel_adapt);
+	INIT_LIST_HEAD(&pc->fanout);
+	if (prov_spill_init(pc))
+		return -ENOMEM;
+	pc->stats = alloc_percpu(struct prov_channel_stats);
+	if (!pc->stats)
+		goto out;
+	pc->subbuf = alloc_percpu(struct prov_subbuf_state);
+	if (!pc->subbuf)
+		goto out;
+	if (prov_numa_size) {
+		pc->numa = prov_numa_alloc(pc->name);
+		if (!pc->numa)
+			goto out;
+	} else {
+		chan = relay_open(pc->name, NULL, subbuf_size, nb_subbuf,
+				  &relay_callbacks, pc);
+		if (!chan)
+			goto out;
+		RCU_INIT_POINTER(pc->chan, chan);
+	}
+	pc->subbuf_size = subbuf_size;
+	pc->nb_subbuf = nb_subbuf;
+	if (prov_lz4_open(pc)) {
+		if (pc->numa)
+			prov_numa_free(pc->numa);
+		else
+			relay_close(chan);
+		goto out;
+	}
+	return 0;
+out:
+	free_percpu(pc->subbuf);
+	free_percpu(pc->stats);
+	free_percpu(pc->spill);
+	return -ENOMEM;
+}
+
+/*!
+ * @brief Close a channel opened with "prov_channel_open" that was never added
+ * to prov_channels, removing its files.
+ */
+static void prov_channel_close(struct prov_channel *pc)
+{
+	prov_lz4_close(pc);
+	if (pc->numa)
+		prov_numa_free(pc->numa);
+	else
+		relay_close(rcu_dereference_protected(pc->chan, true));
+	free_percpu(pc->subbuf);
+	free_percpu(pc->stats);
+	free_percpu(pc->spill);
+}
+
+static void __init init_prov_channel(struct prov_channel *pc,
+				     const char *name,
+				     size_t subbuf_size,
+				     size_t nb_subbuf)
+{
+	if (prov_channel_open(pc, name, subbuf_size, nb_subbuf))
+		panic("Provenance: relay_open failure\n");
+	list_add_tail_rcu(&pc->list, &prov_channels);
+}
+
+static bool prov_channel_name_valid(const char *name)
+{
+	size_t len = strnlen(name, PROV_CHANNEL_NAME_LEN);
+
+	if (len == 0 || len > PROV_CHANNEL_USER_LEN)
+		return false;
+	for (; *name; name++)
+		if (!isalnum(*name) && *name != '_' && *name != '-')
+			return false;
+	return true;
+}
+
+static void prov_channel_set_filter(struct prov_channel *pc,
+				    const struct prov_channel_filter *filter)
+{
+	strscpy(pc->filter.channel, filter->channel, PROV_CHANNEL_NAME_LEN);
+	WRITE_ONCE(pc->filter.node_filter, filter->node_filter);
+	WRITE_ONCE(pc->filter.derived_filter, filter->derived_filter);
+	WRITE_ONCE(pc->filter.generated_filter, filter->generated_filter);
+	WRITE_ONCE(pc->filter.used_filter, filter->used_filter);
+	WRITE_ONCE(pc->filter.informed_filter, filter->informed_filter);
+}
+
+/*!
+ * @brief Create a pair of fan-out channels or update their filter.
+ *
+ * The channels "provenance_<name>" and "long_provenance_<name>" receive
+ * respectively the regular and long elements accepted by the filter.
+ * They use the default geometry and the PROV_RELAY_DROP policy, which can be
+ * changed as for the main channels.
+ * Fan-out channels cannot be removed.
+ * If the relay is already running, the machine element is written to the new
+ * long channel so that its stream is self-contained.
+ * @param filter The name and filter of the channels.
+ * @return 0 on success; -EINVAL if the name is invalid; -ENOMEM if the
+ * channels could not be allocated.
+ *
+ */
+int prov_channel_create(const struct prov_channel_filter *filter)
+{
+	struct prov_channel *pc, *long_pc = NULL;
+	char name[PROV_CHANNEL_NAME_LEN];
+	LIST_HEAD(none);
+	int rc = 0;
+
+	if (!prov_channel_name_valid(filter->channel))
+		return -EINVAL;
+
+	mutex_lock(&prov_channels_lock);
+	snprintf(name, PROV_CHANNEL_NAME_LEN, "%s_%s", PROV_BASE_NAME,
+		 filter->channel);
+	pc = prov_channel_find(name);
+	snprintf(name, PROV_CHANNEL_NAME_LEN, "%s_%s", LONG_PROV_BASE_NAME,
+		 filter->channel);
+	if (pc) {
+		long_pc = prov_channel_find(name);
+		goto update;
+	}
+
+	pc = kzalloc(sizeof(struct prov_channel), GFP_KERNEL);
+	long_pc = kzalloc(sizeof(struct prov_channel), GFP_KERNEL);
+	if (!pc || !long_pc)
+		goto nomem;
+	prov_channel_set_filter(pc, filter);
+	prov_channel_set_filter(long_pc, filter);
+	rc = prov_channel_open(long_pc, name, PROV_RELAY_BUFF_SIZE,
+			       PROV_NB_SUBBUF);
+	if (rc)
+		goto nomem;
+	snprintf(name, PROV_CHANNEL_NAME_LEN, "%s_%s", PROV_BASE_NAME,
+		 filter->channel);
+	rc = prov_channel_open(pc, name, PROV_RELAY_BUFF_SIZE, PROV_NB_SUBBUF);
+	if (rc) {
+		prov_channel_close(long_pc);
+		goto nomem;
+	}
+	list_add_tail_rcu(&long_pc->list, &prov_channels);
+	list_add_tail_rcu(&pc->list, &prov_channels);
+	if (relay_ready)
+		prov_relay_write(long_pc, &none, prov_machine,
+				 sizeof(union long_prov_elt));
+	list_add_tail_rcu(&long_pc->fanout, &long_prov_fanout);
+	list_add_tail_rcu(&pc->fanout, &prov_fanout);
+	// the channel has not seen the versions node deltas are based on
+	prov_delta_invalidate_all();
+	pr_info("Provenance: channel %s created.", filter->channel);
+	goto out;
+update:
+	prov_channel_set_filter(pc, filter);
+	if (long_pc)
+		prov_channel_set_filter(long_pc, filter);
+	prov_delta_invalidate_all();
+	goto out;
+nomem:
+	kfree(pc);
+	kfree(long_pc);
+	rc = -ENOMEM;
+out:
+	mutex_unlock(&prov_channels_lock);
+	return rc;
 }
 
 /*!
@@ -328,24 +2007,28 @@ void long_prov_write(union long_prov_elt *msg, size_t size)
  * Initialize provenance relay buffer with a base relay buffer for regular
  * provenance entries,
  * and a base relay buffer for long provenance entries.
+ * Their geometry can be set with the "provenance_relay=" and
+ * "provenance_long_relay=" boot parameters.
+ * With the "provenance_numa=" boot parameter, the CPUs of a NUMA node share a
+ * single ring per channel instead.
+ * With the "provenance_lz4" boot parameter, completed sub-buffers are
+ * compressed into "<channel>_lz4" relays, which are the only ones that can be
+ * read.
+ * With the "provenance_delta=" boot parameter, new versions of regular nodes
+ * are written as deltas against their previous version.
  * Then we can write down whatever is in the boot buffer to relay buffer.
  * @return 0 if no error occurred.
  *
  */
 static int __init relay_prov_init(void)
 {
-	prov_chan = relay_open(PROV_BASE_NAME, NULL, PROV_RELAY_BUFF_SIZE,
-			       PROV_NB_SUBBUF, &relay_callbacks, NULL);
-	if (!prov_chan)
-		panic("Provenance: relay_open failure\n");
-
-	long_prov_chan = relay_open(LONG_PROV_BASE_NAME, NULL,
-				    PROV_RELAY_BUFF_SIZE,
-				    PROV_NB_SUBBUF,
-				    &relay_callbacks,
-				    NULL);
-	if (!long_prov_chan)
-		panic("Provenance: relay_open failure\n");
+	prov_relay_fops = relay_file_operations;
+	prov_relay_fops.open = prov_relay_file_open;
+	prov_delta_init();
+	init_prov_channel(&prov_chan, PROV_BASE_NAME,
+			  prov_subbuf_size, prov_nb_subbuf);
+	init_prov_channel(&long_prov_chan, LONG_PROV_BASE_NAME,
+			  long_prov_subbuf_size, long_prov_nb_subbuf);
 
 	relay_initialized = true;
 	init_prov_machine();
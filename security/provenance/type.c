@@ -142,6 +142,7 @@ static const char ND_STR_PCKCNT[] = "packet_content";
 static const char ND_STR_ARG[] = "argv";                                        // argument passed to a process
 static const char ND_STR_ENV[] = "envp";                                        // environment parameter
 static const char ND_STR_PROC[] = "process_memory";                             // process memory
+static const char ND_STR_SUPPRESSED[] = "suppressed";                           // relations suppressed by a rate limit
 
 #define MATCH_AND_RETURN(str1, str2, v)	\
 	do { if (strcmp(str1, str2) == 0) { return v; } } while (0)
@@ -508,6 +509,8 @@ const char *node_str(uint64_t type)
 		return ND_STR_ENV;
 	case ENT_PROC:
 		return ND_STR_PROC;
+	case ENT_SUPPRESSED:
+		return ND_STR_SUPPRESSED;
 	default:
 		return ND_STR_UNKNOWN;
 	}
@@ -542,6 +545,7 @@ uint64_t node_id(const char *str)
 	MATCH_AND_RETURN(str, ND_STR_ARG, ENT_ARG);
 	MATCH_AND_RETURN(str, ND_STR_ENV, ENT_ENV);
 	MATCH_AND_RETURN(str, ND_STR_PROC, ENT_PROC);
+	MATCH_AND_RETURN(str, ND_STR_SUPPRESSED, ENT_SUPPRESSED);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(node_id);
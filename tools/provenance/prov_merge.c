@@ -0,0 +1,411 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * Merge the per-CPU relay files of a provenance channel into a single stream
+ * ordered by (ts, seq).
+ *
+ * Each per-CPU file is already ordered, the files are merged with a k-way
+ * merge holding a single buffer per file.
+ * In follow mode, files are read as they grow; a record is only written once
+ * every file either has a later record pending or has been found empty after
+ * the record was stamped (minus a slack accounting for records being written
+ * while the file is read).
+ *
+ * Records are written to stdout unmodified, in the format they were read.
+ * PROV_WIRE_COMPACT records are encoded against the previous records of their
+ * sub-buffer and cannot be interleaved; they are decoded and written as fixed
+ * size elements instead.
+ * Files switch format at each prov_wire_marker; a marker is written to stdout
+ * whenever the format of the records written changes.
+ *
+ * Copies of an element written to several channels (e.g., the main channel
+ * and a fan-out channel) share its (ts, seq); when the files of several
+ * channels are merged, -d only writes the first copy.
+ *
+ * Usage: prov_merge [-l] [-v | -c] [-d] [-f] [-s slack_ms] file...
+ *   -l  files carry long elements (i.e., long_provenance files)
+ *   -v  files start in the PROV_WIRE_VARLEN format
+ *   -c  files start in the PROV_WIRE_COMPACT format
+ *   -d  drop copies of elements already written
+ *   -f  follow the files as they grow
+ *   -s  slack in milliseconds used in follow mode (default 10)
+ *
+ * Elements written back from the overflow pool of a channel, and elements of
+ * NUMA node files, may be slightly out of order; they are written as soon as
+ * they are read.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/provenance.h>
+
+#define BUFFER_SIZE     (1 << 20)
+#define POLL_NS         1000000ULL
+
+struct stream {
+	int fd;
+	uint8_t *buf;
+	size_t start;
+	size_t end;
+	/* current record, valid when pending */
+	int pending;
+	size_t length;
+	uint64_t ts;
+	uint64_t seq;
+	union prov_identifier id;
+	int done;
+	uint32_t format;
+	/* decoding state and current element in compact mode */
+	struct prov_compact_stream state;
+	prov_entry_t elt;
+};
+
+static struct stream *streams;
+static unsigned int *heap;
+static unsigned int nr_heap;
+static uint32_t format = PROV_WIRE_FIXED;
+static uint32_t out_format = PROV_WIRE_FIXED;
+static size_t fixed_size = sizeof(union prov_elt);
+/* identifiers of the elements written with the current (ts, seq) */
+static int dedup;
+static uint64_t seen_ts, seen_seq;
+static union prov_identifier *seen;
+static unsigned int nr_seen, max_seen;
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static int before(unsigned int a, unsigned int b)
+{
+	if (streams[a].ts != streams[b].ts)
+		return streams[a].ts < streams[b].ts;
+	if (streams[a].seq != streams[b].seq)
+		return streams[a].seq < streams[b].seq;
+	return a < b;
+}
+
+static void heap_push(unsigned int s)
+{
+	unsigned int i = nr_heap++, parent;
+
+	heap[i] = s;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!before(heap[i], heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		heap[parent] = s;
+		i = parent;
+	}
+}
+
+static unsigned int heap_pop(void)
+{
+	unsigned int top = heap[0], i = 0, child, tmp;
+
+	heap[0] = heap[--nr_heap];
+	while ((child = 2 * i + 1) < nr_heap) {
+		if (child + 1 < nr_heap && before(heap[child + 1], heap[child]))
+			child++;
+		if (!before(heap[child], heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+	return top;
+}
+
+static int parse(struct stream *s);
+
+/* Decode the compact record at the start of the buffer, 0 if incomplete. */
+static int parse_compact(struct stream *s)
+{
+	int rc, decoded;
+
+	rc = prov_compact_decode(s->buf + s->start, s->end - s->start,
+				 &s->state, &s->elt, &decoded);
+	if (rc < 0) {
+		fprintf(stderr, "prov_merge: corrupted record.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (rc == 0)
+		return 0;
+	// sub-buffer headers only reset the decoding state, and may be
+	// followed by a marker if the sub-buffer holds no record
+	if (!decoded) {
+		s->start += rc;
+		return parse(s);
+	}
+	s->length = rc;
+	s->ts = s->elt.msg_info.ts;
+	s->seq = s->elt.msg_info.seq;
+	s->id = s->elt.msg_info.identifier;
+	return 1;
+}
+
+/* Consume the format markers at the start of the buffer. */
+static void parse_marker(struct stream *s)
+{
+	struct prov_wire_marker marker;
+
+	while (s->end - s->start >= sizeof(struct prov_wire_marker)) {
+		memcpy(&marker, s->buf + s->start,
+		       sizeof(struct prov_wire_marker));
+		if (marker.magic != PROV_WIRE_MARKER_MAGIC)
+			return;
+		if (marker.format > PROV_WIRE_MAX) {
+			fprintf(stderr, "prov_merge: unknown format %u.\n",
+				marker.format);
+			exit(EXIT_FAILURE);
+		}
+		// compact records are not encoded against older sub-buffers
+		if (marker.format == PROV_WIRE_COMPACT)
+			memset(&s->state, 0, sizeof(struct prov_compact_stream));
+		s->format = marker.format;
+		s->start += sizeof(struct prov_wire_marker);
+	}
+}
+
+/* Parse the record at the start of the buffer, return 0 if incomplete. */
+static int parse(struct stream *s)
+{
+	size_t avail;
+	const uint8_t *rec, *msg;
+	struct prov_wire_header hdr;
+
+	parse_marker(s);
+	// a marker may be split across reads
+	avail = s->end - s->start;
+	if (avail < sizeof(struct prov_wire_marker))
+		return 0;
+	if (s->format == PROV_WIRE_COMPACT)
+		return parse_compact(s);
+	rec = s->buf + s->start;
+	msg = rec;
+	if (s->format == PROV_WIRE_VARLEN) {
+		if (avail < sizeof(struct prov_wire_header))
+			return 0;
+		memcpy(&hdr, rec, sizeof(struct prov_wire_header));
+		if (hdr.version != PROV_WIRE_VERSION ||
+		    hdr.size < sizeof(struct prov_wire_header)) {
+			fprintf(stderr, "prov_merge: corrupted record.\n");
+			exit(EXIT_FAILURE);
+		}
+		s->length = hdr.size;
+		msg += sizeof(struct prov_wire_header);
+	} else
+		s->length = fixed_size;
+	if (avail < s->length)
+		return 0;
+	memcpy(&s->ts, msg + offsetof(struct msg_struct, ts), sizeof(uint64_t));
+	memcpy(&s->seq, msg + offsetof(struct msg_struct, seq),
+	       sizeof(uint64_t));
+	memcpy(&s->id, msg + offsetof(struct msg_struct, identifier),
+	       sizeof(union prov_identifier));
+	return 1;
+}
+
+/* Try to get the next record of a stream, return 1 if one is available. */
+static int fill(struct stream *s)
+{
+	ssize_t n;
+
+	while (!parse(s)) {
+		if (s->start > 0) {
+			memmove(s->buf, s->buf + s->start, s->end - s->start);
+			s->end -= s->start;
+			s->start = 0;
+		}
+		n = read(s->fd, s->buf + s->end, BUFFER_SIZE - s->end);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("prov_merge: read");
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0)
+			return 0;
+		s->end += n;
+	}
+	return 1;
+}
+
+/*
+ * Whether a copy of the current record of a stream was already written.
+ * Records with the same (ts, seq) but another identifier (e.g., from two
+ * CPUs) are not copies, and may be interleaved with copies.
+ */
+static int duplicate(struct stream *s)
+{
+	unsigned int i;
+
+	if (nr_seen && (s->ts != seen_ts || s->seq != seen_seq))
+		nr_seen = 0;
+	seen_ts = s->ts;
+	seen_seq = s->seq;
+	for (i = 0; i < nr_seen; i++) {
+		if (!memcmp(&seen[i], &s->id, sizeof(union prov_identifier)))
+			return 1;
+	}
+	if (nr_seen == max_seen) {
+		max_seen = max_seen ? 2 * max_seen : 16;
+		seen = realloc(seen, max_seen * sizeof(union prov_identifier));
+		if (!seen)
+			exit(EXIT_FAILURE);
+	}
+	seen[nr_seen++] = s->id;
+	return 0;
+}
+
+static void emit(struct stream *s)
+{
+	struct prov_wire_marker marker = { .magic = PROV_WIRE_MARKER_MAGIC };
+	const void *rec = s->buf + s->start;
+	size_t length = s->length;
+
+	if (dedup && duplicate(s)) {
+		s->start += s->length;
+		return;
+	}
+	marker.format = s->format;
+	if (s->format == PROV_WIRE_COMPACT) {
+		rec = &s->elt;
+		length = fixed_size;
+		marker.format = PROV_WIRE_FIXED;
+	}
+	if (marker.format != out_format) {
+		out_format = marker.format;
+		if (fwrite(&marker, sizeof(marker), 1, stdout) != 1) {
+			perror("prov_merge: write");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (fwrite(rec, length, 1, stdout) != 1) {
+		perror("prov_merge: write");
+		exit(EXIT_FAILURE);
+	}
+	s->start += s->length;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t slack = 10 * 1000000ULL, watermark, now;
+	struct timespec poll = { 0, POLL_NS };
+	unsigned int i, nr, top, live;
+	struct stream *s;
+	int follow = 0, opt;
+
+	while ((opt = getopt(argc, argv, "lvcdfs:")) != -1) {
+		switch (opt) {
+		case 'l':
+			fixed_size = sizeof(union long_prov_elt);
+			break;
+		case 'v':
+			if (format != PROV_WIRE_FIXED)
+				goto usage;
+			format = PROV_WIRE_VARLEN;
+			break;
+		case 'c':
+			if (format != PROV_WIRE_FIXED)
+				goto usage;
+			format = PROV_WIRE_COMPACT;
+			break;
+		case 'd':
+			dedup = 1;
+			break;
+		case 'f':
+			follow = 1;
+			break;
+		case 's':
+			slack = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= argc)
+		goto usage;
+
+	nr = argc - optind;
+	streams = calloc(nr, sizeof(struct stream));
+	heap = calloc(nr, sizeof(unsigned int));
+	if (!streams || !heap)
+		return EXIT_FAILURE;
+	for (i = 0; i < nr; i++) {
+		streams[i].fd = open(argv[optind + i], O_RDONLY);
+		if (streams[i].fd < 0) {
+			perror(argv[optind + i]);
+			return EXIT_FAILURE;
+		}
+		streams[i].format = format;
+		streams[i].buf = malloc(BUFFER_SIZE);
+		if (!streams[i].buf)
+			return EXIT_FAILURE;
+	}
+
+	while (1) {
+		// refresh the streams that have no pending record
+		now = now_ns();
+		watermark = UINT64_MAX;
+		live = 0;
+		for (i = 0; i < nr; i++) {
+			s = &streams[i];
+			if (s->pending || s->done)
+				continue;
+			if (fill(s)) {
+				s->pending = 1;
+				heap_push(i);
+			} else if (!follow)
+				s->done = 1;
+			else {
+				// nothing stamped before now - slack can show up
+				live++;
+				if (now - slack < watermark)
+					watermark = now - slack;
+			}
+		}
+		if (!nr_heap && !live)
+			break;
+		// write every record that cannot be preceded by another one
+		while (nr_heap && streams[heap[0]].ts <= watermark) {
+			top = heap_pop();
+			emit(&streams[top]);
+			if (!fill(&streams[top])) {
+				streams[top].pending = 0;
+				break;
+			}
+			heap_push(top);
+		}
+		if (!nr_heap || streams[heap[0]].ts > watermark)
+			nanosleep(&poll, NULL);
+	}
+	fflush(stdout);
+	return EXIT_SUCCESS;
+usage:
+	fprintf(stderr,
+		"usage: %s [-l] [-v | -c] [-d] [-f] [-s slack_ms] file...\n",
+		argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * Decompress a "<channel>_lz4" relay file (see struct prov_lz4_frame).
+ *
+ * Each frame is decompressed and the content of the sub-buffer it holds is
+ * written to stdout; the output of a per-CPU file is the stream of records
+ * prov_merge expects, markers included.
+ *
+ * Usage: prov_unlz4 [file]
+ *   reads stdin if no file is given.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/provenance.h>
+
+/* larger than any sub-buffer a channel can be configured with */
+#define PROV_LZ4_MAX_SIZE       (1U << 26)
+
+static int read_full(int fd, void *dst, size_t len)
+{
+	uint8_t *p = dst;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("prov_unlz4: read");
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0)
+			return p == (uint8_t *)dst ? 0 : -1;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* LZ4 lengths of 15 (resp. 15 + 4) continue in the following bytes */
+static int lz4_length(const uint8_t **p, const uint8_t *end, size_t *length)
+{
+	uint8_t byte;
+
+	do {
+		if (*p >= end)
+			return -1;
+		byte = *(*p)++;
+		*length += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+/*
+ * Decompress an LZ4 block.
+ * Returns the decompressed size, or -1 if the block is corrupted or does not
+ * fit in dst.
+ */
+static ssize_t lz4_decompress(const uint8_t *src, size_t len,
+			      uint8_t *dst, size_t size)
+{
+	const uint8_t *end = src + len;
+	size_t literals, match, offset, out = 0;
+	uint8_t token;
+
+	while (src < end) {
+		token = *src++;
+		literals = token >> 4;
+		if (literals == 15 && lz4_length(&src, end, &literals))
+			return -1;
+		if ((size_t)(end - src) < literals || size - out < literals)
+			return -1;
+		memcpy(dst + out, src, literals);
+		src += literals;
+		out += literals;
+		// the last sequence only has literals
+		if (src == end)
+			break;
+		if (end - src < 2)
+			return -1;
+		offset = src[0] | (src[1] << 8);
+		src += 2;
+		match = token & 0x0f;
+		if (match == 15 && lz4_length(&src, end, &match))
+			return -1;
+		match += 4;
+		if (offset == 0 || offset > out || size - out < match)
+			return -1;
+		// matches may overlap their own output
+		for (; match; match--, out++)
+			dst[out] = dst[out - offset];
+	}
+	return out;
+}
+
+int main(int argc, char *argv[])
+{
+	struct prov_lz4_frame frame;
+	uint8_t *src, *dst;
+	ssize_t size;
+	int fd = STDIN_FILENO, rc;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [file]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc == 2) {
+		fd = open(argv[1], O_RDONLY);
+		if (fd < 0) {
+			perror(argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+	src = malloc(PROV_LZ4_MAX_SIZE);
+	dst = malloc(PROV_LZ4_MAX_SIZE);
+	if (!src || !dst)
+		return EXIT_FAILURE;
+
+	while ((rc = read_full(fd, &frame, sizeof(frame))) > 0) {
+		if (frame.magic != PROV_LZ4_MAGIC ||
+		    frame.compressed_size > PROV_LZ4_MAX_SIZE ||
+		    frame.original_size > PROV_LZ4_MAX_SIZE)
+			goto corrupted;
+		if (read_full(fd, src, frame.compressed_size) <= 0)
+			goto corrupted;
+		size = lz4_decompress(src, frame.compressed_size, dst,
+				      frame.original_size);
+		if (size != frame.original_size)
+			goto corrupted;
+		if (fwrite(dst, size, 1, stdout) != 1 && size) {
+			perror("prov_unlz4: write");
+			return EXIT_FAILURE;
+		}
+	}
+	if (rc < 0)
+		goto corrupted;
+	fflush(stdout);
+	return EXIT_SUCCESS;
+corrupted:
+	fprintf(stderr, "prov_unlz4: corrupted frame.\n");
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,387 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * Round trip of elements through the PROV_WIRE_COMPACT format, decoded by
+ * prov_compact_decode and by prov_merge.
+ *
+ * Records are encoded as prov_compact_encode (security/provenance/relay.c)
+ * does.
+ */
+#include "test.h"
+
+#define MACHINE_ID      42
+#define BOOT_ID         1
+
+static void varint(struct test_buf *b, uint64_t v)
+{
+	uint8_t byte;
+
+	do {
+		byte = v & 0x7f;
+		v >>= 7;
+		if (v)
+			byte |= 0x80;
+		test_append(b, &byte, 1);
+	} while (v);
+}
+
+static void zigzag(struct test_buf *b, int64_t v)
+{
+	varint(b, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void encode_id(struct test_buf *b, const union prov_identifier *id,
+		      const struct prov_compact_stream *s, uint64_t *prev)
+{
+	uint8_t tag = 0;
+
+	if (id->node_id.type == ENT_PACKET) {
+		tag = PROV_COMPACT_ID_RAW;
+		test_append(b, &tag, 1);
+		test_append(b, id, sizeof(union prov_identifier));
+		return;
+	}
+	if (id->node_id.boot_id != s->boot_id ||
+	    id->node_id.machine_id != s->machine_id)
+		tag = PROV_COMPACT_ID_FOREIGN;
+	test_append(b, &tag, 1);
+	test_append(b, &id->node_id.type, sizeof(uint64_t));
+	zigzag(b, (int64_t)(id->node_id.id - *prev));
+	*prev = id->node_id.id;
+	varint(b, id->node_id.version);
+	if (tag & PROV_COMPACT_ID_FOREIGN) {
+		varint(b, id->node_id.boot_id);
+		varint(b, id->node_id.machine_id);
+	}
+}
+
+/* Encode an element, against the zero state if stream is NULL. */
+static void encode(struct test_buf *out, const union prov_elt *msg,
+		   const struct prov_wire_header *hdr,
+		   struct prov_compact_stream *stream)
+{
+	struct prov_compact_stream zero = { 0 }, *s = stream ? stream : &zero;
+	struct prov_compact_header h = { 0 };
+	struct test_buf b = { 0 };
+	const uint8_t *src = (const uint8_t *)msg;
+	size_t start = sizeof(struct msg_struct);
+	int relation = prov_type_is_relation(prov_type(msg));
+
+	encode_id(&b, &msg->msg_info.identifier, s,
+		  relation ? &s->relation_id : &s->node_id);
+	varint(&b, msg->msg_info.epoch);
+	varint(&b, msg->msg_info.nepoch);
+	varint(&b, msg->msg_info.internal_flag);
+	varint(&b, msg->msg_info.jiffies);
+	varint(&b, msg->msg_info.taint);
+	zigzag(&b, (int64_t)(msg->msg_info.ts - s->ts));
+	s->ts = msg->msg_info.ts;
+	zigzag(&b, (int64_t)(msg->msg_info.seq - s->seq));
+	s->seq = msg->msg_info.seq;
+	if (relation) {
+		encode_id(&b, &msg->relation_info.snd, s, &s->node_id);
+		encode_id(&b, &msg->relation_info.rcv, s, &s->node_id);
+		test_append(&b, &msg->relation_info.allowed, 1);
+		test_append(&b, &msg->relation_info.set, 1);
+		zigzag(&b, msg->relation_info.offset);
+		varint(&b, msg->relation_info.flags);
+		varint(&b, msg->relation_info.task_id);
+		if (prov_type_is_aggregate(prov_type(msg))) {
+			varint(&b, msg->aggregate_info.count);
+			varint(&b, msg->aggregate_info.bytes);
+			varint(&b, msg->aggregate_info.first);
+			varint(&b, msg->aggregate_info.last);
+		}
+	} else {
+		varint(&b, hdr->var_offset);
+		varint(&b, hdr->var_length);
+		varint(&b, hdr->tail_offset);
+		varint(&b, hdr->tail_length);
+		test_append(&b, src + start, hdr->var_offset - start);
+		test_append(&b, src + hdr->var_offset, hdr->var_length);
+		test_append(&b, src + hdr->tail_offset, hdr->tail_length);
+	}
+	h.size = sizeof(h) + b.len;
+	h.kind = relation ? PROV_COMPACT_RELATION : PROV_COMPACT_NODE;
+	h.flags = stream ? 0 : PROV_COMPACT_ABSOLUTE;
+	test_append(out, &h, sizeof(h));
+	test_append(out, b.data, b.len);
+	free(b.data);
+}
+
+static void subbuf(struct test_buf *out, struct prov_compact_stream *s)
+{
+	struct prov_compact_subbuf hdr = {
+		.magic = PROV_COMPACT_MAGIC,
+		.machine_id = MACHINE_ID,
+		.boot_id = BOOT_ID,
+	};
+
+	memset(s, 0, sizeof(struct prov_compact_stream));
+	s->machine_id = MACHINE_ID;
+	s->boot_id = BOOT_ID;
+	test_append(out, &hdr, sizeof(hdr));
+}
+
+static const struct prov_wire_header whole = {
+	.var_offset = sizeof(union prov_elt),
+};
+
+/*
+ * A node whose bytes between its variable-length field and its tail are not
+ * transmitted (e.g., a path).
+ */
+static const struct prov_wire_header split = {
+	.var_offset = 96,
+	.var_length = 24,
+	.tail_offset = 200,
+	.tail_length = 16,
+};
+
+static void node(union prov_elt *elt, uint64_t id, uint64_t ts, uint64_t seq,
+		 const struct prov_wire_header *hdr)
+{
+	uint8_t *p = (uint8_t *)elt;
+	size_t i;
+
+	test_elt(elt, ENT_INODE_FILE, id, ts, seq);
+	elt->msg_info.epoch = 3;
+	elt->msg_info.jiffies = 123456789;
+	for (i = sizeof(struct msg_struct); i < sizeof(union prov_elt); i++) {
+		if (i < hdr->var_offset + hdr->var_length ||
+		    (i >= hdr->tail_offset &&
+		     i < hdr->tail_offset + hdr->tail_length))
+			p[i] = i * 7 + id;
+	}
+}
+
+static void relation(union prov_elt *elt, uint64_t type, uint64_t id,
+		     uint64_t ts, uint64_t seq, uint64_t snd, uint64_t rcv)
+{
+	test_elt(elt, type, id, ts, seq);
+	elt->relation_info.snd.node_id.type = ACT_TASK;
+	elt->relation_info.snd.node_id.id = snd;
+	elt->relation_info.snd.node_id.boot_id = BOOT_ID;
+	elt->relation_info.snd.node_id.machine_id = MACHINE_ID;
+	elt->relation_info.rcv.node_id.type = ENT_INODE_FILE;
+	elt->relation_info.rcv.node_id.id = rcv;
+	elt->relation_info.rcv.node_id.boot_id = BOOT_ID;
+	elt->relation_info.rcv.node_id.machine_id = MACHINE_ID;
+	elt->relation_info.allowed = 2;
+	elt->relation_info.set = FILE_INFO_SET;
+	elt->relation_info.offset = -4096;
+	elt->relation_info.task_id = snd;
+}
+
+/*
+ * Elements of a sub-buffer, in order: nodes with both layouts, relations, an
+ * aggregate, identifiers of another boot and of a packet, and an ABSOLUTE
+ * record that does not update the stream state.
+ */
+#define NR_ELTS 8
+
+static void elements(union prov_elt *elts, uint64_t base, int *absolute)
+{
+	unsigned int i;
+
+	node(&elts[0], base + 10, base + 1000, 1, &whole);
+	node(&elts[1], base + 12, base + 1010, 2, &split);
+	relation(&elts[2], RL_WRITE, base + 5, base + 1020, 3, base + 10,
+		 base + 12);
+	relation(&elts[3], RL_READ | RL_AGGREGATE, base + 6, base + 1030, 4,
+		 base + 10, base + 12);
+	elts[3].aggregate_info.count = 1000;
+	elts[3].aggregate_info.bytes = 1 << 20;
+	elts[3].aggregate_info.first = 1600000000000000000ULL;
+	elts[3].aggregate_info.last = 1600000000500000000ULL;
+	node(&elts[4], 3, base + 1040, 5, &whole);
+	elts[4].msg_info.identifier.node_id.boot_id = BOOT_ID + 1;
+	relation(&elts[5], RL_WRITE, base + 7, base + 1050, 6, base + 10, 3);
+	elts[5].relation_info.rcv.node_id.boot_id = BOOT_ID + 1;
+	node(&elts[6], base + 14, base + 1060, 7, &whole);
+	memset(&elts[6].msg_info.identifier, 0xab,
+	       sizeof(union prov_identifier));
+	elts[6].msg_info.identifier.node_id.type = ENT_PACKET;
+	// e.g., written back from the spill pool
+	node(&elts[7], base + 200, base + 1070, 8, &whole);
+	for (i = 0; i < NR_ELTS; i++)
+		absolute[i] = i == NR_ELTS - 1;
+}
+
+static const struct prov_wire_header *layout(unsigned int i)
+{
+	return i == 1 ? &split : &whole;
+}
+
+static void encode_subbuf(struct test_buf *out, const union prov_elt *elts,
+			  const int *absolute)
+{
+	struct prov_compact_stream s;
+	unsigned int i;
+
+	subbuf(out, &s);
+	for (i = 0; i < NR_ELTS; i++)
+		encode(out, &elts[i], layout(i), absolute[i] ? NULL : &s);
+}
+
+static void test_decode(void)
+{
+	union prov_elt elts[NR_ELTS];
+	struct prov_compact_stream stream, next;
+	struct test_buf buf = { 0 };
+	prov_entry_t out;
+	size_t pos = 0, i, n = 0;
+	int absolute[NR_ELTS], decoded, rc;
+
+	elements(elts, 0, absolute);
+	encode_subbuf(&buf, elts, absolute);
+	// relations are mostly identifiers, encoded as deltas
+	pos = buf.len;
+	next.relation_id = elts[2].msg_info.identifier.node_id.id - 1;
+	next.node_id = elts[2].relation_info.snd.node_id.id;
+	next.ts = elts[2].msg_info.ts - 10;
+	next.seq = elts[2].msg_info.seq - 1;
+	next.machine_id = MACHINE_ID;
+	next.boot_id = BOOT_ID;
+	encode(&buf, &elts[2], NULL, &next);
+	CHECK(buf.len - pos < sizeof(struct relation_struct) / 3);
+	buf.len = pos;
+	pos = 0;
+
+	memset(&stream, 0xff, sizeof(stream));
+	while (pos < buf.len) {
+		next = stream;
+		rc = prov_compact_decode(buf.data + pos, buf.len - pos, &next,
+					 &out, &decoded);
+		CHECK(rc > 0);
+		if (rc <= 0)
+			break;
+		// any prefix of a record is incomplete, not corrupted
+		for (i = 1; i < (size_t)rc; i++) {
+			CHECK(prov_compact_decode(buf.data + pos, i, &stream,
+						  &out, &decoded) == 0);
+		}
+		rc = prov_compact_decode(buf.data + pos, buf.len - pos, &stream,
+					 &out, &decoded);
+		CHECK(!memcmp(&stream, &next, sizeof(stream)));
+		pos += rc;
+		if (!decoded) {
+			CHECK(stream.machine_id == MACHINE_ID);
+			CHECK(stream.boot_id == BOOT_ID);
+			continue;
+		}
+		CHECK(n < NR_ELTS);
+		if (n >= NR_ELTS)
+			break;
+		CHECK(!memcmp(&out, &elts[n], sizeof(union prov_elt)));
+		n++;
+	}
+	CHECK(n == NR_ELTS);
+	// the ABSOLUTE record left the deltas alone
+	CHECK(stream.ts == elts[NR_ELTS - 2].msg_info.ts);
+	CHECK(stream.seq == elts[NR_ELTS - 2].msg_info.seq);
+	free(buf.data);
+}
+
+/* Headers of an unknown kind or size, and truncated content. */
+static void test_corrupted(void)
+{
+	union prov_elt elts[NR_ELTS];
+	struct prov_compact_stream stream = { 0 };
+	struct prov_compact_header h;
+	struct test_buf buf = { 0 };
+	prov_entry_t out;
+	int absolute[NR_ELTS], decoded;
+
+	elements(elts, 0, absolute);
+	encode(&buf, &elts[2], NULL, NULL);
+	memcpy(&h, buf.data, sizeof(h));
+
+	h.kind = 3;
+	memcpy(buf.data, &h, sizeof(h));
+	CHECK(prov_compact_decode(buf.data, buf.len, &stream, &out,
+				  &decoded) < 0);
+	h.kind = PROV_COMPACT_RELATION;
+	h.size = 2;
+	memcpy(buf.data, &h, sizeof(h));
+	CHECK(prov_compact_decode(buf.data, buf.len, &stream, &out,
+				  &decoded) < 0);
+	// a record shorter than its content
+	h.size = buf.len - 4;
+	memcpy(buf.data, &h, sizeof(h));
+	CHECK(prov_compact_decode(buf.data, buf.len, &stream, &out,
+				  &decoded) < 0);
+	free(buf.data);
+}
+
+static int by_ts(const void *a, const void *b)
+{
+	const union prov_elt *x = a, *y = b;
+
+	return x->msg_info.ts < y->msg_info.ts ? -1 :
+	       x->msg_info.ts > y->msg_info.ts;
+}
+
+/*
+ * prov_merge decodes the compact sub-buffers of a file, found at markers or
+ * with -c, and merges their elements with the fixed records of other files.
+ */
+static void test_merge(void)
+{
+	union prov_elt elts[2 * NR_ELTS + 4];
+	struct test_buf files[2] = { { 0 } }, out = { 0 };
+	char *names[2], cmd[256];
+	int absolute[NR_ELTS];
+	unsigned int i;
+
+	elements(elts, 0, absolute);
+	elements(elts + NR_ELTS, 100, absolute);
+	for (i = 0; i < 2; i++) {
+		test_marker(&files[0], PROV_WIRE_COMPACT);
+		encode_subbuf(&files[0], elts + i * NR_ELTS, absolute);
+	}
+	for (i = 2 * NR_ELTS; i < 2 * NR_ELTS + 4; i++) {
+		node(&elts[i], 500 + i, 1005 + 100 * (i - 2 * NR_ELTS), i,
+		     &whole);
+		test_append(&files[1], &elts[i], sizeof(union prov_elt));
+	}
+	names[0] = test_file(&files[0]);
+	names[1] = test_file(&files[1]);
+
+	// the output starts in PROV_WIRE_FIXED format, no marker is written
+	snprintf(cmd, sizeof(cmd), "./prov_merge -c %s", names[0]);
+	CHECK(test_run(cmd, &out) == 0);
+	CHECK(out.len == sizeof(union prov_elt) * 2 * NR_ELTS);
+	CHECK(out.len == sizeof(union prov_elt) * 2 * NR_ELTS &&
+	      !memcmp(out.data, elts, out.len));
+
+	// the first marker gives the format without -c
+	snprintf(cmd, sizeof(cmd), "./prov_merge %s %s", names[0], names[1]);
+	CHECK(test_run(cmd, &out) == 0);
+	qsort(elts, 2 * NR_ELTS + 4, sizeof(union prov_elt), by_ts);
+	CHECK(out.len == sizeof(elts) && !memcmp(out.data, elts, out.len));
+
+	for (i = 0; i < 2; i++) {
+		unlink(names[i]);
+		free(names[i]);
+		free(files[i].data);
+	}
+	free(out.data);
+}
+
+int main(void)
+{
+	test_decode();
+	test_corrupted();
+	test_merge();
+	return test_done("compact_test");
+}
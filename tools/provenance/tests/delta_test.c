@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * Rebuilding node versions from node deltas with prov_delta_apply.
+ *
+ * Deltas are built as prov_delta_encode (security/provenance/delta.c) does.
+ */
+#include "test.h"
+
+#define NR_VERSIONS     6
+
+static uint64_t *words(union prov_elt *node)
+{
+	return (uint64_t *)((uint8_t *)node + sizeof(struct msg_struct));
+}
+
+/* Returns 0 if too many words changed for a delta. */
+static int delta_encode(const union prov_elt *base, const union prov_elt *node,
+			union prov_elt *delta)
+{
+	const uint64_t *from = words((union prov_elt *)base);
+	const uint64_t *to = words((union prov_elt *)node);
+	uint32_t mask = 0;
+	unsigned int i, n = 0;
+
+	memset(delta, 0, sizeof(union prov_elt));
+	for (i = 0; i < PROV_DELTA_SPAN; i++) {
+		if (to[i] == from[i])
+			continue;
+		if (n == PROV_DELTA_WORDS)
+			return 0;
+		mask |= 1U << i;
+		delta->delta_info.words[n++] = to[i];
+	}
+	memcpy(delta, node, sizeof(struct msg_struct));
+	prov_type(delta) |= ND_DELTA;
+	delta->delta_info.base_version = base->msg_info.identifier.node_id.version;
+	delta->delta_info.mask = mask;
+	return 1;
+}
+
+static void version(union prov_elt *node, uint32_t v)
+{
+	node->msg_info.identifier.node_id.version = v;
+	node->msg_info.ts += 100;
+	node->msg_info.seq++;
+}
+
+static void test_layout(void)
+{
+	// mask has a bit per word, and a delta fits in an element
+	CHECK(PROV_DELTA_SPAN <= 32);
+	CHECK(sizeof(struct node_delta_struct) <= sizeof(union prov_elt));
+	CHECK(PROV_DELTA_WORDS < PROV_DELTA_SPAN);
+}
+
+/*
+ * A chain of versions, each written as a delta against the previous one,
+ * is rebuilt from the first version: words changing in the first, last and
+ * middle positions, no word changing, and the most words a delta carries.
+ */
+static void test_chain(void)
+{
+	union prov_elt versions[NR_VERSIONS], delta, node;
+	unsigned int v, i;
+
+	test_elt(&versions[0], ENT_INODE_FILE, 7, 1000, 1);
+	for (i = 0; i < PROV_DELTA_SPAN; i++)
+		words(&versions[0])[i] = 0x0101010101010101ULL * i;
+	for (v = 1; v < NR_VERSIONS; v++) {
+		versions[v] = versions[v - 1];
+		version(&versions[v], v + 1);
+	}
+	words(&versions[1])[0] = 1;
+	words(&versions[1])[PROV_DELTA_SPAN - 1] = 2;
+	for (v = 2; v < NR_VERSIONS; v++) {
+		words(&versions[v])[0] = 1;
+		words(&versions[v])[PROV_DELTA_SPAN - 1] = 2;
+		words(&versions[v])[PROV_DELTA_SPAN / 2] ^= 0xff;
+	}
+	for (v = 4; v < NR_VERSIONS; v++) {
+		for (i = 0; i < PROV_DELTA_WORDS; i++)
+			words(&versions[v])[PROV_DELTA_SPAN - 1 - i] += 3;
+	}
+	for (i = 0; i < PROV_DELTA_WORDS; i++)
+		words(&versions[5])[i] += 5;
+
+	node = versions[0];
+	for (v = 1; v < NR_VERSIONS; v++) {
+		CHECK(delta_encode(&versions[v - 1], &versions[v], &delta));
+		CHECK(prov_type_is_delta(prov_type(&delta)));
+		CHECK(delta.delta_info.base_version ==
+		      node.msg_info.identifier.node_id.version);
+		prov_delta_apply(&delta.delta_info, &node);
+		CHECK(!prov_type_is_delta(prov_type(&node)));
+		CHECK(!memcmp(&node, &versions[v], sizeof(union prov_elt)));
+	}
+	// version 4 only changed its basic elements
+	CHECK(delta_encode(&versions[2], &versions[3], &delta));
+	CHECK(delta.delta_info.mask == 0);
+}
+
+/* Deltas are not written when more words changed than they can carry. */
+static void test_too_many(void)
+{
+	union prov_elt base, node, delta;
+	unsigned int i;
+
+	test_elt(&base, ENT_INODE_FILE, 7, 1000, 1);
+	node = base;
+	version(&node, 2);
+	for (i = 0; i <= PROV_DELTA_WORDS; i++)
+		words(&node)[i] = ~0ULL;
+	CHECK(!delta_encode(&base, &node, &delta));
+}
+
+int main(void)
+{
+	test_layout();
+	test_chain();
+	test_too_many();
+	return test_done("delta_test");
+}
@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * Round trip of sub-buffers through prov_lz4_frame framing and prov_unlz4.
+ *
+ * The kernel compresses with LZ4_compress_default; blocks are produced here
+ * by a small greedy compressor following the LZ4 block format, and a block
+ * produced by the reference lz4 implementation checks the decoder against
+ * it.
+ */
+#include "test.h"
+
+#define HASH_BITS       12
+#define MIN_MATCH       4
+#define LAST_LITERALS   5
+#define MF_LIMIT        12
+
+/* compressed by lz4 1.9 */
+static const char reference_text[] =
+	"provenance provenance provenance relay relay relay "
+	"sub-buffer sub-buffer sub-buffer";
+static const uint8_t reference_block[] = {
+	0xbf, 0x70, 0x72, 0x6f, 0x76, 0x65, 0x6e, 0x61, 0x6e, 0x63, 0x65,
+	0x20, 0x0b, 0x00, 0x03, 0x59, 0x72, 0x65, 0x6c, 0x61, 0x79, 0x06,
+	0x00, 0xad, 0x73, 0x75, 0x62, 0x2d, 0x62, 0x75, 0x66, 0x66, 0x65,
+	0x72, 0x0b, 0x00, 0x50, 0x75, 0x66, 0x66, 0x65, 0x72,
+};
+
+static void lz4_length(struct test_buf *out, size_t length)
+{
+	uint8_t byte = 255;
+
+	for (; length >= 255; length -= 255)
+		test_append(out, &byte, 1);
+	byte = length;
+	test_append(out, &byte, 1);
+}
+
+static void lz4_sequence(struct test_buf *out, const uint8_t *literals,
+			 size_t nr_literals, size_t offset, size_t match)
+{
+	uint8_t token, le[2];
+
+	token = (nr_literals < 15 ? nr_literals : 15) << 4;
+	if (match)
+		token |= match - MIN_MATCH < 15 ? match - MIN_MATCH : 15;
+	test_append(out, &token, 1);
+	if (nr_literals >= 15)
+		lz4_length(out, nr_literals - 15);
+	test_append(out, literals, nr_literals);
+	if (!match)
+		return;
+	le[0] = offset & 0xff;
+	le[1] = offset >> 8;
+	test_append(out, le, 2);
+	if (match - MIN_MATCH >= 15)
+		lz4_length(out, match - MIN_MATCH - 15);
+}
+
+static void lz4_compress(const uint8_t *src, size_t len, struct test_buf *out)
+{
+	long table[1 << HASH_BITS];
+	size_t i = 0, anchor = 0, match;
+	uint32_t v, c;
+	long cand;
+
+	memset(table, 0xff, sizeof(table));
+	while (len >= MF_LIMIT && i + MF_LIMIT <= len) {
+		memcpy(&v, src + i, sizeof(v));
+		cand = table[(v * 2654435761U) >> (32 - HASH_BITS)];
+		table[(v * 2654435761U) >> (32 - HASH_BITS)] = i;
+		if (cand >= 0 && i - cand <= 0xffff) {
+			memcpy(&c, src + cand, sizeof(c));
+			if (c == v) {
+				match = MIN_MATCH;
+				while (i + match < len - LAST_LITERALS &&
+				       src[cand + match] == src[i + match])
+					match++;
+				lz4_sequence(out, src + anchor, i - anchor,
+					     i - cand, match);
+				i += match;
+				anchor = i;
+				continue;
+			}
+		}
+		i++;
+	}
+	lz4_sequence(out, src + anchor, len - anchor, 0, 0);
+}
+
+static void frame(struct test_buf *out, const void *src, size_t len)
+{
+	struct prov_lz4_frame f = { .magic = PROV_LZ4_MAGIC };
+	struct test_buf block = { 0 };
+
+	lz4_compress(src, len, &block);
+	f.compressed_size = block.len;
+	f.original_size = len;
+	test_append(out, &f, sizeof(f));
+	test_append(out, block.data, block.len);
+	free(block.data);
+}
+
+static int unlz4(const struct test_buf *in, struct test_buf *out)
+{
+	char *name = test_file(in), cmd[256];
+	int rc;
+
+	snprintf(cmd, sizeof(cmd), "./prov_unlz4 %s", name);
+	rc = test_run(cmd, out);
+	unlink(name);
+	free(name);
+	return rc;
+}
+
+static void test_reference(void)
+{
+	struct prov_lz4_frame f = {
+		.magic = PROV_LZ4_MAGIC,
+		.compressed_size = sizeof(reference_block),
+		.original_size = sizeof(reference_text) - 1,
+	};
+	struct test_buf in = { 0 }, out = { 0 };
+
+	test_append(&in, &f, sizeof(f));
+	test_append(&in, reference_block, sizeof(reference_block));
+	CHECK(unlz4(&in, &out) == 0);
+	CHECK(out.len == sizeof(reference_text) - 1);
+	CHECK(out.len == sizeof(reference_text) - 1 &&
+	      !memcmp(out.data, reference_text, out.len));
+	free(in.data);
+	free(out.data);
+}
+
+/*
+ * Sub-buffers of records, the second one starting with a marker as after a
+ * resize, and a sub-buffer of incompressible bytes, are decompressed in
+ * order; the result is a stream prov_merge reads.
+ */
+static void test_subbufs(void)
+{
+	struct test_buf subbuf = { 0 }, in = { 0 }, plain = { 0 };
+	struct test_buf out = { 0 }, records = { 0 };
+	union prov_elt elt;
+	uint64_t ts = 1000, seq = 1;
+	char *name, cmd[256];
+	unsigned int i, j;
+	uint8_t byte;
+
+	for (i = 0; i < 2; i++) {
+		subbuf.len = 0;
+		if (i == 1)
+			test_marker(&subbuf, PROV_WIRE_FIXED);
+		for (j = 0; j < 20; j++, ts += 10, seq++) {
+			test_elt(&elt, ENT_INODE_FILE, seq, ts, seq);
+			test_append(&subbuf, &elt, sizeof(elt));
+			test_append(&records, &elt, sizeof(elt));
+		}
+		frame(&in, subbuf.data, subbuf.len);
+		test_append(&plain, subbuf.data, subbuf.len);
+	}
+	// records repeat most of their bytes, matches were found
+	CHECK(in.len < plain.len / 2);
+	CHECK(unlz4(&in, &out) == 0);
+	CHECK(out.len == plain.len && !memcmp(out.data, plain.data, out.len));
+
+	name = test_file(&in);
+	snprintf(cmd, sizeof(cmd), "./prov_unlz4 %s | ./prov_merge /dev/stdin",
+		 name);
+	CHECK(test_run(cmd, &out) == 0);
+	CHECK(out.len == records.len &&
+	      !memcmp(out.data, records.data, out.len));
+	unlink(name);
+	free(name);
+
+	subbuf.len = 0;
+	srand(1);
+	for (j = 0; j < 1000; j++) {
+		byte = rand();
+		test_append(&subbuf, &byte, 1);
+	}
+	in.len = 0;
+	frame(&in, subbuf.data, subbuf.len);
+	CHECK(unlz4(&in, &out) == 0);
+	CHECK(out.len == subbuf.len &&
+	      !memcmp(out.data, subbuf.data, out.len));
+
+	free(subbuf.data);
+	free(in.data);
+	free(plain.data);
+	free(out.data);
+	free(records.data);
+}
+
+static void test_corrupted(void)
+{
+	struct test_buf in = { 0 }, out = { 0 };
+	struct prov_lz4_frame *f;
+	char text[] = "corrupted corrupted corrupted frames";
+
+	frame(&in, text, sizeof(text));
+	f = (struct prov_lz4_frame *)in.data;
+
+	f->original_size++;
+	CHECK(unlz4(&in, &out) != 0);
+	f->original_size--;
+	CHECK(unlz4(&in, &out) == 0);
+
+	f->magic = PROV_WIRE_MARKER_MAGIC;
+	CHECK(unlz4(&in, &out) != 0);
+	f->magic = PROV_LZ4_MAGIC;
+
+	in.len--;
+	CHECK(unlz4(&in, &out) != 0);
+
+	free(in.data);
+	free(out.data);
+}
+
+int main(void)
+{
+	test_reference();
+	test_subbufs();
+	test_corrupted();
+	return test_done("lz4_test");
+}
@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * Ordering of the records merged by prov_merge, format markers in its output,
+ * and removal of the copies written to several channels (-d).
+ */
+#include <stddef.h>
+#include "test.h"
+
+#define MAX_RECORDS     256
+
+struct record {
+	uint64_t ts;
+	uint64_t seq;
+	uint64_t id;
+	uint32_t format;
+};
+
+static void fixed(struct test_buf *b, uint64_t id, uint64_t ts, uint64_t seq)
+{
+	union prov_elt elt;
+
+	test_elt(&elt, ENT_INODE_FILE, id, ts, seq);
+	test_append(b, &elt, sizeof(elt));
+}
+
+/* A PROV_WIRE_VARLEN record only carrying the basic elements. */
+static void varlen(struct test_buf *b, uint64_t id, uint64_t ts, uint64_t seq)
+{
+	struct prov_wire_header hdr = {
+		.version = PROV_WIRE_VERSION,
+		.var_offset = sizeof(struct msg_struct),
+	};
+	uint8_t pad[PROV_WIRE_ALIGN] = { 0 };
+	union prov_elt elt;
+	size_t length = sizeof(hdr) + sizeof(struct msg_struct);
+
+	hdr.size = (length + PROV_WIRE_ALIGN - 1) & ~(PROV_WIRE_ALIGN - 1);
+	test_elt(&elt, ENT_INODE_FILE, id, ts, seq);
+	test_append(b, &hdr, sizeof(hdr));
+	test_append(b, &elt, sizeof(struct msg_struct));
+	test_append(b, pad, hdr.size - length);
+}
+
+/* Parse the output of prov_merge, return the number of records. */
+static unsigned int parse(const struct test_buf *out, struct record *records)
+{
+	struct prov_wire_marker marker;
+	struct prov_wire_header hdr;
+	struct msg_struct msg;
+	uint32_t format = PROV_WIRE_FIXED;
+	size_t pos = 0, length;
+	unsigned int n = 0;
+
+	while (pos < out->len && n < MAX_RECORDS) {
+		memcpy(&marker, out->data + pos, sizeof(marker));
+		if (marker.magic == PROV_WIRE_MARKER_MAGIC) {
+			// a marker always changes the format
+			CHECK(marker.format != format);
+			format = marker.format;
+			pos += sizeof(marker);
+			continue;
+		}
+		length = sizeof(union prov_elt);
+		if (format == PROV_WIRE_VARLEN) {
+			memcpy(&hdr, out->data + pos, sizeof(hdr));
+			length = hdr.size;
+			pos += sizeof(hdr);
+			length -= sizeof(hdr);
+		}
+		memcpy(&msg, out->data + pos, sizeof(msg));
+		records[n].ts = msg.ts;
+		records[n].seq = msg.seq;
+		records[n].id = msg.identifier.node_id.id;
+		records[n++].format = format;
+		pos += length;
+	}
+	CHECK(pos == out->len);
+	return n;
+}
+
+static unsigned int merge(const char *options, struct test_buf *files,
+			  unsigned int nr, struct record *records)
+{
+	struct test_buf out = { 0 };
+	char *names[8], cmd[512];
+	unsigned int i, n;
+	int len;
+
+	len = snprintf(cmd, sizeof(cmd), "./prov_merge %s", options);
+	for (i = 0; i < nr; i++) {
+		names[i] = test_file(&files[i]);
+		len += snprintf(cmd + len, sizeof(cmd) - len, " %s", names[i]);
+	}
+	CHECK(test_run(cmd, &out) == 0);
+	n = parse(&out, records);
+	for (i = 0; i < nr; i++) {
+		unlink(names[i]);
+		free(names[i]);
+	}
+	free(out.data);
+	return n;
+}
+
+static int ordered(const struct record *records, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 1; i < n; i++) {
+		if (records[i].ts < records[i - 1].ts)
+			return 0;
+		if (records[i].ts == records[i - 1].ts &&
+		    records[i].seq < records[i - 1].seq)
+			return 0;
+	}
+	return 1;
+}
+
+/* Per-CPU files with interleaved timestamps, some equal. */
+static void test_order(void)
+{
+	struct test_buf files[3] = { { 0 } };
+	struct record records[MAX_RECORDS];
+	unsigned int cpu, i, n;
+
+	for (cpu = 0; cpu < 3; cpu++) {
+		for (i = 0; i < 30; i++)
+			fixed(&files[cpu], cpu * 100 + i, 10 * i + 3 * cpu,
+			      i + 1);
+	}
+	// same ts as the previous record of the CPU
+	fixed(&files[1], 999, 10 * 29 + 3, 31);
+	n = merge("", files, 3, records);
+	CHECK(n == 91);
+	CHECK(ordered(records, n));
+	for (cpu = 0; cpu < 3; cpu++)
+		free(files[cpu].data);
+}
+
+/*
+ * Files switching format at markers: the output carries a marker whenever
+ * the format of the records written changes.
+ */
+static void test_markers(void)
+{
+	struct test_buf files[2] = { { 0 } };
+	struct record records[MAX_RECORDS];
+	unsigned int i, n, changes = 0;
+
+	for (i = 0; i < 10; i++)
+		fixed(&files[0], i, 10 * i, i + 1);
+	test_marker(&files[1], PROV_WIRE_VARLEN);
+	for (i = 0; i < 5; i++)
+		varlen(&files[1], 100 + i, 10 * i + 5, i + 1);
+	test_marker(&files[1], PROV_WIRE_FIXED);
+	for (i = 5; i < 10; i++)
+		fixed(&files[1], 100 + i, 10 * i + 5, i + 1);
+	n = merge("", files, 2, records);
+	CHECK(n == 20);
+	CHECK(ordered(records, n));
+	for (i = 0; i < n; i++) {
+		CHECK(records[i].format == (records[i].id >= 100 &&
+					    records[i].id < 105 ?
+					    PROV_WIRE_VARLEN :
+					    PROV_WIRE_FIXED));
+		if (i && records[i].format != records[i - 1].format)
+			changes++;
+	}
+	CHECK(changes == 10);
+
+	// files starting in PROV_WIRE_VARLEN format
+	free(files[0].data);
+	memset(&files[0], 0, sizeof(files[0]));
+	for (i = 0; i < 10; i++)
+		varlen(&files[0], i, 10 * i, i + 1);
+	n = merge("-v", files, 1, records);
+	CHECK(n == 10);
+	for (i = 0; i < n; i++)
+		CHECK(records[i].format == PROV_WIRE_VARLEN);
+	free(files[0].data);
+	free(files[1].data);
+}
+
+/*
+ * Copies in a fan-out channel share the (ts, seq) of the element; records of
+ * two CPUs may share a (ts, seq) too, and sort between copies.
+ */
+static void test_dedup(void)
+{
+	struct test_buf files[3] = { { 0 } };
+	struct record records[MAX_RECORDS];
+	unsigned int i, j, n;
+
+	for (i = 0; i < 10; i++) {
+		fixed(&files[0], i, 10 * i, i + 1);
+		if (i % 2)
+			fixed(&files[2], i, 10 * i, i + 1);
+	}
+	fixed(&files[1], 100, 30, 4);
+	fixed(&files[1], 101, 200, 1);
+
+	n = merge("", files, 3, records);
+	CHECK(n == 17);
+	CHECK(ordered(records, n));
+
+	n = merge("-d", files, 3, records);
+	CHECK(n == 12);
+	CHECK(ordered(records, n));
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++)
+			CHECK(records[i].id != records[j].id);
+	}
+	for (i = 0; i < 3; i++)
+		free(files[i].data);
+}
+
+int main(void)
+{
+	test_order();
+	test_markers();
+	test_dedup();
+	return test_done("merge_test");
+}
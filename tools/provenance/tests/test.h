@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * Helpers shared by the tests of the provenance userspace tools.
+ * Tests are run from tools/provenance by "make check", the tools they
+ * exercise are in the current directory.
+ */
+#ifndef _PROV_TEST_H
+#define _PROV_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <linux/provenance.h>
+
+static int test_failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+static inline int test_done(const char *name)
+{
+	if (test_failures) {
+		fprintf(stderr, "%s: %d check(s) failed.\n", name,
+			test_failures);
+		return EXIT_FAILURE;
+	}
+	printf("%s: ok\n", name);
+	return EXIT_SUCCESS;
+}
+
+struct test_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+static inline void test_append(struct test_buf *b, const void *src,
+			       size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+		if (!b->data)
+			exit(EXIT_FAILURE);
+	}
+	memcpy(b->data + b->len, src, len);
+	b->len += len;
+}
+
+static inline void test_marker(struct test_buf *b, uint32_t format)
+{
+	struct prov_wire_marker marker = {
+		.magic = PROV_WIRE_MARKER_MAGIC,
+		.format = format,
+	};
+
+	test_append(b, &marker, sizeof(marker));
+}
+
+/* Write a buffer to a new temporary file, whose name is returned. */
+static inline char *test_file(const struct test_buf *b)
+{
+	char *name = strdup("/tmp/prov_test_XXXXXX");
+	int fd;
+
+	if (!name)
+		exit(EXIT_FAILURE);
+	fd = mkstemp(name);
+	if (fd < 0 || write(fd, b->data, b->len) != (ssize_t)b->len) {
+		perror("test_file");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	return name;
+}
+
+/*
+ * Run a shell command with its stdout captured in out.
+ * Returns the exit status of the command.
+ */
+static inline int test_run(const char *cmd, struct test_buf *out)
+{
+	uint8_t chunk[4096];
+	size_t n;
+	FILE *p;
+	int status;
+
+	out->len = 0;
+	p = popen(cmd, "r");
+	if (!p) {
+		perror("test_run");
+		exit(EXIT_FAILURE);
+	}
+	while ((n = fread(chunk, 1, sizeof(chunk), p)) > 0)
+		test_append(out, chunk, n);
+	status = pclose(p);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* A node or relation with the given identity and ordering keys. */
+static inline void test_elt(union prov_elt *elt, uint64_t type, uint64_t id,
+			    uint64_t ts, uint64_t seq)
+{
+	memset(elt, 0, sizeof(union prov_elt));
+	elt->msg_info.identifier.node_id.type = type;
+	elt->msg_info.identifier.node_id.id = id;
+	elt->msg_info.identifier.node_id.boot_id = 1;
+	elt->msg_info.identifier.node_id.machine_id = 42;
+	elt->msg_info.identifier.node_id.version = 1;
+	elt->msg_info.ts = ts;
+	elt->msg_info.seq = seq;
+}
+
+#endif